@@ -1,101 +1,417 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Open addressing with linear probing and Robin Hood displacement: an entry
+// that is further from its home slot than the one occupying a slot takes it
+// over. This keeps probe sequences short and lets lookups stop as soon as they
+// meet an entry closer to home than the searched key would be. Removal uses
+// backward shifting, so there are no tombstones.
+//
+// The table grows when it gets more than 3/4 full and shrinks when it gets
+// less than 1/8 full, but never below MIN_CAPACITY slots. The first table of
+// MIN_CAPACITY slots lies in the same memory as the map, so a new map takes
+// one allocation (or none if it is created in caller's memory).
+//
+// Most maps are small, so the first table is not hashed. Its entries fill its
+// first slots, sorted by key, and lookups scan them comparing hashes. It is
+// left only when it is full and used again when the map shrinks to at most
+// MIN_CAPACITY / 2 entries, so maps around the limit do not switch tables on
+// every change. Iteration over a small map gives keys in order, so they do not
+// have to be sorted.
+//
+// Keys of at most INLINE_KEY_SIZE bytes (with the terminating null byte) are
+// stored in the slot itself, next to their hash and size, so a lookup compares
+// them without following a pointer. Longer keys are copied to the heap.
+//
+// Lookups may race with one modifying operation (see hmap_set_deferred_free).
+// Therefore, slots are written with atomic stores, everything before the key
+// size, and a table is published only after it is filled. Values and pointers
+// to long keys are stored with release and loaded with acquire, since a slot
+// may get them from another entry (shifted during insertion or removal) after
+// its key size was read. For the same reason an inline key may be a mix of two
+// keys, which is harmless, but a pointer to a long key is never read from bytes
+// of an inline one. A lookup reads the table pointer once, so it never mixes
+// capacity of one table with slots of another, and never probes more than
+// capacity slots. Everything it may dereference (the table and long keys) is
+// freed through deferred_free, except the first table, which is refilled
+// before it is published again and may meanwhile be read by lookups that
+// started before it was left.
+#define MIN_CAPACITY 4
 
-typedef struct Pair Pair;
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
 
-struct Pair {
-  char* key;
+typedef struct Slot Slot;
+
+#define INLINE_KEY_WORDS 3
+#define INLINE_KEY_SIZE (INLINE_KEY_WORDS * sizeof(uint64_t))
+
+struct Slot {
   void* value;
-  Pair* next; // Next item in a single-linked list.
+  unsigned int hash;     // Full hash of key, compared before the key itself.
+  unsigned int key_size; // Length of key + 1, 0 if the slot is empty.
+  char* long_key;        // Copy of key if it is not inline, otherwise NULL.
+  uint64_t inline_key[INLINE_KEY_WORDS]; // Key padded with zeros if it fits.
+};
+
+// Key searched for, with everything a lookup compares computed once.
+typedef struct Key {
+  const char* str;
+  unsigned int hash;
+  unsigned int size;
+  uint64_t words[INLINE_KEY_WORDS]; // Key padded with zeros if it fits.
+} Key;
+
+typedef struct Table Table;
+
+struct Table {
+  size_t capacity; // Always a power of two.
+  Slot slots[];
 };
 
 struct HashMap {
-  Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-  size_t size; // total number of entries in map.
+  Table* table;
+  size_t size; // Total number of entries in map.
+  void (*deferred_free)(void*);
+  Table first_table; // Has to be last, followed by its MIN_CAPACITY slots.
 };
 
-static unsigned int get_hash(const char* key);
+static unsigned int hash_string(const char* str, size_t* length);
+
+// Distance of an entry with hash `hash` stored in slot `i` from its home slot.
+static size_t probe_distance(Table* table, unsigned int hash, size_t i)
+{
+  return (i - (hash & (table->capacity - 1))) & (table->capacity - 1);
+}
+
+static Table* table_new(size_t capacity)
+{
+  Table* table = calloc(1, sizeof(Table) + capacity * sizeof(Slot));
+  if (table)
+    table->capacity = capacity;
+  return table;
+}
+
+static void slot_store(Slot* slot, Slot entry)
+{
+  STORE_RELEASE(slot->value, entry.value);
+  STORE(slot->hash, entry.hash);
+  STORE_RELEASE(slot->long_key, entry.long_key);
+  for (int w = 0; w < INLINE_KEY_WORDS; ++w)
+    STORE(slot->inline_key[w], entry.inline_key[w]);
+  STORE_RELEASE(slot->key_size, entry.key_size);
+}
+
+static void slot_clear(Slot* slot)
+{
+  STORE_RELEASE(slot->key_size, 0);
+  STORE(slot->value, NULL);
+  STORE(slot->long_key, NULL);
+}
+
+// Key stored in `slot`, which must not be modified concurrently.
+static char* slot_key(Slot* slot)
+{
+  return slot->long_key ? slot->long_key : (char*) slot->inline_key;
+}
+
+// Whether `slot` of a table possibly being modified holds `key`.
+static bool slot_holds(Slot* slot, unsigned int key_size, const Key* key)
+{
+  if (key_size != key->size)
+    return false;
+  const char* long_key = LOAD_ACQUIRE(slot->long_key);
+  // `long_key` may belong to another entry shifted into the slot after
+  // `key_size` was read, so it is not read past its terminating null byte.
+  if (long_key)
+    return strncmp(long_key, key->str, key->size - 1) == 0 && long_key[key->size - 1] == '\0';
+  if (key->size > INLINE_KEY_SIZE)
+    return false;
+  for (size_t w = 0; w * sizeof(uint64_t) < key->size; ++w) {
+    if (LOAD(slot->inline_key[w]) != key->words[w])
+      return false;
+  }
+  return true;
+}
+
+size_t hmap_memory_size()
+{
+  return sizeof(HashMap) + MIN_CAPACITY * sizeof(Slot);
+}
+
+HashMap* hmap_init(void* memory)
+{
+  HashMap* map = memory;
+  memset(map, 0, hmap_memory_size());
+  map->deferred_free = free;
+  map->first_table.capacity = MIN_CAPACITY;
+  map->table = &map->first_table;
+  return map;
+}
 
 HashMap* hmap_new()
 {
-  HashMap* map = malloc(sizeof(HashMap));
-  if (!map)
+  void* memory = malloc(hmap_memory_size());
+  if (!memory)
     return NULL;
-  memset(map, 0, sizeof(HashMap));
-  return map;
+  return hmap_init(memory);
+}
+
+void hmap_destroy(HashMap* map)
+{
+  for (size_t i = 0; i < map->table->capacity; ++i)
+    free(map->table->slots[i].long_key);
+  if (map->table != &map->first_table)
+    free(map->table);
 }
 
 void hmap_free(HashMap* map)
 {
-  for (int h = 0; h < N_BUCKETS; ++h) {
-    for (Pair* p = map->buckets[h]; p;) {
-      Pair* q = p;
-      p = p->next;
-      free(q->key);
-      free(q);
+  hmap_destroy(map);
+  free(map);
+}
+
+void hmap_set_deferred_free(HashMap* map, void (*deferred_free)(void*))
+{
+  map->deferred_free = deferred_free;
+}
+
+// Whether `table` is the first table of `map`, kept sorted instead of hashed.
+static bool is_sorted(HashMap* map, Table* table)
+{
+  return table == &map->first_table;
+}
+
+// Return index of the slot holding `key` in hashed `table`, or -1 if not
+// present. If found and `value` is not NULL, stores the value there.
+static ssize_t table_find(Table* table, const Key* key, void** value)
+{
+  size_t mask = table->capacity - 1;
+  size_t i = key->hash & mask;
+  for (size_t dist = 0; dist < table->capacity; ++dist) {
+    Slot* s = &table->slots[i];
+    unsigned int key_size = LOAD_ACQUIRE(s->key_size);
+    if (!key_size)
+      return -1;
+    unsigned int slot_hash = LOAD(s->hash);
+    if (probe_distance(table, slot_hash, i) < dist)
+      return -1;
+    if (slot_hash == key->hash && slot_holds(s, key_size, key)) {
+      if (value)
+        *value = LOAD_ACQUIRE(s->value);
+      return i;
     }
+    i = (i + 1) & mask;
   }
-  free(map);
+  return -1;
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// The same as `table_find`, for the sorted first table. Hashes of all slots
+// are compared without branching, as the position of the key is random, and
+// the slot found is checked after. Keys with equal hashes are rare, so the
+// following slots are checked only if it holds another key.
+static ssize_t sorted_find(Table* table, const Key* key, void** value)
 {
-  for (Pair* p = map->buckets[h]; p; p = p->next) {
-    if (strcmp(key, p->key) == 0)
-      return p;
+  ssize_t found = -1;
+  for (ssize_t i = MIN_CAPACITY - 1; i >= 0; --i)
+    found = LOAD(table->slots[i].hash) == key->hash ? i : found;
+  for (; found >= 0 && found < MIN_CAPACITY; ++found) {
+    Slot* s = &table->slots[found];
+    unsigned int key_size = LOAD_ACQUIRE(s->key_size);
+    if (key_size && LOAD(s->hash) == key->hash && slot_holds(s, key_size, key)) {
+      if (value)
+        *value = LOAD_ACQUIRE(s->value);
+      return found;
+    }
   }
-  return NULL;
+  return -1;
+}
+
+// Find `key` in `table` of `map`, the way the table is kept.
+static ssize_t map_find(HashMap* map, Table* table, const Key* key, void** value)
+{
+  if (is_sorted(map, table))
+    return sorted_find(table, key, value);
+  return table_find(table, key, value);
+}
+
+// Prepare `key` for comparisons with slots.
+static Key make_key(HashMapKey key)
+{
+  Key k = { key.str, key.hash, key.length + 1, { 0 } };
+  if (k.size <= INLINE_KEY_SIZE)
+    memcpy(k.words, key.str, key.length);
+  return k;
+}
+
+HashMapKey hmap_key(const char* str)
+{
+  HashMapKey key;
+  key.str = str;
+  key.hash = hash_string(str, &key.length);
+  return key;
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-  int h = get_hash(key);
-  Pair* p = hmap_find(map, h, key);
-  if (p)
-    return p->value;
-  else
-    return NULL;
+  return hmap_get_key(map, hmap_key(key));
+}
+
+void* hmap_get_key(HashMap* map, HashMapKey key)
+{
+  void* value = NULL;
+  Key k = make_key(key);
+  map_find(map, LOAD_ACQUIRE(map->table), &k, &value);
+  return value;
+}
+
+// Place an entry known to be absent, displacing richer entries on the way.
+static void table_place(Table* table, Slot entry)
+{
+  size_t mask = table->capacity - 1;
+  size_t i = entry.hash & mask;
+  size_t dist = 0;
+  while (table->slots[i].key_size) {
+    size_t existing_dist = probe_distance(table, table->slots[i].hash, i);
+    if (existing_dist < dist) {
+      Slot tmp = table->slots[i];
+      slot_store(&table->slots[i], entry);
+      entry = tmp;
+      dist = existing_dist;
+    }
+    i = (i + 1) & mask;
+    dist++;
+  }
+  slot_store(&table->slots[i], entry);
+}
+
+// Place an entry known to be absent in the sorted first table holding `size`
+// entries, shifting greater ones one slot further.
+static void sorted_place(Table* table, size_t size, Slot entry)
+{
+  const char* key = slot_key(&entry);
+  size_t i = size;
+  while (i > 0 && strcmp(slot_key(&table->slots[i - 1]), key) > 0) {
+    slot_store(&table->slots[i], table->slots[i - 1]);
+    i--;
+  }
+  slot_store(&table->slots[i], entry);
+}
+
+// Move all entries to a table of `capacity` slots, the first table for
+// MIN_CAPACITY. On allocation failure the map is left unchanged, which is fine
+// as resizing is only an optimization.
+static void hmap_resize(HashMap* map, size_t capacity)
+{
+  Table* old_table = map->table;
+  Table* table;
+  if (capacity == MIN_CAPACITY) {
+    // Slots still hold entries from before the map grew.
+    table = &map->first_table;
+    for (size_t i = 0; i < capacity; ++i)
+      slot_clear(&table->slots[i]);
+  } else {
+    table = table_new(capacity);
+    if (!table)
+      return;
+  }
+  size_t placed = 0;
+  for (size_t i = 0; i < old_table->capacity; ++i) {
+    if (!old_table->slots[i].key_size)
+      continue;
+    if (is_sorted(map, table))
+      sorted_place(table, placed++, old_table->slots[i]);
+    else
+      table_place(table, old_table->slots[i]);
+  }
+  STORE_RELEASE(map->table, table);
+  if (old_table != &map->first_table)
+    map->deferred_free(old_table);
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
+{
+  return hmap_insert_key(map, hmap_key(key), value);
+}
+
+bool hmap_insert_key(HashMap* map, HashMapKey key, void* value)
 {
   if (!value)
     return false;
-  int h = get_hash(key);
-  Pair* p = hmap_find(map, h, key);
-  if (p)
+  Key k = make_key(key);
+  if (map_find(map, map->table, &k, NULL) >= 0)
     return false; // Already exists.
-  Pair* new_p = malloc(sizeof(Pair));
-  new_p->key = strdup(key);
-  new_p->value = value;
-  new_p->next = map->buckets[h];
-  map->buckets[h] = new_p;
+  bool sorted = is_sorted(map, map->table);
+  if (sorted ? map->size == MIN_CAPACITY : (map->size + 1) * 4 > map->table->capacity * 3) {
+    hmap_resize(map, map->table->capacity * 2);
+    sorted = is_sorted(map, map->table);
+  }
+  if (sorted ? map->size == MIN_CAPACITY : map->size + 1 >= map->table->capacity)
+    return false; // Table is full and could not grow.
+  Slot entry = { value, k.hash, k.size, NULL, { 0 } };
+  if (k.size <= INLINE_KEY_SIZE) {
+    memcpy(entry.inline_key, k.words, sizeof(k.words));
+  } else {
+    entry.long_key = malloc(k.size);
+    if (!entry.long_key)
+      return false;
+    memcpy(entry.long_key, key.str, key.length);
+    entry.long_key[key.length] = '\0';
+  }
+  if (sorted)
+    sorted_place(map->table, map->size, entry);
+  else
+    table_place(map->table, entry);
   map->size++;
   return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-  int h = get_hash(key);
-  Pair** pp = &(map->buckets[h]);
-  while (*pp) {
-    Pair* p = *pp;
-    if (strcmp(key, p->key) == 0) {
-      *pp = p->next;
-      free(p->key);
-      free(p);
-      map->size--;
-      return true;
+  return hmap_remove_key(map, hmap_key(key));
+}
+
+bool hmap_remove_key(HashMap* map, HashMapKey key)
+{
+  Table* table = map->table;
+  Key k = make_key(key);
+  ssize_t found = map_find(map, table, &k, NULL);
+  if (found < 0)
+    return false;
+  char* removed_key = table->slots[found].long_key;
+
+  size_t i = found;
+  if (is_sorted(map, table)) {
+    // Shift greater entries back.
+    for (; i + 1 < map->size; ++i)
+      slot_store(&table->slots[i], table->slots[i + 1]);
+  } else {
+    // Shift following entries back until one is empty or already at home.
+    size_t mask = table->capacity - 1;
+    size_t next = (i + 1) & mask;
+    while (table->slots[next].key_size && probe_distance(table, table->slots[next].hash, next) > 0) {
+      slot_store(&table->slots[i], table->slots[next]);
+      i = next;
+      next = (next + 1) & mask;
     }
-    pp = &(p->next);
   }
-  return false;
+  slot_clear(&table->slots[i]);
+  if (removed_key)
+    map->deferred_free(removed_key);
+  map->size--;
+
+  // The first table is used again only when half full at most.
+  size_t shrink_below = table->capacity == 2 * MIN_CAPACITY ? MIN_CAPACITY / 2 + 1
+                                                             : table->capacity / 8;
+  if (table->capacity > MIN_CAPACITY && map->size < shrink_below)
+    hmap_resize(map, table->capacity / 2);
+  return true;
 }
 
 size_t hmap_size(HashMap* map)
@@ -103,32 +419,92 @@ size_t hmap_size(HashMap* map)
   return map->size;
 }
 
+bool hmap_is_sorted(HashMap* map)
+{
+  return is_sorted(map, map->table);
+}
+
 HashMapIterator hmap_iterator(HashMap* map)
 {
-  HashMapIterator it = { 0, map->buckets[0] };
+  (void) map;
+  HashMapIterator it = { 0 };
   return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-  Pair* p = it->pair;
-  while (!p && it->bucket < N_BUCKETS - 1) {
-    p = map->buckets[++it->bucket];
-  }
-  if (!p)
+  Table* table = map->table;
+  while (it->slot < table->capacity && !table->slots[it->slot].key_size)
+    it->slot++;
+  if (it->slot >= table->capacity)
     return false;
-  *key = p->key;
-  *value = p->value;
-  it->pair = p->next;
+  *key = slot_key(&table->slots[it->slot]);
+  *value = table->slots[it->slot].value;
+  it->slot++;
   return true;
 }
 
-static unsigned int get_hash(const char* key)
+// Hashing follows wyhash: the key is read 8 bytes at a time (short keys in
+// overlapping pieces) and mixed with 64x64->128-bit multiplications, so every
+// bit of the key affects every bit of the hash, including the low ones picking
+// slots, and similar names do not collide in them.
+static const uint64_t SECRET[4] = {
+  0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static uint64_t read64(const unsigned char* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t read32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Multiply `a` and `b` and fold the 128-bit product.
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+  __uint128_t product = (__uint128_t) a * b;
+  return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+unsigned int hmap_hash(const char* str, size_t length)
 {
-  unsigned int hash = 17;
-  while (*key) {
-    hash = (hash << 3) + hash + *key;
-    ++key;
+  const unsigned char* p = (const unsigned char*) str;
+  uint64_t seed = mix(SECRET[0] ^ length, SECRET[1]);
+  uint64_t a = 0, b = 0;
+  if (length <= 16) {
+    if (length >= 4) {
+      size_t middle = (length >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+    } else if (length > 0) {
+      a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+    }
+  } else {
+    size_t left = length;
+    while (left > 16) {
+      seed = mix(read64(p) ^ SECRET[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    // The last 16 bytes, overlapping ones already mixed if needed.
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
   }
-  return hash % N_BUCKETS;
-}
\ No newline at end of file
+  __uint128_t product = (__uint128_t) (a ^ SECRET[1]) * (b ^ seed);
+  uint64_t hash = mix((uint64_t) product ^ SECRET[0] ^ length, (uint64_t) (product >> 64) ^ SECRET[1]);
+  return (unsigned int) (hash ^ (hash >> 32));
+}
+
+// Hash of null-terminated `str`, storing its length in `*length`.
+static unsigned int hash_string(const char* str, size_t* length)
+{
+  *length = strlen(str);
+  return hmap_hash(str, *length);
+}
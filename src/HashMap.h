@@ -14,9 +14,47 @@ HashMap* hmap_new();
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Return the number of bytes of memory `hmap_init` needs.
+size_t hmap_memory_size();
+
+// Create a new, empty map in `memory` of `hmap_memory_size()` bytes, aligned
+// for any type, and return a pointer to it.
+HashMap* hmap_init(void* memory);
+
+// Clear a map created by `hmap_init` and free its memory, except `memory`
+// given to `hmap_init`, which the caller frees when it wants to.
+void hmap_destroy(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
 void* hmap_get(HashMap* map, const char* key);
 
+// A key with its hash computed in advance: the first `length` characters of
+// `str`, which does not have to be null-terminated there.
+typedef struct HashMapKey {
+  const char* str;
+  size_t length;
+  unsigned int hash; // Equal to hmap_hash(str, length).
+} HashMapKey;
+
+// Return the hash of the first `length` characters of `str`.
+unsigned int hmap_hash(const char* str, size_t length);
+
+// Return the key equal to null-terminated `str`.
+HashMapKey hmap_key(const char* str);
+
+// The same as `hmap_get`, `hmap_insert` and `hmap_remove`, for prepared keys.
+void* hmap_get_key(HashMap* map, HashMapKey key);
+bool hmap_insert_key(HashMap* map, HashMapKey key, void* value);
+bool hmap_remove_key(HashMap* map, HashMapKey key);
+
+// Make `deferred_free` responsible for freeing memory that a concurrent
+// hmap_get may still read (removed keys and tables replaced when resizing).
+// If it delays freeing until such readers finish, hmap_get may run
+// concurrently with one modifying operation (hmap_insert/hmap_remove). Such
+// hmap_get never crashes, but its result is reliable only if the map did not
+// change during the call, which the caller has to verify by other means.
+void hmap_set_deferred_free(HashMap* map, void (*deferred_free)(void*));
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
@@ -30,6 +68,10 @@ bool hmap_remove(HashMap* map, const char* key);
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return true if `hmap_next` gives keys in `strcmp` order, which it does for
+// maps of a few elements, kept in a sorted array.
+bool hmap_is_sorted(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -52,6 +94,5 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-  int bucket;
-  void* pair;
-};
\ No newline at end of file
+  size_t slot; // Index of the next slot to inspect.
+};
@@ -0,0 +1,630 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Journal.h"
+#include "err.h"
+#include "path_utils.h"
+#include "safe_alloc.h"
+
+// A journal file consists of JournalHeader and records, each made of:
+//  - u16 length of the payload and u32 hmap_hash of the payload,
+//  - payload: u8 type, varint parent, u8 length of name, name and, for
+//    JOURNAL_MOVE, varint target parent, u8 length of target name, target name.
+// Numbers are stored in native byte order, which is checked when opening.
+// The file of the previous generation is kept as "[path].[generation].journal"
+// while a checkpoint is being made, and the file of the next one is prepared
+// as "[path].next".
+
+#define JOURNAL_MAGIC "FOLDJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BYTE_ORDER 0x01020304
+
+#define RECORD_HEADER_SIZE 6
+#define MAX_VARINT_SIZE 10
+#define MAX_RECORD_SIZE (RECORD_HEADER_SIZE + 1 + 2 * (MAX_VARINT_SIZE + 1 + MAX_FOLDER_NAME_LENGTH))
+
+// Size of records buffered by threads that do not wait for them to be synced
+// (TREE_DURABILITY_NONE), above which one of them writes them.
+#define WRITE_THRESHOLD (64 * 1024)
+
+typedef struct JournalHeader {
+  char magic[8];          // JOURNAL_MAGIC without the terminating null byte
+  uint32_t version;       // JOURNAL_VERSION
+  uint32_t byte_order;    // JOURNAL_BYTE_ORDER as written by the writing machine
+  uint64_t generation;
+  uint64_t next_id;       // identifier of the folder created by the first record
+} JournalHeader;
+
+struct Journal {
+  char* path;
+  int fd;                 // positioned at the end of the written records
+  TreeDurability durability;
+  uint64_t generation;
+  pthread_mutex_t lock;   // protects the fields below
+  pthread_cond_t written; // signalled when a thread finishes writing
+  uint64_t next_id;
+  char* buffer;           // records appended, but not written yet
+  size_t size;
+  size_t capacity;
+  char* spare;            // buffer given to the writing thread
+  size_t spare_capacity;
+  uint64_t appended;      // number of bytes of records appended so far
+  uint64_t durable;       // of them written (and synced, unless durability
+                          // is TREE_DURABILITY_NONE)
+  uint64_t start;         // of them appended before the current file
+  bool writing;           // true while some thread writes records
+  int next_fd;            // file prepared by journal_prepare_restart, -1 if
+                          // there is none
+  // Records appended before journal_cut, which journal_finish_cut writes to
+  // the old file before any record appended after them is written.
+  int cut_fd;             // old file, -1 if no cut is being finished
+  char* cut_records;
+  size_t cut_size;
+  size_t cut_capacity;
+  uint64_t cut_end;       // [appended] at the cut
+  uint64_t cut_next_id;
+};
+
+// Journal calling thread has last appended to and the number of its bytes
+// appended by then, which the thread waits for when committing.
+static _Thread_local Journal* last_journal = NULL;
+static _Thread_local uint64_t last_end = 0;
+
+// Journal calling thread has last appended to, reset by journal_last_size, and
+// size of its current file by then.
+static _Thread_local Journal* sized_journal = NULL;
+static _Thread_local uint64_t last_size = 0;
+
+static void lock(Journal* journal) {
+  if (pthread_mutex_lock(&journal->lock) != 0)
+    fatal("lock failed");
+}
+
+static void unlock(Journal* journal) {
+  if (pthread_mutex_unlock(&journal->lock) != 0)
+    fatal("unlock failed");
+}
+
+static size_t put_varint(char* out, uint64_t value) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (char) (value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (char) value;
+  return size;
+}
+
+// Reads varint at [*in] before [end] into [*value] and moves [*in] past it.
+// Returns false if it is malformed.
+static bool get_varint(const char** in, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 7 * MAX_VARINT_SIZE && *in < end; shift += 7) {
+    unsigned char byte = (unsigned char) *(*in)++;
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if (byte < 0x80) return true;
+  }
+  return false;
+}
+
+static size_t put_name(char* out, HashMapKey name) {
+  out[0] = (char) name.length;
+  memcpy(out + 1, name.str, name.length);
+  return name.length + 1;
+}
+
+static bool get_name(const char** in, const char* end, HashMapKey* name) {
+  if (*in == end) return false;
+  name->length = (unsigned char) *(*in)++;
+  if (name->length == 0 || name->length > end - *in) return false;
+  name->str = *in;
+  name->hash = hmap_hash(name->str, name->length);
+  *in += name->length;
+  return true;
+}
+
+// Writes [record] with its header to [out]. Returns its size.
+static size_t encode_record(const JournalRecord* record, char* out) {
+  char* payload = out + RECORD_HEADER_SIZE;
+  size_t size = 0;
+  payload[size++] = (char) record->type;
+  size += put_varint(payload + size, record->parent);
+  size += put_name(payload + size, record->name);
+  if (record->type == JOURNAL_MOVE) {
+    size += put_varint(payload + size, record->target_parent);
+    size += put_name(payload + size, record->target_name);
+  }
+
+  uint16_t payload_size = size;
+  uint32_t checksum = hmap_hash(payload, size);
+  memcpy(out, &payload_size, sizeof(payload_size));
+  memcpy(out + sizeof(payload_size), &checksum, sizeof(checksum));
+  return RECORD_HEADER_SIZE + size;
+}
+
+// Reads [record] from [payload] of [size]. Returns false if it is malformed.
+static bool decode_record(const char* payload, size_t size, JournalRecord* record) {
+  const char* end = payload + size;
+  record->type = (JournalRecordType) (unsigned char) *payload++;
+  if (record->type > JOURNAL_REMOVE_RECURSIVE) return false;
+  if (!get_varint(&payload, end, &record->parent) || !get_name(&payload, end, &record->name))
+    return false;
+  if (record->type == JOURNAL_MOVE &&
+      (!get_varint(&payload, end, &record->target_parent) ||
+       !get_name(&payload, end, &record->target_name)))
+    return false;
+  return payload == end;
+}
+
+static int write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int journal_sync_directory(const char* path) {
+  const char* slash = strrchr(path, '/');
+  size_t length = slash == NULL ? 1 : slash == path ? 1 : slash - path;
+  char* directory = (char*) safe_malloc(length + 1);
+  memcpy(directory, slash == NULL ? "." : path, length);
+  directory[length] = '\0';
+
+  int error = 0;
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) != 0)
+    error = errno;
+  if (fd >= 0) close(fd);
+  free(directory);
+  return error;
+}
+
+// Returns [path] followed by [suffix].
+static char* add_suffix(const char* path, const char* suffix) {
+  size_t path_length = strlen(path);
+  size_t suffix_length = strlen(suffix);
+  char* result = (char*) safe_malloc(path_length + suffix_length + 1);
+  memcpy(result, path, path_length);
+  memcpy(result + path_length, suffix, suffix_length + 1);
+  return result;
+}
+
+char* journal_kept_path(const char* path, uint64_t generation) {
+  size_t size = strlen(path) + 30;
+  char* result = (char*) safe_malloc(size);
+  snprintf(result, size, "%s.%llu.journal", path, (unsigned long long) generation);
+  return result;
+}
+
+static void fill_header(JournalHeader* header, uint64_t generation, uint64_t next_id) {
+  memset(header, 0, sizeof(JournalHeader));
+  memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+  header->version = JOURNAL_VERSION;
+  header->byte_order = JOURNAL_BYTE_ORDER;
+  header->generation = generation;
+  header->next_id = next_id;
+}
+
+// Reads header of journal file [fd] into [*header]. Returns 0, EINVAL if it is
+// not a journal or the error of a failed read.
+static int read_header(int fd, JournalHeader* header) {
+  ssize_t size = pread(fd, header, sizeof(JournalHeader), 0);
+  if (size < 0) return errno;
+  if (size != sizeof(JournalHeader) || memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != JOURNAL_VERSION || header->byte_order != JOURNAL_BYTE_ORDER)
+    return EINVAL;
+  return 0;
+}
+
+// Creates file [path] holding an empty journal, not synced yet, and stores its
+// descriptor in [*fd]. Returns 0 or error code.
+static int open_empty(const char* path, uint64_t generation, uint64_t next_id, int* fd) {
+  JournalHeader header;
+  fill_header(&header, generation, next_id);
+  *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (*fd < 0) return errno;
+  int error = write_all(*fd, (const char*) &header, sizeof(header));
+  if (error != 0) {
+    close(*fd);
+    unlink(path);
+  }
+  return error;
+}
+
+// Replaces file [path] with an empty journal and stores its descriptor in
+// [*fd]. Returns 0 or error code.
+static int create_file(const char* path, uint64_t generation, uint64_t next_id, int* fd) {
+  // The file appears under [path] only when it is complete.
+  char* temporary_path = add_suffix(path, ".tmp");
+  int error = open_empty(temporary_path, generation, next_id, fd);
+  if (error != 0) {
+    free(temporary_path);
+    return error;
+  }
+  if (fsync(*fd) != 0)
+    error = errno;
+  if (error == 0 && rename(temporary_path, path) != 0)
+    error = errno;
+  if (error != 0) {
+    close(*fd);
+    unlink(temporary_path);
+  }
+  // Once renamed, the file is the journal, so it cannot be given up.
+  else if (journal_sync_directory(path) != 0) {
+    syserr("journal directory sync failed");
+  }
+
+  free(temporary_path);
+  return error;
+}
+
+Journal* journal_open(const char* path, TreeDurability durability) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0 && errno == ENOENT) {
+    int error = create_file(path, 0, 1, &fd);
+    if (error != 0) {
+      errno = error;
+      return NULL;
+    }
+  }
+  if (fd < 0) return NULL;
+
+  JournalHeader header;
+  int error = read_header(fd, &header);
+  if (error != 0) {
+    close(fd);
+    errno = error;
+    return NULL;
+  }
+
+  Journal* journal = (Journal*) safe_malloc(sizeof(Journal));
+  size_t path_length = strlen(path);
+  journal->path = (char*) safe_malloc(path_length + 1);
+  memcpy(journal->path, path, path_length + 1);
+  journal->fd = fd;
+  journal->durability = durability;
+  journal->generation = header.generation;
+  if (pthread_mutex_init(&journal->lock, 0) != 0)
+    fatal("mutex init failed");
+  if (pthread_cond_init(&journal->written, 0) != 0)
+    fatal("cond init failed");
+  journal->next_id = header.next_id;
+  journal->buffer = NULL;
+  journal->size = 0;
+  journal->capacity = 0;
+  journal->spare = NULL;
+  journal->spare_capacity = 0;
+  journal->appended = 0;
+  journal->durable = 0;
+  journal->start = 0;
+  journal->writing = false;
+  journal->next_fd = -1;
+  journal->cut_fd = -1;
+  journal->cut_records = NULL;
+  journal->cut_size = 0;
+  journal->cut_capacity = 0;
+  journal->cut_end = 0;
+  journal->cut_next_id = 0;
+
+  return journal;
+}
+
+uint64_t journal_generation(Journal* journal) {
+  return journal->generation;
+}
+
+const char* journal_path(Journal* journal) {
+  return journal->path;
+}
+
+// Calls [apply] on every record of journal file [fd] with [context], giving
+// created folders identifiers from [*next_id] up, and stores the size of the
+// applied records in [*end]. A torn record at the end is skipped. Returns the
+// same as journal_replay.
+static int replay_records(int fd, uint64_t* next_id,
+                          bool (*apply)(const JournalRecord* record, void* context),
+                          void* context, size_t* end) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return errno;
+  size_t size = st.st_size - sizeof(JournalHeader);
+  char* data = (char*) safe_malloc(size + 1);
+  size_t read_size = 0;
+  while (read_size < size) {
+    ssize_t result = pread(fd, data + read_size, size - read_size,
+                           sizeof(JournalHeader) + read_size);
+    if (result <= 0) {
+      int error = result < 0 ? errno : EIO;
+      free(data);
+      return error;
+    }
+    read_size += result;
+  }
+
+  int error = 0;
+  size_t offset = 0;
+  while (size - offset >= RECORD_HEADER_SIZE) {
+    uint16_t payload_size;
+    uint32_t checksum;
+    memcpy(&payload_size, data + offset, sizeof(payload_size));
+    memcpy(&checksum, data + offset + sizeof(payload_size), sizeof(checksum));
+    const char* payload = data + offset + RECORD_HEADER_SIZE;
+    // Everything from a torn record on is dropped.
+    if (payload_size == 0 || payload_size > size - offset - RECORD_HEADER_SIZE ||
+        hmap_hash(payload, payload_size) != checksum)
+      break;
+
+    JournalRecord record;
+    if (!decode_record(payload, payload_size, &record)) {
+      error = EINVAL;
+      break;
+    }
+    record.id = record.type == JOURNAL_CREATE ? (*next_id)++ : 0;
+    if (!apply(&record, context)) {
+      error = EINVAL;
+      break;
+    }
+    offset += RECORD_HEADER_SIZE + payload_size;
+  }
+  free(data);
+  *end = offset;
+  return error;
+}
+
+int journal_replay(Journal* journal, bool (*apply)(const JournalRecord* record, void* context),
+                   void* context) {
+  size_t size;
+  int error = replay_records(journal->fd, &journal->next_id, apply, context, &size);
+  if (error != 0) return error;
+
+  struct stat st;
+  if (fstat(journal->fd, &st) != 0) return errno;
+  off_t end = sizeof(JournalHeader) + size;
+  if (end < st.st_size && (ftruncate(journal->fd, end) != 0 || fsync(journal->fd) != 0))
+    return errno;
+  if (lseek(journal->fd, end, SEEK_SET) < 0)
+    return errno;
+  return 0;
+}
+
+int journal_replay_kept(const char* path, uint64_t generation,
+                        bool (*apply)(const JournalRecord* record, void* context), void* context) {
+  char* file_path = journal_kept_path(path, generation);
+  int fd = open(file_path, O_RDONLY);
+  free(file_path);
+  if (fd < 0) return errno;
+
+  JournalHeader header;
+  int error = read_header(fd, &header);
+  if (error == 0 && header.generation != generation)
+    error = EINVAL;
+  size_t size;
+  if (error == 0)
+    error = replay_records(fd, &header.next_id, apply, context, &size);
+  close(fd);
+  return error;
+}
+
+uint64_t journal_append(Journal* journal, const JournalRecord* record) {
+  char encoded[MAX_RECORD_SIZE];
+  size_t size = encode_record(record, encoded);
+
+  lock(journal);
+  if (journal->size + size > journal->capacity) {
+    journal->capacity = journal->capacity == 0 ? 4096 : 2 * journal->capacity;
+    if (journal->capacity < journal->size + size) journal->capacity = journal->size + size;
+    journal->buffer = (char*) safe_realloc(journal->buffer, journal->capacity);
+  }
+  memcpy(journal->buffer + journal->size, encoded, size);
+  journal->size += size;
+  journal->appended += size;
+  uint64_t id = record->type == JOURNAL_CREATE ? journal->next_id++ : 0;
+  last_journal = journal;
+  last_end = journal->appended;
+  sized_journal = journal;
+  last_size = journal->appended - journal->start;
+  unlock(journal);
+
+  return id;
+}
+
+// Writes all records appended so far and syncs them if [sync]. Calling thread
+// has to hold [journal]'s lock, which is released while writing, and no one
+// else can be writing.
+static void write_records(Journal* journal, bool sync) {
+  int fd = journal->fd;
+  char* data = journal->buffer;
+  size_t size = journal->size;
+  size_t capacity = journal->capacity;
+  uint64_t end = journal->appended;
+  journal->buffer = journal->spare;
+  journal->capacity = journal->spare_capacity;
+  journal->size = 0;
+  journal->writing = true;
+  unlock(journal);
+
+  // Records cannot be dropped once others have seen their changes.
+  if (write_all(fd, data, size) != 0)
+    syserr("journal write failed");
+  if (sync && fdatasync(fd) != 0)
+    syserr("journal sync failed");
+
+  lock(journal);
+  journal->spare = data;
+  journal->spare_capacity = capacity;
+  journal->durable = end;
+  journal->writing = false;
+  if (pthread_cond_broadcast(&journal->written) != 0)
+    fatal("cond broadcast failed");
+}
+
+// Returns true if some thread writes records of [journal] or they wait for a
+// cut to be finished. Calling thread has to hold [journal]'s lock.
+static bool is_busy(Journal* journal) {
+  return journal->writing || journal->cut_fd >= 0;
+}
+
+void journal_commit(Journal* journal, bool holding_locks) {
+  if (last_journal != journal) return;
+
+  bool wait;
+  switch (journal->durability) {
+    case TREE_DURABILITY_PER_OP:
+      wait = true;
+      break;
+    case TREE_DURABILITY_BATCHED:
+      wait = !holding_locks;
+      break;
+    default:
+      wait = false;
+      break;
+  }
+  if (holding_locks && !wait) return;
+
+  lock(journal);
+  if (!wait) {
+    if (!is_busy(journal) && journal->size >= WRITE_THRESHOLD)
+      write_records(journal, false);
+  }
+  else {
+    // Thread finding no one writing writes for everyone waiting, records
+    // appended while it writes are written by the next such thread.
+    while (journal->durable < last_end) {
+      if (is_busy(journal)) {
+        if (pthread_cond_wait(&journal->written, &journal->lock) != 0)
+          fatal("cond wait failed");
+      }
+      else {
+        write_records(journal, true);
+      }
+    }
+  }
+  unlock(journal);
+  last_journal = NULL;
+}
+
+void journal_flush(Journal* journal) {
+  lock(journal);
+  while (is_busy(journal)) {
+    if (pthread_cond_wait(&journal->written, &journal->lock) != 0)
+      fatal("cond wait failed");
+  }
+  // Records written earlier without syncing are synced too.
+  write_records(journal, true);
+  unlock(journal);
+}
+
+uint64_t journal_last_size(Journal* journal) {
+  if (sized_journal != journal) return 0;
+  sized_journal = NULL;
+  return last_size;
+}
+
+int journal_prepare_restart(Journal* journal) {
+  // A link left by a checkpoint that did not finish keeps the same journal.
+  char* old_path = journal_kept_path(journal->path, journal->generation);
+  unlink(old_path);
+  int error = 0;
+  if (link(journal->path, old_path) != 0)
+    error = errno;
+  // Recovery finds the old file under its new name only if the link is
+  // durable before the new file replaces it.
+  if (error == 0)
+    error = journal_sync_directory(journal->path);
+  char* next_path = add_suffix(journal->path, ".next");
+  if (error == 0)
+    error = open_empty(next_path, journal->generation + 1, 0, &journal->next_fd);
+  if (error != 0) {
+    unlink(old_path);
+    journal->next_fd = -1;
+  }
+  free(next_path);
+  free(old_path);
+  return error;
+}
+
+uint64_t journal_cut(Journal* journal) {
+  lock(journal);
+  // Records are swapped with the empty spare buffer of the cut.
+  journal->cut_fd = journal->fd;
+  char* records = journal->buffer;
+  size_t capacity = journal->capacity;
+  journal->cut_size = journal->size;
+  journal->buffer = journal->cut_records;
+  journal->capacity = journal->cut_capacity;
+  journal->size = 0;
+  journal->cut_records = records;
+  journal->cut_capacity = capacity;
+  journal->cut_end = journal->appended;
+  journal->cut_next_id = journal->next_id;
+  journal->start = journal->appended;
+  journal->fd = journal->next_fd;
+  journal->next_fd = -1;
+  journal->generation++;
+  unlock(journal);
+  return journal->cut_next_id;
+}
+
+void journal_finish_cut(Journal* journal) {
+  // A thread writing records before the cut writes them to the old file.
+  lock(journal);
+  while (journal->writing) {
+    if (pthread_cond_wait(&journal->written, &journal->lock) != 0)
+      fatal("cond wait failed");
+  }
+  unlock(journal);
+
+  // Records of the new file name folders created by the old one, so the old
+  // one has to be durable first. Others have seen changes of both, so neither
+  // can be given up.
+  if (write_all(journal->cut_fd, journal->cut_records, journal->cut_size) != 0)
+    syserr("journal write failed");
+  if (fdatasync(journal->cut_fd) != 0)
+    syserr("journal sync failed");
+  JournalHeader header;
+  fill_header(&header, journal->generation, journal->cut_next_id);
+  if (pwrite(journal->fd, &header, sizeof(header), 0) != sizeof(header))
+    syserr("journal write failed");
+  if (fsync(journal->fd) != 0)
+    syserr("journal sync failed");
+  char* next_path = add_suffix(journal->path, ".next");
+  if (rename(next_path, journal->path) != 0)
+    syserr("journal rename failed");
+  if (journal_sync_directory(journal->path) != 0)
+    syserr("journal directory sync failed");
+  free(next_path);
+  close(journal->cut_fd);
+
+  lock(journal);
+  journal->cut_fd = -1;
+  journal->cut_size = 0;
+  journal->durable = journal->cut_end;
+  if (pthread_cond_broadcast(&journal->written) != 0)
+    fatal("cond broadcast failed");
+  unlock(journal);
+}
+
+void journal_close(Journal* journal) {
+  journal_flush(journal);
+  close(journal->fd);
+  if (pthread_cond_destroy(&journal->written) != 0)
+    fatal("cond destroy failed");
+  if (pthread_mutex_destroy(&journal->lock) != 0)
+    fatal("mutex destroy failed");
+  free(journal->buffer);
+  free(journal->spare);
+  free(journal->cut_records);
+  free(journal->path);
+  free(journal);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HashMap.h"
+#include "Tree.h"
+
+// Append-only log of changes of a tree, written to a file. Folders are named
+// in records by identifiers (see node_get_id), so records of operations that
+// did not occupy the same node can be replayed in any order. Every record
+// carries its length and checksum, so a record torn by a crash is detected and
+// dropped, together with everything after it.
+//
+// A journal belongs to a generation: the number of the checkpoint its records
+// have to be replayed on. Records appended by concurrent threads are written
+// and synced together, by one of the threads waiting for them (group commit).
+// A checkpoint cuts the journal: records appended after the cut go to a new
+// file of the next generation, while the file of the previous one is kept
+// until the checkpoint is durable, so that recovery can replay both on the
+// previous checkpoint. All functions except journal_open, journal_replay,
+// journal_prepare_restart, journal_cut and journal_close can be called
+// concurrently.
+typedef struct Journal Journal;
+
+typedef enum JournalRecordType {
+  JOURNAL_CREATE, // [name] created in [parent], with the next identifier
+  JOURNAL_REMOVE, // [name] removed from [parent]
+  JOURNAL_MOVE,   // [name] in [parent] moved to [target_name] in [target_parent]
+  JOURNAL_REMOVE_RECURSIVE, // [name] removed from [parent] with its descendants
+} JournalRecordType;
+
+typedef struct JournalRecord {
+  JournalRecordType type;
+  uint64_t parent;
+  HashMapKey name;
+  uint64_t target_parent; // only for JOURNAL_MOVE
+  HashMapKey target_name; // only for JOURNAL_MOVE
+  uint64_t id;            // of the created folder, only for replayed JOURNAL_CREATE
+} JournalRecord;
+
+// Opens journal in file [path], creating an empty one of generation 0, whose
+// created folders get identifiers from 1 up, if it does not exist. Returns
+// NULL with errno set on failure, EINVAL if the file is not a journal.
+Journal* journal_open(const char* path, TreeDurability durability);
+
+// Returns generation of [journal].
+uint64_t journal_generation(Journal* journal);
+
+// Returns name of the file of [journal].
+const char* journal_path(Journal* journal);
+
+// Calls [apply] on every record of [journal] with [context], in order of
+// appending, and prepares [journal] for appending after them. A torn record at
+// the end is cut off. Returns 0 on success, EINVAL if [apply] returned false or
+// a record is malformed, or the error of a failed file operation.
+int journal_replay(Journal* journal, bool (*apply)(const JournalRecord* record, void* context),
+                   void* context);
+
+// Calls [apply] on every record of the journal of [generation] kept by
+// journal_prepare_restart for journal in file [path], as journal_replay does,
+// without changing the file. Returns the same as journal_replay, ENOENT if
+// there is no such journal.
+int journal_replay_kept(const char* path, uint64_t generation,
+                        bool (*apply)(const JournalRecord* record, void* context), void* context);
+
+// Returns name of the file keeping the journal of [generation] for journal in
+// file [path], to be freed by caller.
+char* journal_kept_path(const char* path, uint64_t generation);
+
+// Appends [record] and returns identifier of the created folder for
+// JOURNAL_CREATE, 0 otherwise. Calling thread has to occupy nodes of the
+// changed folders, so that records of the same folder are appended in order
+// of changes.
+uint64_t journal_append(Journal* journal, const JournalRecord* record);
+
+// Finishes appending records by calling thread, which occupies nodes of the
+// changed folders if [holding_locks]. Depending on durability, writes them and
+// waits until they are synced, either before calling thread leaves the nodes,
+// so that no one sees changes that could be lost (TREE_DURABILITY_PER_OP), or
+// after (TREE_DURABILITY_BATCHED).
+void journal_commit(Journal* journal, bool holding_locks);
+
+// Writes and syncs all records. No one can append concurrently.
+void journal_flush(Journal* journal);
+
+// Returns size of the records of the current generation of [journal] appended
+// by the last append of calling thread, or 0 if it has not appended to
+// [journal] since the last call.
+uint64_t journal_last_size(Journal* journal);
+
+// Prepares the cut of [journal]: keeps its file under another name too and
+// creates the empty file of the next generation, not under [journal]'s name
+// yet. Returns 0 or the error of a failed file operation, leaving [journal]
+// unchanged.
+int journal_prepare_restart(Journal* journal);
+
+// Makes records appended from now on go to the file prepared by
+// journal_prepare_restart, and returns the identifier of the first folder they
+// create. No one can append concurrently. Does no file operation, so that
+// appending waits only briefly: records are not written until
+// journal_finish_cut.
+uint64_t journal_cut(Journal* journal);
+
+// Finishes journal_cut: writes and syncs records appended before it to the old
+// file, then puts the new file under [journal]'s name. Can be called
+// concurrently with appending and committing, which may wait for it.
+void journal_finish_cut(Journal* journal);
+
+// Syncs the directory containing file [path], so that renames in it are
+// durable. Returns 0 or error code.
+int journal_sync_directory(const char* path);
+
+// Writes and syncs all records and frees [journal]. No one can use [journal]
+// concurrently.
+void journal_close(Journal* journal);
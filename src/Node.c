@@ -1,77 +1,251 @@
+#define _GNU_SOURCE
+
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "Node.h"
+#include "epoch.h"
 #include "err.h"
+#include "path_utils.h"
+#include "Slab.h"
 #include "safe_alloc.h"
+#include "stats.h"
+
+// Every Node is a reading room for readers and writers.
+//
+// The reading room is a monitor without a mutex. Its whole state fits in one
+// 64-bit word, and every critical section of the monitor is a single
+// compare-and-swap on it, computing new state from the old one exactly as the
+// monitor would. Waiting is done on futexes, one sequence counter per kind of
+// waiting threads, which plays the role of a condition variable. A thread
+// reads the counter before registering itself as waiting, so a signal sent
+// after registration (which increments the counter) cannot be missed.
+// Readers let in after a writer are all woken at once, each of them counting
+// itself off in the state, so that none of them waits for another to be
+// scheduled.
+//
+// Critical sections are usually much shorter than sleeping on a futex and
+// being woken, so a thread finding the reading room occupied first spins on
+// its state for a while. Every Node keeps an average of spins that were
+// enough for its last waiting threads, like adaptive mutexes of glibc, and
+// threads spin at most twice as long, so they soon stop spinning in nodes
+// occupied for long.
+//
+// Besides, every Node is a sequence lock. Its version is incremented when
+// a writer enters and when it leaves, so it is odd while a writer is inside.
+// Threads can read children without entering the reading room and then check
+// that version did not change in the meantime. Such threads do it in epoch
+// critical sections, so memory of removed Nodes and everything their children
+// maps may still point to is freed through epoch_retire.
+//
+// Version also stamps the listing of children rendered by the last reader, so
+// next readers copy it instead of sorting the children again until a writer
+// enters.
+//
+// Every Node counts its descendants. A change adds its difference to the
+// pending difference of the changed folder, which is listed (see
+// node_add_pending) until someone folds it: adds it to the counter and passes
+// it on to the pending difference of the parent, read under the same lock of
+// the counter. Moving a node to another parent reads its counter and replaces
+// its parent under this lock, so differences that passed the node before are
+// counted in the number moved from the old parent to the new one, and the ones
+// passing after go to the new parent. A listed node is not retired, so that
+// lists never point to freed memory.
+
+// Listing of children, valid while node's version is equal to [version].
+typedef struct Listing {
+  unsigned int version;
+  size_t length;
+  char text[];
+} Listing;
 
-// Every Node is a reading room. Not only can typical readers and writers
-// enter the reading room, but also cleaners. Cleaners can enter only if
-// no one is in the reading room and no one wants to enter reading room.
-// Only one cleaner can enter reading room and only one can wait. Otherwise,
-// behaviour of reading room is undefined. Cleaners call start_cleaning before
-// cleaning. Thread calling tree_move is a cleaner in every node of source's
-// subtree and calls start_cleaning in every node of source's subtree to wait
-// for finish of all operations.
 struct Node {
-  HashMap* children;      // HashMap containing pointers to children
-  pthread_mutex_t lock;   // mutex needed to implement monitor
-  pthread_cond_t readers; // readers are waiting here
-  pthread_cond_t writers; // writers are waiting here
-  pthread_cond_t cleaner; // cleaner is waiting here (only one can)
-  int rcount;             // number of reading readers
-  int wcount;             // number of writing writers
-  int rwait;              // number of waiting readers
-  int wwait;              // number of waiting writers
-  int cwait;              // number of waiting cleaners
-  int r_to_let_in;        // number of readers to let in
-  // change == 2 -> we let cleaner in
+  HashMap* children;          // HashMap containing pointers to children
+  _Atomic uint64_t state;     // encoded State of the reading room
+  atomic_uint readers;        // readers are waiting here
+  atomic_uint writers;        // writers are waiting here
+  atomic_uint version;        // odd while a writer is in the reading room
+  atomic_uint moves;          // number of times node was moved
+  _Atomic(Listing*) listing;  // last rendered listing, NULL if none
+  Slab* slab;                 // slab Node has been allocated from
+  uint64_t id;                // identifier in the journal of the tree
+  atomic_ushort spins;        // average number of spins enough to enter
+  void* copies;               // copies of children kept for snapshots
+  Node* parent;               // NULL for the root and detached nodes
+  atomic_uint counter_lock;   // 0 if [descendants] and [parent] are unlocked,
+                              // 2 if someone may sleep waiting for them
+  _Atomic int64_t descendants; // number of descendants counted so far
+  _Atomic int64_t pending;    // difference not folded yet
+  max_align_t map_memory[];   // memory of [children]
+};
+
+// Decoded state of the reading room.
+typedef struct State {
+  int rcount;      // number of reading readers
+  int wcount;      // number of writing writers
+  int rwait;       // number of waiting readers
+  int wwait;       // number of waiting writers
+  int r_to_let_in; // number of readers to let in
   // change == 1 -> we let reader in
   // change == 0 -> we let writer in
   // change == -1 -> no one can enter
   int change;
-  bool to_delete;         // equals to true if node should be freed
-};
+  bool to_delete;  // equals to true if node should be freed
+  bool freed;      // equals to true if node has been retired
+  bool pinned;     // equals to true if node cannot be retired yet
+  bool listed;     // equals to true if node has a pending difference listed
+} State;
+
+// Layout of the encoded state. Counters of threads have COUNT_BITS bits, so
+// at most 2^COUNT_BITS - 1 threads can use one node at the same time.
+// r_to_let_in and change are stored increased by one.
+#define COUNT_BITS 14
+#define COUNT_MASK ((1 << COUNT_BITS) - 1)
+#define RCOUNT_SHIFT 0
+#define RWAIT_SHIFT (COUNT_BITS)
+#define WWAIT_SHIFT (2 * COUNT_BITS)
+#define TO_LET_IN_SHIFT (3 * COUNT_BITS)
+#define WCOUNT_SHIFT (4 * COUNT_BITS)
+#define CHANGE_SHIFT (WCOUNT_SHIFT + 1)
+#define TO_DELETE_SHIFT (CHANGE_SHIFT + 2)
+#define FREED_SHIFT (TO_DELETE_SHIFT + 1)
+#define PINNED_SHIFT (FREED_SHIFT + 1)
+#define LISTED_SHIFT (PINNED_SHIFT + 1)
+
+static State decode(uint64_t word) {
+  State s;
+  s.rcount = (word >> RCOUNT_SHIFT) & COUNT_MASK;
+  s.rwait = (word >> RWAIT_SHIFT) & COUNT_MASK;
+  s.wwait = (word >> WWAIT_SHIFT) & COUNT_MASK;
+  s.r_to_let_in = (int) ((word >> TO_LET_IN_SHIFT) & COUNT_MASK) - 1;
+  s.wcount = (word >> WCOUNT_SHIFT) & 1;
+  s.change = (int) ((word >> CHANGE_SHIFT) & 3) - 1;
+  s.to_delete = (word >> TO_DELETE_SHIFT) & 1;
+  s.freed = (word >> FREED_SHIFT) & 1;
+  s.pinned = (word >> PINNED_SHIFT) & 1;
+  s.listed = (word >> LISTED_SHIFT) & 1;
+  return s;
+}
 
-Node* node_new() {
-  Node* node = (Node *) safe_malloc(sizeof(Node));
-
-  if ((node->children = hmap_new()) == NULL) exit(1);
-
-  if (pthread_mutex_init(&node->lock, 0) != 0)
-    fatal("mutex init failed");
-  if (pthread_cond_init(&node->readers, 0) != 0)
-    fatal("cond init failed");
-  if (pthread_cond_init(&node->writers, 0) != 0)
-    fatal("cond init failed");
-  if (pthread_cond_init(&node->cleaner, 0) != 0)
-    fatal("cond init failed");
-
-  node->rcount = 0;
-  node->wcount = 0;
-  node->rwait = 0;
-  node->wwait = 0;
-  node->cwait = 0;
-  node->r_to_let_in = -1;
-  node->change = 0;
-  node->to_delete = false;
+// Spins are never shorter, so that a few threads taking turns do not sleep.
+#define MIN_SPINS 16
+
+static uint64_t encode(State s) {
+  return (uint64_t) s.rcount << RCOUNT_SHIFT
+       | (uint64_t) s.rwait << RWAIT_SHIFT
+       | (uint64_t) s.wwait << WWAIT_SHIFT
+       | (uint64_t) (s.r_to_let_in + 1) << TO_LET_IN_SHIFT
+       | (uint64_t) s.wcount << WCOUNT_SHIFT
+       | (uint64_t) (s.change + 1) << CHANGE_SHIFT
+       | (uint64_t) s.to_delete << TO_DELETE_SHIFT
+       | (uint64_t) s.freed << FREED_SHIFT
+       | (uint64_t) s.pinned << PINNED_SHIFT
+       | (uint64_t) s.listed << LISTED_SHIFT;
+}
 
-  return node;
+static void futex_wait(atomic_uint* futex, unsigned int expected) {
+  syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
 }
 
-void node_free(Node* node) {
-  hmap_free(node->children);
+static void futex_wake(atomic_uint* futex, int count) {
+  if (syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) < 0)
+    syserr("futex wake failed");
+}
+
+// Wakes [count] threads waiting on [queue].
+static void wake(atomic_uint* queue, int count) {
+  atomic_fetch_add(queue, 1);
+  futex_wake(queue, count);
+}
+
+// Maximum number of spins, -1 until it is set or defaults.
+static atomic_int max_spins = -1;
 
-  if (pthread_cond_destroy (&node->readers) != 0)
-    fatal("cond destroy failed");
-  if (pthread_cond_destroy (&node->writers) != 0)
-    fatal("cond destroy failed");
-  if (pthread_cond_destroy (&node->cleaner) != 0)
-    fatal("cond destroy failed");
-  if (pthread_mutex_destroy (&node->lock) != 0)
-    fatal("mutex destroy failed");
+void node_set_max_spins(int spins) {
+  atomic_store_explicit(&max_spins, spins, memory_order_relaxed);
+}
+
+// Returns maximum number of spins. Threads spinning on one processor would
+// only delay the thread they wait for.
+static int get_max_spins() {
+  int spins = atomic_load_explicit(&max_spins, memory_order_relaxed);
+  if (spins < 0) {
+    spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? NODE_MAX_SPINS : 0;
+    atomic_store_explicit(&max_spins, spins, memory_order_relaxed);
+  }
+  return spins;
+}
 
-  free(node);
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Returns encoded state of a reading room with [rcount] readers and [wcount]
+// writers inside, no one waiting and no one let in. Entering and leaving
+// threads start with a compare-and-swap assuming this state instead of loading
+// the current one, which saves a load stalled by a preceding compare-and-swap
+// in the uncontended case.
+static uint64_t quiet_state(int rcount, int wcount) {
+  State s = { 0 };
+  s.rcount = rcount;
+  s.wcount = wcount;
+  s.r_to_let_in = -1;
+  s.change = -1;
+  return encode(s);
+}
+
+// Tries to replace state [*old] with [new]. On failure, sets [*old] to the
+// current state.
+static bool update(Node* node, uint64_t* old, State new) {
+  return atomic_compare_exchange_strong(&node->state, old, encode(new));
+}
+
+size_t node_memory_size() {
+  return sizeof(Node) + hmap_memory_size();
+}
+
+Node* node_new(Slab* slab) {
+  Node* node = (Node *) slab_alloc(slab);
+
+  node->slab = slab;
+  node->id = 0;
+  node->children = hmap_init(node->map_memory);
+  hmap_set_deferred_free(node->children, epoch_retire_free);
+
+  atomic_init(&node->state, quiet_state(0, 0));
+  atomic_init(&node->readers, 0);
+  atomic_init(&node->writers, 0);
+  atomic_init(&node->version, 0);
+  atomic_init(&node->moves, 0);
+  atomic_init(&node->listing, NULL);
+  atomic_init(&node->spins, 0);
+  node->copies = NULL;
+  node->parent = NULL;
+  atomic_init(&node->counter_lock, 0);
+  atomic_init(&node->descendants, 0);
+  atomic_init(&node->pending, 0);
+
+  return node;
+}
+
+// Frees memory of [node] except the Node itself.
+static void node_destroy_contents(Node* node) {
+  free(atomic_load(&node->listing));
+  hmap_destroy(node->children);
+}
+
+void node_free(Node* node) {
+  node_destroy_contents(node);
+  slab_return(node->slab, node);
 }
 
 void node_recursive_free(Node* node) {
@@ -82,164 +256,451 @@ void node_recursive_free(Node* node) {
     node_recursive_free((Node*) child);
   }
 
-  node_free(node);
+  node_destroy_contents(node);
 }
 
 void node_set_to_delete(Node* node) {
-  node->to_delete = true;
+  atomic_fetch_or(&node->state, (uint64_t) 1 << TO_DELETE_SHIFT);
+}
+
+void node_pin(Node* node) {
+  atomic_fetch_or(&node->state, (uint64_t) 1 << PINNED_SHIFT);
+}
+
+unsigned int node_get_moves(Node* node) {
+  return atomic_load(&node->moves);
+}
+
+void node_count_move(Node* node) {
+  atomic_fetch_add(&node->moves, 1);
+}
+
+// Locks counter of descendants and parent of [node]. The lock is held for a
+// few instructions, so calling thread spins as long as entering a reading room
+// would, and only then sleeps.
+static void lock_counter(Node* node) {
+  int limit = get_max_spins();
+  for (int spins = 0; spins <= limit; spins++) {
+    unsigned int unlocked = 0;
+    if (atomic_load_explicit(&node->counter_lock, memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_weak_explicit(&node->counter_lock, &unlocked, 1,
+                                              memory_order_acquire, memory_order_relaxed))
+      return;
+    cpu_relax();
+  }
+  while (atomic_exchange_explicit(&node->counter_lock, 2, memory_order_acquire) != 0)
+    futex_wait(&node->counter_lock, 2);
+}
+
+static void unlock_counter(Node* node) {
+  if (atomic_exchange_explicit(&node->counter_lock, 0, memory_order_release) == 2)
+    futex_wake(&node->counter_lock, 1);
+}
+
+Node* node_add_descendants(Node* node, long delta) {
+  lock_counter(node);
+  Node* parent = node->parent;
+  atomic_store_explicit(&node->descendants,
+                        atomic_load_explicit(&node->descendants, memory_order_relaxed) + delta,
+                        memory_order_relaxed);
+  unlock_counter(node);
+  return parent;
+}
+
+long node_set_parent(Node* node, Node* parent) {
+  lock_counter(node);
+  node->parent = parent;
+  long count = atomic_load_explicit(&node->descendants, memory_order_relaxed) + 1;
+  unlock_counter(node);
+  return count;
+}
+
+long node_get_descendants(Node* node) {
+  int64_t descendants = atomic_load(&node->descendants) + atomic_load(&node->pending);
+  return descendants < 0 ? 0 : descendants;
+}
+
+bool node_add_pending(Node* node, long delta) {
+  atomic_fetch_add(&node->pending, delta);
+  uint64_t old = atomic_load(&node->state);
+
+  while (true) {
+    State s = decode(old);
+    // A retired node is detached, so its count does not matter any more.
+    if (s.listed || s.freed) return false;
+    s.listed = true;
+    if (update(node, &old, s)) return true;
+  }
+}
+
+Node* node_get_parent(Node* node) {
+  return node->parent;
+}
+
+uint64_t node_get_id(Node* node) {
+  return node->id;
+}
+
+void node_set_id(Node* node, uint64_t id) {
+  node->id = id;
+}
+
+bool node_is_deleted(Node* node) {
+  return (atomic_load(&node->state) >> TO_DELETE_SHIFT) & 1;
 }
 
 HashMap* node_get_children(Node* node) {
   return node->children;
 }
 
-int node_get_waiting_writers(Node* node) {
-  return node->wwait;
+void* node_get_copies(Node* node) {
+  return node->copies;
 }
 
-static void let_readers_in(Node* node) {
-  node->change = 1;
-  if (pthread_cond_signal(&node->readers) != 0)
-    fatal("cond signal failed");
+void node_set_copies(Node* node, void* copies) {
+  node->copies = copies;
 }
 
-static void let_writer_in(Node* node) {
-  node->change = 0;
-  if (pthread_cond_signal(&node->writers) != 0)
-    fatal("cond signal failed");
+unsigned int node_read_version(Node* node) {
+  return atomic_load_explicit(&node->version, memory_order_acquire);
 }
 
-static void let_cleaner_in(Node* node) {
-  node->change = 2;
-  if (pthread_cond_signal(&node->cleaner) != 0)
-    fatal("cond signal failed");
+bool node_check_version(Node* node, unsigned int version) {
+  // Reads of children made before the check cannot move after it.
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&node->version, memory_order_relaxed) == version;
 }
 
-void start_reading(Node* node) {
-  if (pthread_mutex_lock(&node->lock) != 0)
-    fatal("lock failed");
-
-  // Reader is waiting.
-  while (node->wcount + node->wwait > 0 && node->change != 1) {
-    node->rwait++;
-    if (pthread_cond_wait(&node->readers, &node->lock) != 0)
-      fatal("cond wait failed");
-    node->rwait--;
+// Returns listing of [node]'s children valid for its current version,
+// rendering it if needed. Calling thread has to be a reader in [node] and in
+// epoch critical section.
+static Listing* get_listing(Node* node) {
+  // Readers hold the version still, writers that changed it left before.
+  unsigned int version = atomic_load_explicit(&node->version, memory_order_relaxed);
+  Listing* listing = atomic_load_explicit(&node->listing, memory_order_acquire);
+  if (listing != NULL && listing->version == version) return listing;
+
+  char* text = make_map_contents_string(node->children);
+  size_t length = strlen(text);
+  Listing* rendered = (Listing*) safe_malloc(sizeof(Listing) + length + 1);
+  rendered->version = version;
+  rendered->length = length;
+  memcpy(rendered->text, text, length + 1);
+  free(text);
+
+  // Other readers may be copying the stale listing or installing their own
+  // one, equal to ours.
+  if (atomic_compare_exchange_strong(&node->listing, &listing, rendered)) {
+    if (listing != NULL) epoch_retire_free(listing);
+    return rendered;
   }
+  free(rendered);
+  return listing;
+}
 
-  node->rcount++;
+size_t node_copy_listing(Node* node, char* buffer, size_t capacity) {
+  Listing* listing = get_listing(node);
+  if (listing->length < capacity)
+    memcpy(buffer, listing->text, listing->length + 1);
+  return listing->length + 1;
+}
 
-  // We let another reader in if we can.
-  if (node->rwait > 0 && node->r_to_let_in != 0) {
-    if (node->r_to_let_in == -1) {
-      node->r_to_let_in = node->rwait;
-    }
-    node->r_to_let_in--;
-    node->change = 1;
-    if (pthread_cond_signal(&node->readers) != 0)
-      fatal("cond signal failed");
+static void node_destroy(void* node) {
+  node_free((Node*) node);
+}
+
+// What a thread leaving the reading room has to do after updating the state.
+typedef enum Handoff {
+  NONE,
+  LET_READERS_IN,
+  LET_WRITER_IN,
+  RETIRE
+} Handoff;
+
+// Lets all waiting readers in.
+static Handoff let_readers_in(State* s) {
+  s->change = 1;
+  s->r_to_let_in = s->rwait;
+  return LET_READERS_IN;
+}
+
+static Handoff let_writer_in(State* s) {
+  s->change = 0;
+  return LET_WRITER_IN;
+}
+
+// Called when the reading room becomes empty and no one is waiting. Threads
+// that read [node]'s address without locking may still enter the reading room
+// after [node] has been retired, so [node] is retired only once. A pinned or
+// listed node is retired when it is unpinned or unlisted instead.
+static Handoff retire_if_deleted(State* s) {
+  if (!s->to_delete || s->freed || s->pinned || s->listed)
+    return NONE;
+  s->freed = true;
+  return RETIRE;
+}
+
+// Does [handoff] decided together with setting state [s].
+static void handoff(Node* node, Handoff handoff, State s) {
+  switch (handoff) {
+    case LET_READERS_IN:
+      wake(&node->readers, s.r_to_let_in);
+      break;
+    case LET_WRITER_IN:
+      wake(&node->writers, 1);
+      break;
+    case RETIRE:
+      epoch_retire(node, node_destroy);
+      break;
+    case NONE:
+      break;
   }
-  else {
-    node->change = -1;
+}
+
+// Clears [node]'s pinned bit if [pinned] or its listed bit otherwise,
+// retiring it if nothing else keeps it.
+static void release(Node* node, bool pinned) {
+  uint64_t old = atomic_load(&node->state);
+
+  while (true) {
+    State s = decode(old);
+    Handoff next = NONE;
+
+    if (pinned)
+      s.pinned = false;
+    else
+      s.listed = false;
+    if (s.rcount + s.wcount + s.rwait + s.wwait == 0)
+      next = retire_if_deleted(&s);
+
+    if (update(node, &old, s)) {
+      handoff(node, next, s);
+      return;
+    }
   }
+}
 
-  if (pthread_mutex_unlock(&node->lock) != 0)
-    fatal("unlock failed");
+void node_unpin(Node* node) {
+  release(node, true);
 }
 
-void finish_reading(Node* node) {
-  if (pthread_mutex_lock(&node->lock) != 0)
-    fatal("lock failed");
+long node_take_pending(Node* node) {
+  // A difference added after the bit is cleared lists the node again.
+  release(node, false);
+  return atomic_exchange(&node->pending, 0);
+}
 
-  node->rcount--;
+// Called by a writer that has just entered [node]. Only the writer inside
+// changes version, so no read-modify-write is needed. The fence keeps later
+// writes of children after the increment.
+static void make_version_odd(Node* node) {
+  unsigned int version = atomic_load_explicit(&node->version, memory_order_relaxed);
+  atomic_store_explicit(&node->version, version + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
 
-  // Last finishing reader decides what to do next.
-  if (node->rcount == 0) {
-    node->r_to_let_in = -1;
+// Returns true if a thread has to wait to enter a reading room in state [s]
+// as a reader or a writer.
+static bool must_wait(State s, bool as_reader) {
+  if (as_reader)
+    return s.wcount + s.wwait > 0 && s.change != 1;
+  return s.wcount + s.rcount + s.rwait > 0 && s.change != 0;
+}
 
-    // Last reader frees node if it should be freed.
-    if (node->to_delete) {
-      if (node->rwait > 0) {
-        let_readers_in(node);
-        if (pthread_mutex_unlock(&node->lock) != 0)
-          fatal("unlock failed");
+// Spins until calling thread does not have to wait to enter [node] as
+// a reader or a writer, or until it has spun long enough, setting [*old] to
+// the last seen state. Writers do not spin behind waiting writers, which
+// would be let in first anyway.
+static void spin(Node* node, uint64_t* old, bool as_reader) {
+  int average = atomic_load_explicit(&node->spins, memory_order_relaxed);
+  int limit = get_max_spins();
+  if (limit == 0) return;
+  if (2 * average + MIN_SPINS < limit) limit = 2 * average + MIN_SPINS;
+
+  for (int spins = 1; spins <= limit; spins++) {
+    cpu_relax();
+    *old = atomic_load_explicit(&node->state, memory_order_relaxed);
+    State s = decode(*old);
+    if (!must_wait(s, as_reader)) {
+      atomic_store_explicit(&node->spins, average + (spins - average) / 8, memory_order_relaxed);
+      return;
+    }
+    if (!as_reader && s.wwait > 0) return;
+  }
+  atomic_store_explicit(&node->spins, average / 2, memory_order_relaxed);
+}
+
+void start_reading(Node* node) {
+  uint64_t old = quiet_state(0, 0);
+  bool waiting = false;
+  bool spun = false;
+#ifdef TREE_STATS
+  uint64_t wait_start = 0;
+#endif
+
+  while (true) {
+    unsigned int queue = atomic_load(&node->readers);
+    State s = decode(old);
+    if (waiting) s.rwait--;
+
+    // Reader is waiting.
+    if (must_wait(s, true)) {
+      if (!spun && !waiting) {
+        spun = true;
+        spin(node, &old, true);
+        continue;
       }
-      else {
-        if (pthread_mutex_unlock(&node->lock) != 0)
-          fatal("unlock failed");
-        node_free(node);
+      s.rwait++;
+      if (update(node, &old, s)) {
+#ifdef TREE_STATS
+        if (!waiting) wait_start = stats_now();
+#endif
+        waiting = true;
+        futex_wait(&node->readers, queue);
+        old = atomic_load(&node->state);
       }
-      return;
+      continue;
+    }
+
+    s.rcount++;
+
+    // Last of the readers let in together closes the door behind them.
+    // Readers coming meanwhile just enter.
+    if (waiting && s.change == 1 && --s.r_to_let_in == 0) {
+      s.r_to_let_in = -1;
+      s.change = -1;
     }
 
-    // Last reader lets a writer in if at least one writer is waiting.
-    if (node->wwait > 0)
-      let_writer_in(node);
-    // Otherwise, last reader lets reader in if at least one reader is waiting.
-    else if (node->rwait > 0)
-      let_readers_in(node);
-    // If no one is waiting and cleaner is waiting, last reader lets cleaner in.
-    else if (node->cwait > 0)
-      let_cleaner_in(node);
+    if (update(node, &old, s)) {
+#ifdef TREE_STATS
+      if (waiting) stats_count_wait(true, wait_start);
+#endif
+      return;
+    }
   }
+}
 
-  if (pthread_mutex_unlock(&node->lock) != 0)
-    fatal("unlock failed");
+void finish_reading(Node* node) {
+  uint64_t old = quiet_state(1, 0);
+
+  while (true) {
+    State s = decode(old);
+    Handoff next = NONE;
+
+    s.rcount--;
+
+    // Last finishing reader decides what to do next, unless readers let in
+    // together are still coming, as they have been woken already.
+    if (s.rcount == 0 && s.change != 1) {
+      // Last reader lets a writer in if at least one writer is waiting.
+      if (s.wwait > 0)
+        next = let_writer_in(&s);
+      // Otherwise, last reader lets reader in if at least one reader is waiting.
+      else if (s.rwait > 0)
+        next = let_readers_in(&s);
+      // If no one is waiting at all, last reader frees node if it should be freed.
+      else
+        next = retire_if_deleted(&s);
+    }
+
+    if (update(node, &old, s)) {
+      handoff(node, next, s);
+      return;
+    }
+  }
 }
 
 void start_writing(Node* node) {
-  if (pthread_mutex_lock(&node->lock) != 0)
-    fatal("lock failed");
-
-  // Writer is waiting.
-  while (node->wcount + node->rcount + node->rwait > 0 && node->change != 0) {
-    node->wwait++;
-    if (pthread_cond_wait(&node->writers, &node->lock) != 0)
-      fatal("cond wait failed");
-    node->wwait--;
+  uint64_t old = quiet_state(0, 0);
+  bool waiting = false;
+  bool spun = false;
+#ifdef TREE_STATS
+  uint64_t wait_start = 0;
+#endif
+
+  while (true) {
+    unsigned int queue = atomic_load(&node->writers);
+    State s = decode(old);
+    if (waiting) s.wwait--;
+
+    // Writer is waiting.
+    if (must_wait(s, false)) {
+      if (!spun && !waiting) {
+        spun = true;
+        spin(node, &old, false);
+        continue;
+      }
+      s.wwait++;
+      if (update(node, &old, s)) {
+#ifdef TREE_STATS
+        if (!waiting) wait_start = stats_now();
+#endif
+        waiting = true;
+        futex_wait(&node->writers, queue);
+        old = atomic_load(&node->state);
+      }
+      continue;
+    }
+
+    s.change = -1;
+    s.wcount++;
+
+    if (update(node, &old, s)) {
+      make_version_odd(node);
+#ifdef TREE_STATS
+      if (waiting) stats_count_wait(false, wait_start);
+#endif
+      return;
+    }
   }
+}
+
+bool try_start_writing(Node* node) {
+  uint64_t old = quiet_state(0, 0);
+
+  while (true) {
+    State s = decode(old);
 
-  node->change = -1;
-  node->wcount++;
+    // Waiting writers may be let in already, so they are not overtaken.
+    if (s.wcount + s.rcount + s.rwait + s.wwait > 0)
+      return false;
 
-  if (pthread_mutex_unlock(&node->lock) != 0)
-    fatal("unlock failed");
+    s.change = -1;
+    s.wcount++;
+
+    if (update(node, &old, s)) {
+      make_version_odd(node);
+      return true;
+    }
+  }
 }
 
 void finish_writing(Node* node) {
-  if (pthread_mutex_lock(&node->lock) != 0)
-    fatal("lock failed");
-
-  node->wcount--;
-
-  // Writer lets reader in if at least one is waiting.
-  if (node->rwait > 0)
-    let_readers_in(node);
-  // Otherwise, writer lets writer in if at least one is waiting.
-  else if (node->wwait > 0)
-    let_writer_in(node);
-  // If no one is waiting and cleaner is waiting, writer lets cleaner in.
-  else if (node->cwait > 0)
-    let_cleaner_in(node);
-
-  if (pthread_mutex_unlock(&node->lock) != 0)
-    fatal("unlock failed");
-}
-
-void start_cleaning(Node* node) {
-  if (pthread_mutex_lock(&node->lock) != 0)
-    fatal("lock failed");
-
-  // Cleaner is waiting.
-  while (node->wcount + node->wwait + node->rcount + node->rwait > 0 && node->change != 2) {
-    node->cwait++;
-    if (pthread_cond_wait(&node->cleaner, &node->lock) != 0)
-      fatal("cond wait failed");
-    node->cwait--;
+  // Version has to be even again before another writer can enter.
+  unsigned int version = atomic_load_explicit(&node->version, memory_order_relaxed);
+  atomic_store_explicit(&node->version, version + 1, memory_order_release);
+
+  uint64_t old = quiet_state(0, 1);
+
+  while (true) {
+    State s = decode(old);
+    Handoff next = NONE;
+
+    s.wcount--;
+
+    // Writer lets reader in if at least one is waiting.
+    if (s.rwait > 0)
+      next = let_readers_in(&s);
+    // Otherwise, writer lets writer in if at least one is waiting.
+    else if (s.wwait > 0)
+      next = let_writer_in(&s);
+    // If no one is waiting at all, writer frees node if it should be freed.
+    else
+      next = retire_if_deleted(&s);
+
+    if (update(node, &old, s)) {
+      handoff(node, next, s);
+      return;
+    }
   }
-
-  node->change = -1;
-
-  if (pthread_mutex_unlock(&node->lock) != 0)
-    fatal("unlock failed");
 }
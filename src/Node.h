@@ -1,26 +1,130 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "HashMap.h"
+#include "Slab.h"
 
 typedef struct Node Node; // structure representing folder
 
-// Returns pointer to newly created Node.
-Node* node_new();
+// Returns size of memory of one Node, which slabs Nodes are allocated from
+// have to hand out.
+size_t node_memory_size();
+
+// Returns pointer to newly created Node allocated from [slab].
+Node* node_new(Slab* slab);
 
 // Frees [node]'s memory.
 void node_free(Node* node);
 
-// Frees memory od [node] and all his descendants.
+// Frees memory of [node] and all his descendants, except Nodes themselves,
+// which are freed together with their slab.
 void node_recursive_free(Node* node);
 
-// Marks node as "to_delete". Last finishing reader will free its memory.
+// Marks node as "to_delete". Last thread leaving its reading room will free
+// its memory.
 void node_set_to_delete(Node* node);
 
+// Returns true if [node] has been marked as "to_delete".
+bool node_is_deleted(Node* node);
+
+// Keeps [node] in memory after it is marked as "to_delete" and left by the
+// last thread, until node_unpin. Has to be called before [node] could be
+// freed.
+void node_pin(Node* node);
+
+// Lets [node] be freed again, freeing it now if it is marked as "to_delete"
+// and no one occupies it.
+void node_unpin(Node* node);
+
+// Returns number of times [node] has been moved to another parent (or
+// detached with its subtree).
+unsigned int node_get_moves(Node* node);
+
+// Increases number of times [node] has been moved. Has to be called before
+// moving [node], by a writer in its parent, or after detaching it, by a
+// writer in [node].
+void node_count_move(Node* node);
+
+// Returns number of descendants of [node] counted so far, with its own
+// pending difference (see node_add_pending). Differences still pending in its
+// descendants are missing.
+long node_get_descendants(Node* node);
+
+// Adds [delta] to number of descendants of [node] and returns its parent, to
+// whose pending difference it has to be added next, or NULL if it is the root
+// or detached.
+Node* node_add_descendants(Node* node, long delta);
+
+// Adds [delta] to pending difference of number of descendants of [node] and
+// all its ancestors, which will be counted when someone folds it (see
+// node_take_pending). Returns true if [node] has just been listed: then
+// calling thread has to put it on a list of nodes to fold. A listed node stays
+// in memory until it is folded, and a retired one is not listed any more.
+// Calling thread has to be in epoch critical section.
+bool node_add_pending(Node* node, long delta);
+
+// Unlists [node], which may let it be freed after calling thread leaves epoch
+// critical section, and returns its pending difference, to be added by
+// node_add_descendants.
+long node_take_pending(Node* node);
+
+// Makes [parent] (NULL to detach it) the parent of [node], which has to be
+// done by a writer in the old and new parent. Returns number of folders
+// [node] brings: itself and descendants counted so far, to be subtracted
+// from the old parent and added to the new one. Pending differences of [node]
+// and its descendants go to [parent] when they are folded.
+long node_set_parent(Node* node, Node* parent);
+
+// Returns parent of [node], NULL for the root and detached nodes. No one can
+// change it concurrently.
+Node* node_get_parent(Node* node);
+
+// Returns [node]'s identifier, which names it in the journal of its tree (see
+// Journal.h), 0 by default.
+uint64_t node_get_id(Node* node);
+
+// Sets [node]'s identifier. No one can read it concurrently.
+void node_set_id(Node* node, uint64_t id);
+
 // Returns HashMap containing children of [node].
 HashMap* node_get_children(Node* node);
 
-// Returns number of waiting writers.
-int node_get_waiting_writers(Node* node);
+// Returns copies of children of [node] kept for snapshots of its tree (see
+// Tree.c), NULL by default. Calling thread has to occupy [node].
+void* node_get_copies(Node* node);
+
+// Sets copies of children of [node], which are not freed with it. Calling
+// thread has to be a writer in [node].
+void node_set_copies(Node* node, void* copies);
+
+// Copies string with names of [node]'s children in lexicographic order,
+// separated by commas, into [buffer] if it fits in [capacity] bytes ([buffer]
+// may be NULL if [capacity] is 0). Returns its size including the terminating
+// null byte. Calling thread has to be
+// a reader in [node] and in epoch critical section. Listing is rendered again
+// only after a writer has been in [node], otherwise it is just copied.
+size_t node_copy_listing(Node* node, char* buffer, size_t capacity);
+
+// Returns [node]'s version. It is odd while a writer is in [node] and changes
+// every time a writer enters or leaves. Children of [node] can be read without
+// entering its reading room, inside epoch critical section, between
+// node_read_version and successful node_check_version.
+unsigned int node_read_version(Node* node);
+
+// Returns true if no writer has entered [node] since node_read_version returned
+// [version].
+bool node_check_version(Node* node, unsigned int version);
+
+// Default maximum number of times a thread checks the state of an occupied
+// node before it waits to enter it, on machines with more than one processor.
+#define NODE_MAX_SPINS 2048
+
+// Sets maximum number of times threads check the state of an occupied node
+// before they wait to enter it, 0 to make them wait at once, which is the
+// default on one processor.
+void node_set_max_spins(int spins);
 
 void start_reading(Node* node);
 
@@ -28,6 +132,9 @@ void finish_reading(Node* node);
 
 void start_writing(Node* node);
 
+// Starts writing in [node] if it can be done without waiting. Returns true if
+// it did.
+bool try_start_writing(Node* node);
+
 void finish_writing(Node* node);
 
-void start_cleaning(Node* node);
@@ -0,0 +1,132 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PathCache.h"
+#include "epoch.h"
+#include "err.h"
+#include "safe_alloc.h"
+
+// Number of separate pairs of counters. Every thread counts lookups in one of
+// them, so threads do not fight for one cache line on every lookup.
+#define STRIPES 16
+
+#define CACHE_LINE 64
+
+typedef struct Entry {
+  unsigned long gen;
+  void* value;       // NULL for negative entries
+  size_t hash;
+  size_t length;     // of path
+  char path[];
+} Entry;
+
+typedef struct Counters {
+  _Alignas(CACHE_LINE) atomic_ulong hits;
+  atomic_ulong misses;
+} Counters;
+
+struct PathCache {
+  Counters counters[STRIPES];
+  size_t mask;             // number of slots - 1, number of slots is a power of two
+  _Atomic(Entry*)* slots;
+};
+
+static atomic_uint next_stripe = 0;
+static _Thread_local int stripe = -1;
+
+// FNV-1a.
+static size_t get_hash(const char* path, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char) path[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ (hash >> 32);
+}
+
+// Returns true if [entry] is an entry of [path] of [length] with [hash].
+static bool is_entry_of(Entry* entry, const char* path, size_t length, size_t hash) {
+  return entry != NULL && entry->hash == hash && entry->length == length &&
+         memcmp(entry->path, path, length) == 0;
+}
+
+PathCache* pcache_new(size_t capacity) {
+  PathCache* cache = (PathCache*) aligned_alloc(CACHE_LINE, sizeof(PathCache));
+  if (cache == NULL) fatal("aligned_alloc failed");
+
+  size_t slots = 1;
+  while (slots < capacity) slots *= 2;
+
+  cache->mask = slots - 1;
+  cache->slots = (_Atomic(Entry*)*) safe_malloc(slots * sizeof(_Atomic(Entry*)));
+  for (size_t i = 0; i < slots; ++i)
+    atomic_init(&cache->slots[i], NULL);
+  for (int i = 0; i < STRIPES; ++i) {
+    atomic_init(&cache->counters[i].hits, 0);
+    atomic_init(&cache->counters[i].misses, 0);
+  }
+
+  return cache;
+}
+
+void pcache_free(PathCache* cache) {
+  for (size_t i = 0; i <= cache->mask; ++i)
+    free(atomic_load(&cache->slots[i]));
+  free(cache->slots);
+  free(cache);
+}
+
+bool pcache_get(PathCache* cache, const char* path, size_t length, unsigned long* gen, void** value) {
+  size_t hash = get_hash(path, length);
+  Entry* entry = atomic_load_explicit(&cache->slots[hash & cache->mask], memory_order_acquire);
+  if (!is_entry_of(entry, path, length, hash))
+    return false;
+
+  *gen = entry->gen;
+  *value = entry->value;
+  return true;
+}
+
+void pcache_put(PathCache* cache, const char* path, size_t length, unsigned long gen, void* value) {
+  size_t hash = get_hash(path, length);
+  Entry* entry = (Entry*) safe_malloc(sizeof(Entry) + length);
+  entry->gen = gen;
+  entry->value = value;
+  entry->hash = hash;
+  entry->length = length;
+  memcpy(entry->path, path, length);
+
+  Entry* old = atomic_exchange(&cache->slots[hash & cache->mask], entry);
+  if (old != NULL) epoch_retire_free(old);
+}
+
+void pcache_erase(PathCache* cache, const char* path, size_t length) {
+  size_t hash = get_hash(path, length);
+  _Atomic(Entry*)* slot = &cache->slots[hash & cache->mask];
+  Entry* entry = atomic_load(slot);
+  if (!is_entry_of(entry, path, length, hash))
+    return;
+
+  // Entry could have been replaced in the meantime, then it is not ours to
+  // retire.
+  if (atomic_compare_exchange_strong(slot, &entry, NULL))
+    epoch_retire_free(entry);
+}
+
+void pcache_count(PathCache* cache, bool hit) {
+  if (stripe < 0) stripe = atomic_fetch_add(&next_stripe, 1) % STRIPES;
+
+  Counters* counters = &cache->counters[stripe];
+  atomic_fetch_add_explicit(hit ? &counters->hits : &counters->misses, 1, memory_order_relaxed);
+}
+
+void pcache_stats(PathCache* cache, unsigned long* hits, unsigned long* misses) {
+  *hits = 0;
+  *misses = 0;
+  for (int i = 0; i < STRIPES; ++i) {
+    *hits += atomic_load_explicit(&cache->counters[i].hits, memory_order_relaxed);
+    *misses += atomic_load_explicit(&cache->counters[i].misses, memory_order_relaxed);
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Concurrent direct-mapped cache of results of path lookups. Every path has
+// one slot, an entry stored there replaces any entry of another path in this
+// slot. An entry holds a value (NULL for a negative entry, meaning that path
+// does not exist) and a generation chosen by the user, who decides whether
+// the entry is still valid. Entries are immutable, replaced and erased ones are
+// freed through epoch_retire, so all functions except pcache_new and
+// pcache_free can be called concurrently from epoch critical sections.
+typedef struct PathCache PathCache;
+
+// Returns pointer to newly created cache with at least [capacity] slots.
+PathCache* pcache_new(size_t capacity);
+
+// Frees [cache] and all its entries. No one can use [cache] concurrently.
+void pcache_free(PathCache* cache);
+
+// Paths are given as first [length] characters of [path], which does not have
+// to be null-terminated there.
+
+// Returns true if [cache] has an entry for [path], storing its generation in
+// [*gen] and its value in [*value].
+bool pcache_get(PathCache* cache, const char* path, size_t length, unsigned long* gen, void** value);
+
+// Stores entry with [gen] and [value] for [path], replacing the previous one.
+void pcache_put(PathCache* cache, const char* path, size_t length, unsigned long gen, void* value);
+
+// Removes entry for [path] if there is one.
+void pcache_erase(PathCache* cache, const char* path, size_t length);
+
+// Counts a lookup answered (if [hit]) or not answered by [cache].
+void pcache_count(PathCache* cache, bool hit);
+
+// Stores numbers of counted lookups in [*hits] and [*misses].
+void pcache_stats(PathCache* cache, unsigned long* hits, unsigned long* misses);
@@ -0,0 +1,171 @@
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "Slab.h"
+#include "err.h"
+#include "safe_alloc.h"
+
+// Number of objects moved at once between a thread's cache and the shared
+// list. A thread's cache holds at most 2 * BATCH objects.
+#define BATCH 64
+
+// Number of objects in one chunk.
+#define CHUNK_OBJECTS 1024
+
+// Number of slabs every thread caches objects of at the same time. Objects
+// cached for a slab evicted from a thread's cache, or by a finished thread, are
+// not used again before their slab is freed.
+#define THREAD_CACHES 4
+
+typedef struct Object Object;
+
+struct Object {
+  Object* next; // next free object on a list
+};
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+  Chunk* next;
+  max_align_t objects[];
+};
+
+struct Slab {
+  unsigned long id;       // never reused, identifies slab in threads' caches
+  size_t object_size;     // multiple of alignof(max_align_t)
+  pthread_mutex_t lock;   // protects the fields below
+  Chunk* chunks;          // all chunks, the newest first
+  size_t carved;          // number of objects cut out of the newest chunk
+  Object* shared;         // objects given back by threads with full caches
+};
+
+// Cache of free objects of one slab owned by one thread.
+typedef struct Cache {
+  unsigned long slab_id;  // 0 if cache is unused
+  Object* head;
+  size_t count;
+} Cache;
+
+static atomic_ulong next_id = 1;
+static _Thread_local Cache caches[THREAD_CACHES];
+static _Thread_local int next_victim = 0;
+
+Slab* slab_new(size_t object_size) {
+  Slab* slab = (Slab*) safe_malloc(sizeof(Slab));
+
+  size_t alignment = alignof(max_align_t);
+  if (object_size < sizeof(Object)) object_size = sizeof(Object);
+  slab->id = atomic_fetch_add(&next_id, 1);
+  slab->object_size = (object_size + alignment - 1) / alignment * alignment;
+  if (pthread_mutex_init(&slab->lock, 0) != 0)
+    fatal("mutex init failed");
+  slab->chunks = NULL;
+  slab->carved = CHUNK_OBJECTS;
+  slab->shared = NULL;
+
+  return slab;
+}
+
+void slab_free(Slab* slab) {
+  while (slab->chunks != NULL) {
+    Chunk* next = slab->chunks->next;
+    free(slab->chunks);
+    slab->chunks = next;
+  }
+  if (pthread_mutex_destroy(&slab->lock) != 0)
+    fatal("mutex destroy failed");
+  free(slab);
+}
+
+// Returns calling thread's cache of objects of [slab].
+static Cache* get_cache(Slab* slab) {
+  for (int i = 0; i < THREAD_CACHES; i++) {
+    if (caches[i].slab_id == slab->id) return &caches[i];
+  }
+
+  // Objects of the evicted slab are dropped, as it may have been freed.
+  Cache* cache = NULL;
+  for (int i = 0; i < THREAD_CACHES && cache == NULL; i++) {
+    if (caches[i].slab_id == 0) cache = &caches[i];
+  }
+  if (cache == NULL) {
+    cache = &caches[next_victim];
+    next_victim = (next_victim + 1) % THREAD_CACHES;
+  }
+
+  cache->slab_id = slab->id;
+  cache->head = NULL;
+  cache->count = 0;
+  return cache;
+}
+
+// Fills empty [cache] with objects of [slab].
+static void refill(Slab* slab, Cache* cache) {
+  if (pthread_mutex_lock(&slab->lock) != 0)
+    fatal("lock failed");
+
+  while (cache->count < BATCH && slab->shared != NULL) {
+    Object* object = slab->shared;
+    slab->shared = object->next;
+    object->next = cache->head;
+    cache->head = object;
+    cache->count++;
+  }
+
+  while (cache->count < BATCH) {
+    if (slab->carved == CHUNK_OBJECTS) {
+      Chunk* chunk = (Chunk*) safe_malloc(sizeof(Chunk) + CHUNK_OBJECTS * slab->object_size);
+      chunk->next = slab->chunks;
+      slab->chunks = chunk;
+      slab->carved = 0;
+    }
+    Object* object = (Object*) ((char*) slab->chunks->objects + slab->carved * slab->object_size);
+    slab->carved++;
+    object->next = cache->head;
+    cache->head = object;
+    cache->count++;
+  }
+
+  if (pthread_mutex_unlock(&slab->lock) != 0)
+    fatal("unlock failed");
+}
+
+// Moves BATCH objects from full [cache] to the shared list of [slab].
+static void flush(Slab* slab, Cache* cache) {
+  Object* first = cache->head;
+  Object* last = first;
+  for (int i = 1; i < BATCH; i++)
+    last = last->next;
+  cache->head = last->next;
+  cache->count -= BATCH;
+
+  if (pthread_mutex_lock(&slab->lock) != 0)
+    fatal("lock failed");
+  last->next = slab->shared;
+  slab->shared = first;
+  if (pthread_mutex_unlock(&slab->lock) != 0)
+    fatal("unlock failed");
+}
+
+void* slab_alloc(Slab* slab) {
+  Cache* cache = get_cache(slab);
+  if (cache->head == NULL) refill(slab, cache);
+
+  Object* object = cache->head;
+  cache->head = object->next;
+  cache->count--;
+  return object;
+}
+
+void slab_return(Slab* slab, void* object) {
+  Cache* cache = get_cache(slab);
+  ((Object*) object)->next = cache->head;
+  cache->head = (Object*) object;
+  cache->count++;
+
+  if (cache->count > 2 * BATCH) flush(slab, cache);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+// Allocator of objects of one size. Objects are cut out of big chunks of
+// memory, which are given back to the system all at once by slab_free.
+// Every thread keeps its own cache of free objects of a few slabs, filled with
+// objects it gives back (whichever thread allocated them) and, in batches,
+// from a list shared by all threads. Thus allocating and giving back objects
+// usually touches only memory of calling thread. All functions except slab_new
+// and slab_free can be called concurrently.
+typedef struct Slab Slab;
+
+// Returns pointer to newly created slab of objects of [object_size] bytes.
+Slab* slab_new(size_t object_size);
+
+// Frees [slab] together with all its objects, including ones not given back.
+// No one can use [slab] concurrently.
+void slab_free(Slab* slab);
+
+// Returns pointer to an object from [slab], aligned for any type.
+void* slab_alloc(Slab* slab);
+
+// Gives [object] back to [slab] it has been allocated from.
+void slab_return(Slab* slab, void* object);
@@ -5,108 +5,780 @@
 // The solution is to reduce the problem to the problem of readers and writers.
 // Every node representing folder is a different reading room. Every thread
 // is a reader or writer depending on what it wants to do. Every thread:
-//  - wanting to reach node's child is a reader in this node.
-//  - calling tree_create is a writer in the parent of the node to create.
 //  - calling tree_list is a reader in the node to list.
+//  - calling tree_create is a writer in the parent of the node to create.
 //  - calling tree_remove is a writer in the parent of the node to remove and
 //    a reader in the node to remove.
 //  - calling tree_move is a writer in the source's parent and a writer in the
-//    target's parent
-// In addition, threads calling tree_remove and tree_move perform some special
-// actions.
-// Thread calling three_remove checks if node to remove has no children and
-// no waiting writers - threads calling tree_create. If yes, it marks node as
-// "to_delete" and removes it from its parent's HashMap. From this moment no
-// threads will reach removed node, but readers in removed node can still work.
-// The last finishing reader will notice "to_delete" mark and remove node's
-// memory. This approach is correct, because the result of all function calls
-// in removed node will always be equal to sequentially made calls with remove
-// last.
-// Thread calling tree_move reaches lca (lowest common ancestor) of source's
-// parent and target's parent and it starts writing there. Then it reaches
-// source's parent and target's parent and starts writing there. So thread
-// calling tree_move is also a writer in lca(source's parent, target's parent).
-// In my implementation it is necessary. Without this deadlocks could happen.
-// For example, for tree with folders "/", "/a/", "/b/", "/a/c/", "/b/e/" two
-// threads calling concurrently tree_move("/a/c/", "/b/f/") and
-// tree_move("/b/e/", "/a/d/") could block themselves. Both threads could
-// concurrently reach their source's parent and start writing there, but this
-// way both target's parents would be locked by the other thread and never
-// reached - deadlock. Even if this specific case can be solved, there are
-// many similar problematic scenarios leading to deadlock. Fixing them all
-// without locking at least part of the tree seems really difficult or even
-// impossible. Locking lca(source's parent, target's parent) may not be
-// the most optimal solution, but is general and easy to implement. That is
-// why I chose this option.
-// Moreover, thread calling tree_move waits until all operations in source's
-// subtree finish. Without this, final effect of function calls could have no
-// matching sequential substitute. For example, if tree_move finished
-// before all tree_lists in source's subtree finished and tree_create
-// reached source's subtree after tree_move finished, but before all tree_lists
-// in the parent of node to create finished, final result would not match any
-// sequential result. It is easy to check.
+//    target's parent.
+// Thread calling tree_remove checks if node to remove has no children. If so,
+// it marks node as "to_delete" and removes it from its parent's HashMap, not
+// waiting for writers waiting in the node: they have reached it without
+// occupying the parent, so they will find their paths changed and walk them
+// again. From this moment no thread will reach removed node, but readers in
+// removed node can still work. The last finishing reader will notice
+// "to_delete" mark and retire node's memory, which is freed through
+// epoch-based reclamation once no thread walking without locking can still
+// see it. The result of all calls in removed node is the same as if they were
+// made sequentially, with remove last.
+// Threads do not enter reading rooms on their way to the node they operate
+// on. Every Node is also a sequence lock (see Node.c), so a thread first walks
+// from the root without locking, checking after every step that the node it
+// has just left did not change. Then it enters the reading room of the node
+// it operates on and checks that no node on the path has changed since it was
+// passed. At this moment the path is valid: every node on it is still a child
+// of the previous one, and the thread cannot be in source's subtree of an
+// unfinished tree_move, which occupies source's parent as a writer for the
+// whole time. Any other operation in its subtree has to pass through the node
+// it occupies from then on. This way reads do not write shared memory on the
+// path, in particular the root's lock. If any check fails OPTIMISTIC_ATTEMPTS
+// times, and always for paths deeper than MAX_OPTIMISTIC_DEPTH, thread walks
+// the path locking every node instead, occupying only one or two of them at a
+// time. Nodes it has left behind may be moved in the meantime, so it records
+// their move counters (see Node.h) in a Trail and, having reached the node,
+// checks that none of them changed, walking the path again if one did.
+// Thread calling tree_move finds source's parent and target's parent without
+// locking, like other operations. Then it starts writing in the one with the
+// lower address and only tries to start writing in the other one, releasing
+// the first one if it fails, so it never waits while occupying a node. With
+// both parents occupied, it checks their paths exactly as other operations
+// do, except that a parent occupied by itself has its version increased by
+// one. Hence tree_move does not wait for operations in source's subtree and
+// costs only as much as reaching both parents. If this fails MOVE_ATTEMPTS
+// times, thread falls back to walking to lca (lowest common ancestor) of
+// source's parent and target's parent locking every node, starting writing
+// there and walking down from it to both parents. Waiting for the second
+// parent while holding the first one without lca could deadlock: for tree with
+// folders "/", "/a/", "/b/", "/a/c/", "/b/e/", tree_move("/a/c/", "/b/f/") and
+// tree_move("/b/e/", "/a/d/") could each occupy its source's parent and wait
+// for the other one forever.
+// Optionally, results of reaching nodes are cached by path (see PathCache.h),
+// so reaching a node again costs a single lookup instead of walking the path.
+// A cached node is valid if no tree_move in its scope (folders with the same
+// first folder name, or another one sharing its CacheScope) has started since
+// it was reached and it is not removed, which is checked after entering its
+// reading room. Thread removing a node first marks it as "to_delete" and then
+// erases its path from the cache, while thread caching a node it occupies
+// first caches it and then checks the mark. Hence, when the last thread leaves
+// a removed node, no valid cache entry points to it. A cached nonexistent path
+// is valid if no folder has been created (or moved) in its scope since it was
+// found nonexistent. Without the cache, changes do not count anything.
+// A tree opened by tree_open logs every change to its journal (see Journal.h)
+// while the changed nodes are occupied, naming folders by identifiers that do
+// not change when they are moved. Records of changes made by operations that
+// did not occupy the same node can be replayed in any order, hence appending
+// only briefly takes the journal's lock. Syncing it is left until the
+// operation leaves its nodes (or not, see TreeDurability) and is shared by all
+// threads waiting for it. A checkpoint cuts the journal, starting a new file
+// of the next generation, and takes a snapshot (see below) while no changing
+// operation is in progress, so that the snapshot sees exactly the changes
+// recorded before the cut. Only then does it write the snapshot, while
+// changes go on. Until the checkpoint is durable, recovery replays the old
+// file, kept under another name, and the new one on the previous checkpoint.
+// tree_remove_recursive detaches a whole subtree as a writer in its parent,
+// like tree_move, and returns. A reclaimer thread of the tree, started by the
+// first such call, frees it node by node, from the top. It enters every node
+// as a writer, so operations that reached it before the subtree was detached
+// finish first, and counts a move of it, so threads that passed it and have
+// not checked their paths yet walk them again.
+// A snapshot taken by tree_snapshot is only a number, its generation: the
+// number of snapshots taken before it and itself. Every change reads the
+// generation of the newest live snapshot while it occupies as a writer all
+// folders it changes, so changes of every folder are tagged with generations
+// in order, and every snapshot sees exactly the changes tagged with older
+// generations. The first change of a folder tagged with a generation copies
+// its children first, and the snapshot sees the oldest copy of its generation
+// or newer, or the current children if there is none. A removed node is
+// pinned in memory for as long as a snapshot may see it. Copies and pins are
+// kept in a list of the tree and freed when no snapshot that needs them is
+// live. tree_walk walks a snapshot of its own, which keeps folders waiting to
+// be walked in memory without keeping walkers in epoch critical section while
+// they call back.
+// Changes are reported to watches (see Watch.h) while the changed folders are
+// still occupied, so events of changes of a folder come in order. Events are
+// made before the change enters any node (see Notice), so it only pushes them
+// there. The list of watches is replaced as a whole when one is added or
+// removed and freed through epoch-based reclamation, so changes only read it.
+// Every node counts its descendants (see node_add_descendants). A change only
+// adds its difference to the pending difference of the folder it occupies,
+// listing the folder in a stripe of the tree (see count_descendants) if it was
+// not listed, so changes never wait for each other to count, not even at the
+// root. A change that has made its stripe long folds all listed differences up
+// to the root when it finishes, if no one else does, and so does
+// tree_fold_counts. tree_stat only reads the count of the folder and its own
+// pending difference, so it misses differences listed below it.
+// tree_batch counts all changes of a folder reached once together.
+
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "Tree.h"
+#include "Journal.h"
 #include "Node.h"
+#include "PathCache.h"
+#include "Slab.h"
+#include "Watch.h"
+#include "epoch.h"
+#include "err.h"
 #include "path_utils.h"
 #include "safe_alloc.h"
+#include "stats.h"
 
 // Error returned by tree_move, when [source] is a prefix of [target].
 #define EMOVETOSUBTREE -1
 
+// Number of attempts to reach a node without locking before falling back to
+// locking every node on the path.
+#define OPTIMISTIC_ATTEMPTS 3
+
+// Maximum number of folders on a path walked without locking. Deeper paths are
+// walked locking every node.
+#define MAX_OPTIMISTIC_DEPTH 64
+
+// Number of attempts to move a folder locking only its old and new parent
+// before falling back to locking their lowest common ancestor.
+#define MOVE_ATTEMPTS 8
+
+// Number of events a watch holds before it drops further ones.
+#define WATCH_CAPACITY 4096
+
+// Number of watches a change makes events for without allocating memory for
+// pointers to them.
+#define NOTICE_INLINE_EVENTS 4
+
+// Maximum number of threads of tree_walk with TREE_WALK_PARALLEL.
+#define MAX_WALK_THREADS 64
+
+// Number of nodes a thread walking paths locking every node remembers without
+// allocating memory. Enough for any move between paths walked without locking.
+#define TRAIL_INLINE_LENGTH (2 * MAX_OPTIMISTIC_DEPTH)
+
+// Number of groups of paths validated in the path cache separately (see
+// CacheScope).
+#define CACHE_SCOPES 64
+
+// Size of a cache line, which counters written by different threads do not
+// share.
+#define CACHE_LINE 64
+
+// Number of lists of folders with pending numbers of descendants (see
+// CountStripe), which threads append to separately.
+#define COUNT_STRIPES 16
+
+// Length of a list of folders with pending numbers of descendants at which
+// a changing operation folds them (see fold_counts) when it finishes.
+#define FOLD_THRESHOLD 1024
+
+// Size of the journal above which a tree opened by tree_open checkpoints itself
+// by default (see tree_set_checkpoint_size).
+#define CHECKPOINT_JOURNAL_SIZE (64 * 1024 * 1024)
+
+// Children of a folder copied by the first change of it tagged with a
+// generation (see current_generation), as they were before the change, for
+// snapshots of this and older generations. Kept in one block of memory.
+typedef struct FolderCopy FolderCopy;
+struct FolderCopy {
+  uint64_t generation;
+  FolderCopy* older;      // previous copy of the same folder, NULL if none
+  size_t count;           // number of children
+  Node** children;        // sorted by names
+  uint32_t* name_offsets; // of names in [listing], [count] + 1 of them, the
+                          // last one equal to size of [listing]
+  char* listing;          // names as tree_list returns them
+};
+
+// Copy of children or a removed node (if [copy] is NULL) kept in memory until
+// no snapshot of [generation] or older is live.
+// Subtree detached by tree_remove_recursive, waiting to be freed.
+typedef struct Detached {
+  Node* node;
+  uint64_t generation;    // of the change that detached it
+} Detached;
+
+typedef struct Retained {
+  uint64_t generation;
+  Node* node;
+  FolderCopy* copy;
+} Retained;
+
+struct TreeSnapshot {
+  Tree* tree;
+  uint64_t generation;
+  TreeSnapshot* older;    // live snapshots of the tree, from the oldest to the
+  TreeSnapshot* newer;    // newest one
+};
+
+// Counters validating cached paths whose first folder names have the same
+// hash modulo CACHE_SCOPES. Every change that can make a path valid or invalid
+// changes the path's first folder or one of its descendants, so it only has to
+// bump counters of its own scope.
+typedef struct CacheScope {
+  // Numbers of tree_moves that started moving and that finished moving.
+  _Alignas(CACHE_LINE) atomic_ulong moves_begun;
+  atomic_ulong moves_done;
+  atomic_ulong paths_created; // number of tree_creates and tree_moves done
+} CacheScope;
+
+// Folders whose numbers of descendants have pending differences (see
+// node_add_pending), appended by the threads using this stripe.
+typedef struct CountStripe {
+  _Alignas(CACHE_LINE) pthread_mutex_t lock; // protects the fields below
+  Node** nodes;
+  size_t count;
+  size_t capacity;
+} CountStripe;
+
+// Watches of a tree, replaced by a new list when one is added or removed.
+typedef struct WatchList {
+  size_t count;
+  TreeWatch* watches[];
+} WatchList;
+
+// Change [type] of folder [path] of [length], moved to [target] of
+// [target_length] for TREE_EVENT_MOVE (NULL otherwise), with events for
+// watches reporting it, made before the change enters any node. While the
+// change occupies the changed folders, it only pushes them.
+typedef struct Notice {
+  TreeEventType type;
+  const char* path;
+  size_t length;
+  const char* target;
+  size_t target_length;
+  WatchList* list;        // watches the events were made for, NULL if none
+  TreeEvent** events;     // event for every watch of [list], NULL if the watch
+                          // does not report the change or has its event pushed
+  TreeEvent* inline_events[NOTICE_INLINE_EVENTS];
+} Notice;
+
 struct Tree {
-  Node* root; // pointer to Node representing folder "/"
+  Node* root;                     // pointer to Node representing folder "/"
+  Slab* nodes;                    // memory of all Nodes
+  PathCache* cache;               // NULL if path cache is disabled
+  CacheScope* cache_scopes;       // CACHE_SCOPES of them, NULL if path cache
+                                  // is disabled
+  Journal* journal;               // NULL if tree is not opened by tree_open
+  pthread_rwlock_t checkpoint_lock; // held as reader by changing operations
+                                  // of a tree with a journal, as writer by
+                                  // tree_checkpoint to cut it
+  pthread_mutex_t checkpoint_mutex; // held during tree_checkpoint
+  uint64_t checkpoint_size;       // of the journal that makes [checkpointer]
+                                  // checkpoint the tree, 0 if it never does
+  atomic_bool checkpoint_due;     // true once the journal has grown over
+                                  // [checkpoint_size] since the last checkpoint
+  bool has_checkpointer;          // true if [checkpointer] runs
+  pthread_t checkpointer;         // thread checkpointing the tree when due
+  pthread_mutex_t checkpointer_lock; // protects the field below
+  pthread_cond_t checkpointer_wakeup; // signalled when [checkpoint_due] or
+                                  // [closing] is set
+  bool closing;                   // true when [checkpointer] has to finish
+  bool has_reclaimer;             // true if [reclaimer] runs, protected by
+                                  // [reclaimer_lock]
+  pthread_t reclaimer;            // thread freeing detached subtrees
+  pthread_mutex_t reclaimer_lock; // protects the fields below
+  pthread_cond_t reclaimer_wakeup; // signalled when a subtree is detached or
+                                  // [reclaimer_closing] is set
+  Detached* detached;             // subtrees [reclaimer] has to free
+  size_t detached_count;
+  size_t detached_capacity;
+  bool reclaimer_closing;         // true when [reclaimer] has to finish once
+                                  // [detached] is empty
+  pthread_mutex_t snapshots_lock; // protects the fields below
+  TreeSnapshot* oldest_snapshot;  // NULL if there is no live snapshot
+  TreeSnapshot* newest_snapshot;
+  Retained* retained;             // copies and nodes kept for live snapshots
+  size_t retained_count;
+  size_t retained_capacity;
+  atomic_ulong snapshot_generation; // of the newest snapshot, 0 if none
+  atomic_ulong live_snapshots;    // number of snapshots not freed yet
+  CountStripe* count_stripes;     // COUNT_STRIPES of them
+  pthread_mutex_t fold_lock;      // held while pending numbers of descendants
+                                  // are folded
+  pthread_mutex_t watches_lock;   // held while [watches] are replaced
+  _Atomic(WatchList*) watches;    // NULL if there is no watch
+#ifdef TREE_STATS
+  Stats* stats;                   // counters of tree_stats
+#endif
+};
+
+// Counting of an operation for tree_stats, compiled in only with TREE_STATS.
+// COUNTING_START makes calling thread count its waits to enter nodes as waits
+// of [op], or of another one after COUNTING_AS, until COUNTING_FINISH, in the
+// same block.
+#ifdef TREE_STATS
+#define COUNTING_START(tree, op) StatsScope stats_scope = stats_start((tree)->stats, (op))
+#define COUNTING_AS(op) stats_switch(op)
+#define COUNT(op, result) stats_count(&stats_scope, (op), (result))
+#define COUNTING_FINISH() stats_finish(&stats_scope)
+
+// Operations of tree_batch counted as operations done separately.
+static const TreeStatsOp counted_ops[] = {
+  [TREE_LIST] = TREE_STATS_LIST,
+  [TREE_CREATE] = TREE_STATS_CREATE,
+  [TREE_REMOVE] = TREE_STATS_REMOVE,
 };
+#else
+#define COUNTING_START(tree, op) ((void) 0)
+#define COUNTING_AS(op) ((void) 0)
+#define COUNT(op, result) ((void) (result))
+#define COUNTING_FINISH() ((void) 0)
+#endif
+
+// Index of the CountStripe calling thread appends to, -1 before the first
+// append.
+static _Thread_local int count_stripe = -1;
+
+// Number of threads that have chosen their CountStripes, which are given in
+// turns.
+static atomic_int count_stripes_chosen = 0;
+
+// Tree whose stripe calling thread has made too long, which calling thread
+// folds when it finishes its change. NULL if there is none.
+static _Thread_local Tree* fold_due = NULL;
+
+// Appends [node] to [stripe], when calling thread holds its lock.
+static void stripe_add(CountStripe* stripe, Node* node) {
+  if (stripe->count == stripe->capacity) {
+    stripe->capacity = stripe->capacity == 0 ? 64 : 2 * stripe->capacity;
+    stripe->nodes = (Node**) safe_realloc(stripe->nodes, stripe->capacity * sizeof(Node*));
+  }
+  stripe->nodes[stripe->count++] = node;
+}
+
+// Adds [delta] to numbers of descendants of [node] and all its ancestors of
+// [tree]. Only [node]'s pending difference is changed, and [node] listed in a
+// stripe if it was not, so concurrent changes never wait for each other here.
+// Calling thread has to be in epoch critical section.
+static void count_descendants(Tree* tree, Node* node, long delta) {
+  if (delta == 0 || !node_add_pending(node, delta)) return;
+
+  if (count_stripe < 0) count_stripe = atomic_fetch_add(&count_stripes_chosen, 1) % COUNT_STRIPES;
+  CountStripe* stripe = &tree->count_stripes[count_stripe];
+  if (pthread_mutex_lock(&stripe->lock) != 0)
+    fatal("lock failed");
+  stripe_add(stripe, node);
+  if (stripe->count >= FOLD_THRESHOLD) fold_due = tree;
+  if (pthread_mutex_unlock(&stripe->lock) != 0)
+    fatal("unlock failed");
+}
+
+// Folds pending differences of numbers of descendants of [tree] listed so
+// far, passing each on to the parent until the root counts it. Calling thread
+// has to hold [tree]'s fold_lock and be in epoch critical section.
+static void fold_counts(Tree* tree) {
+  CountStripe nodes = { .nodes = NULL, .count = 0, .capacity = 0 };
+  for (int i = 0; i < COUNT_STRIPES; i++) {
+    CountStripe* stripe = &tree->count_stripes[i];
+    if (pthread_mutex_lock(&stripe->lock) != 0)
+      fatal("lock failed");
+    for (size_t j = 0; j < stripe->count; j++)
+      stripe_add(&nodes, stripe->nodes[j]);
+    stripe->count = 0;
+    if (pthread_mutex_unlock(&stripe->lock) != 0)
+      fatal("unlock failed");
+  }
+
+  // Differences of children reaching a listed parent are folded with its own.
+  while (nodes.count > 0) {
+    Node* node = nodes.nodes[--nodes.count];
+    long delta = node_take_pending(node);
+    if (delta == 0) continue;
+    Node* parent = node_add_descendants(node, delta);
+    if (parent != NULL && node_add_pending(parent, delta)) stripe_add(&nodes, parent);
+  }
+  free(nodes.nodes);
+}
+
+// Folds pending differences of numbers of descendants of [tree], waiting for
+// a concurrent fold. Calling thread has to be in epoch critical section.
+static void fold_all_counts(Tree* tree) {
+  if (pthread_mutex_lock(&tree->fold_lock) != 0)
+    fatal("lock failed");
+  fold_counts(tree);
+  if (pthread_mutex_unlock(&tree->fold_lock) != 0)
+    fatal("unlock failed");
+}
 
 Tree* tree_new() {
   Tree* tree = (Tree *) safe_malloc(sizeof(Tree));
 
-  tree->root = node_new();
+  tree->nodes = slab_new(node_memory_size());
+  tree->root = node_new(tree->nodes);
+  tree->cache = NULL;
+  tree->cache_scopes = NULL;
+  tree->journal = NULL;
+  // Changing operations keep coming as readers, so a checkpoint waiting to cut
+  // the journal would never get in otherwise.
+  pthread_rwlockattr_t attributes;
+  if (pthread_rwlockattr_init(&attributes) != 0)
+    fatal("rwlockattr init failed");
+  if (pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) != 0)
+    fatal("rwlockattr setkind failed");
+  if (pthread_rwlock_init(&tree->checkpoint_lock, &attributes) != 0)
+    fatal("rwlock init failed");
+  if (pthread_rwlockattr_destroy(&attributes) != 0)
+    fatal("rwlockattr destroy failed");
+  if (pthread_mutex_init(&tree->checkpoint_mutex, 0) != 0)
+    fatal("mutex init failed");
+  tree->checkpoint_size = CHECKPOINT_JOURNAL_SIZE;
+  atomic_init(&tree->checkpoint_due, false);
+  tree->has_checkpointer = false;
+  if (pthread_mutex_init(&tree->checkpointer_lock, 0) != 0)
+    fatal("mutex init failed");
+  if (pthread_cond_init(&tree->checkpointer_wakeup, 0) != 0)
+    fatal("cond init failed");
+  tree->closing = false;
+  tree->has_reclaimer = false;
+  if (pthread_mutex_init(&tree->reclaimer_lock, 0) != 0)
+    fatal("mutex init failed");
+  if (pthread_cond_init(&tree->reclaimer_wakeup, 0) != 0)
+    fatal("cond init failed");
+  tree->detached = NULL;
+  tree->detached_count = 0;
+  tree->detached_capacity = 0;
+  tree->reclaimer_closing = false;
+  if (pthread_mutex_init(&tree->snapshots_lock, 0) != 0)
+    fatal("mutex init failed");
+  tree->oldest_snapshot = NULL;
+  tree->newest_snapshot = NULL;
+  tree->retained = NULL;
+  tree->retained_count = 0;
+  tree->retained_capacity = 0;
+  atomic_init(&tree->snapshot_generation, 0);
+  atomic_init(&tree->live_snapshots, 0);
+  tree->count_stripes = (CountStripe*) aligned_alloc(_Alignof(CountStripe),
+                                                     COUNT_STRIPES * sizeof(CountStripe));
+  if (tree->count_stripes == NULL) fatal("aligned_alloc failed");
+  for (int i = 0; i < COUNT_STRIPES; i++) {
+    if (pthread_mutex_init(&tree->count_stripes[i].lock, 0) != 0)
+      fatal("mutex init failed");
+    tree->count_stripes[i].nodes = NULL;
+    tree->count_stripes[i].count = 0;
+    tree->count_stripes[i].capacity = 0;
+  }
+  if (pthread_mutex_init(&tree->fold_lock, 0) != 0)
+    fatal("mutex init failed");
+  if (pthread_mutex_init(&tree->watches_lock, 0) != 0)
+    fatal("mutex init failed");
+  atomic_init(&tree->watches, NULL);
+#ifdef TREE_STATS
+  tree->stats = stats_new();
+#endif
 
   return tree;
 }
 
 void tree_free(Tree* tree) {
+  if (tree->has_checkpointer) {
+    if (pthread_mutex_lock(&tree->checkpointer_lock) != 0)
+      fatal("lock failed");
+    tree->closing = true;
+    if (pthread_cond_signal(&tree->checkpointer_wakeup) != 0)
+      fatal("cond signal failed");
+    if (pthread_mutex_unlock(&tree->checkpointer_lock) != 0)
+      fatal("unlock failed");
+    if (pthread_join(tree->checkpointer, NULL) != 0)
+      fatal("join failed");
+  }
+  // Subtrees detached earlier are freed first.
+  if (pthread_mutex_lock(&tree->reclaimer_lock) != 0)
+    fatal("lock failed");
+  bool has_reclaimer = tree->has_reclaimer;
+  tree->reclaimer_closing = true;
+  if (pthread_cond_signal(&tree->reclaimer_wakeup) != 0)
+    fatal("cond signal failed");
+  if (pthread_mutex_unlock(&tree->reclaimer_lock) != 0)
+    fatal("unlock failed");
+  if (has_reclaimer && pthread_join(tree->reclaimer, NULL) != 0)
+    fatal("join failed");
+  // Listed nodes are not freed until they are folded.
+  epoch_enter();
+  fold_all_counts(tree);
+  epoch_exit();
+  // Free nodes removed earlier, which may be waiting for epochs to pass.
+  epoch_barrier();
   node_recursive_free(tree->root);
+  slab_free(tree->nodes);
+  if (tree->cache != NULL) pcache_free(tree->cache);
+  free(tree->cache_scopes);
+  if (tree->journal != NULL) journal_close(tree->journal);
+  if (pthread_rwlock_destroy(&tree->checkpoint_lock) != 0)
+    fatal("rwlock destroy failed");
+  if (pthread_mutex_destroy(&tree->checkpoint_mutex) != 0)
+    fatal("mutex destroy failed");
+  if (pthread_mutex_destroy(&tree->checkpointer_lock) != 0)
+    fatal("mutex destroy failed");
+  if (pthread_cond_destroy(&tree->checkpointer_wakeup) != 0)
+    fatal("cond destroy failed");
+  if (pthread_mutex_destroy(&tree->reclaimer_lock) != 0)
+    fatal("mutex destroy failed");
+  if (pthread_cond_destroy(&tree->reclaimer_wakeup) != 0)
+    fatal("cond destroy failed");
+  free(tree->detached);
+  if (pthread_mutex_destroy(&tree->snapshots_lock) != 0)
+    fatal("mutex destroy failed");
+  free(tree->retained);
+  for (int i = 0; i < COUNT_STRIPES; i++) {
+    if (pthread_mutex_destroy(&tree->count_stripes[i].lock) != 0)
+      fatal("mutex destroy failed");
+    free(tree->count_stripes[i].nodes);
+  }
+  free(tree->count_stripes);
+  if (pthread_mutex_destroy(&tree->fold_lock) != 0)
+    fatal("mutex destroy failed");
+  if (pthread_mutex_destroy(&tree->watches_lock) != 0)
+    fatal("mutex destroy failed");
+  free(atomic_load(&tree->watches));
+#ifdef TREE_STATS
+  stats_free(tree->stats);
+#endif
 
   free(tree);
 }
 
-// Function finding Node which represents folder with path [path] in tree
-// [tree]. If wanted Node does not exist, function returns NULL. Otherwise,
-// function returns pointer to wanted Node in occupied state. If [as_reader]
-// is equal to true, the Node is in reading state. If [as_reader] is equal to
-// false, the Node is in writing state. Calling thread should finish
-// reading/writing if wanted Node exists.
-static Node* reach_node(Tree* tree, const char* path, bool as_reader) {
-  char next_node_name[MAX_FOLDER_NAME_LENGTH + 1];
-  const char* subpath = path;
+// Enters [node]'s reading room as a reader or a writer.
+static void start_occupying(Node* node, bool as_reader) {
+  if (as_reader)
+    start_reading(node);
+  else
+    start_writing(node);
+}
+
+// Leaves [node]'s reading room as a reader or a writer.
+static void finish_occupying(Node* node, bool as_reader) {
+  if (as_reader)
+    finish_reading(node);
+  else
+    finish_writing(node);
+}
+
+// Node found by walking a path without locking.
+typedef struct Location {
+  Node* node;                                  // NULL if path does not exist
+  int depth;                                   // number of nodes in [path]
+  Node* path[MAX_OPTIMISTIC_DEPTH];            // nodes passed on the way, from the root
+  unsigned int versions[MAX_OPTIMISTIC_DEPTH]; // their versions when passed
+} Location;
+
+// Returns true if no node [location] passed changed since it was passed.
+// [locked] (which may be NULL) is a node the calling thread has started
+// writing in since then, so its version is expected to be greater by one.
+static bool check_location(Location* location, Node* locked) {
+  for (int i = 0; i < location->depth; i++) {
+    unsigned int version = location->versions[i];
+    if (location->path[i] == locked) version++;
+    if (!node_check_version(location->path[i], version)) return false;
+  }
+  return true;
+}
+
+// Walks the first [depth] folders of [path] without locking. Returns false if
+// concurrent operations interfered or the path is too deep. Otherwise, returns
+// true and fills [*location]. If the path does not exist, it did not exist at
+// some moment of the call. If it exists, [location]'s node is at this path as
+// long as check_location() succeeds. Calling thread has to be in epoch
+// critical section.
+static bool locate_node(Tree* tree, const ParsedPath* path, int depth, Location* location) {
+  Node* current_node = tree->root;
+  unsigned int version = node_read_version(current_node);
+  location->depth = 0;
+
+  for (int i = 0; i < depth; i++) {
+    if (version % 2 == 1 || location->depth == MAX_OPTIMISTIC_DEPTH) return false;
+
+    location->path[location->depth] = current_node;
+    location->versions[location->depth] = version;
+    location->depth++;
+
+    Node* next_node = hmap_get_key(node_get_children(current_node), path_name_key(path, i));
+    if (next_node == NULL) {
+      if (!check_location(location, NULL)) return false;
+      location->node = NULL;
+      return true;
+    }
+
+    // [next_node] is valid only if [current_node] did not change while
+    // looking it up and reading its version.
+    unsigned int next_version = node_read_version(next_node);
+    if (!node_check_version(current_node, version)) return false;
+
+    current_node = next_node;
+    version = next_version;
+  }
+
+  location->node = current_node;
+  return true;
+}
+
+// Tries to do the same as reach_node() without locking nodes on the path,
+// except for the wanted one. Returns false if concurrent operations interfered,
+// in which case nothing is locked. Otherwise, returns true and sets [*result]
+// as reach_node() would return. Calling thread has to be in epoch critical
+// section.
+static bool reach_node_optimistic(Tree* tree, const ParsedPath* path, int depth,
+                                  bool as_reader, Node** result) {
+  Location location;
+  if (!locate_node(tree, path, depth, &location)) return false;
+  if (location.node == NULL) {
+    *result = NULL;
+    return true;
+  }
+
+  start_occupying(location.node, as_reader);
+  if (!check_location(&location, NULL)) {
+    finish_occupying(location.node, as_reader);
+    return false;
+  }
+
+  *result = location.node;
+  return true;
+}
+
+// Returns counters validating cached paths whose first folder name has
+// [hash], which is one of the first [path]'s if [hash] is NULL, or NULL if
+// path cache is disabled. [path] has to be a valid path other than "/".
+static CacheScope* cache_scope(Tree* tree, const char* path, const unsigned int* hash) {
+  if (tree->cache_scopes == NULL) return NULL;
+  if (hash != NULL) return &tree->cache_scopes[*hash % CACHE_SCOPES];
+  const char* end = strchr(path + 1, '/');
+  return &tree->cache_scopes[hmap_hash(path + 1, end - path - 1) % CACHE_SCOPES];
+}
+
+// Tries to do the same as reach_node() using only the path cache. Returns
+// false if the cache has no valid entry for the path, in which case nothing is
+// locked. Otherwise, returns true and sets [*result] as reach_node() would
+// return. Calling thread has to be in epoch critical section.
+static bool reach_node_cached(Tree* tree, const ParsedPath* path, int depth,
+                              CacheScope* scope, bool as_reader, Node** result) {
+  unsigned long gen;
+  void* value;
+  if (!pcache_get(tree->cache, path->path, path_prefix_length(path, depth), &gen, &value))
+    return false;
+
+  if (value == NULL) {
+    if (atomic_load(&scope->paths_created) != gen) return false;
+    *result = NULL;
+    return true;
+  }
+
+  // Node cached in the current generation cannot have been freed yet, because
+  // its entry would have been erased before.
+  if (atomic_load(&scope->moves_begun) != gen) return false;
+
+  Node* node = (Node*) value;
+  start_occupying(node, as_reader);
+  if (node_is_deleted(node) || atomic_load(&scope->moves_begun) != gen) {
+    finish_occupying(node, as_reader);
+    return false;
+  }
+
+  *result = node;
+  return true;
+}
+
+// Caches [node] reached by walking the first [depth] folders of [path] (NULL
+// if they do not exist). [moves] and [created] are numbers of finished
+// tree_moves and created paths of [scope] read before walking. [node] has to
+// be occupied by calling thread.
+static void cache_node(Tree* tree, const ParsedPath* path, int depth, Node* node,
+                       CacheScope* scope, unsigned long moves, unsigned long created) {
+  size_t length = path_prefix_length(path, depth);
+  if (node == NULL) {
+    pcache_put(tree->cache, path->path, length, created, NULL);
+    return;
+  }
+
+  // Path is valid only if no tree_move was in progress or started during the
+  // walk.
+  if (atomic_load(&scope->moves_begun) != moves) return;
+
+  pcache_put(tree->cache, path->path, length, moves, node);
+  if (node_is_deleted(node)) pcache_erase(tree->cache, path->path, length);
+}
+
+// Nodes passed by a thread walking a path locking every node, together with
+// numbers of times they had been moved when they were passed. Trails of up to
+// TRAIL_INLINE_LENGTH nodes are kept in the structure itself.
+typedef struct Trail {
+  int length;
+  Node** nodes;
+  unsigned int* moves;
+  Node* inline_nodes[TRAIL_INLINE_LENGTH];
+  unsigned int inline_moves[TRAIL_INLINE_LENGTH];
+} Trail;
+
+// Makes [trail] empty and able to hold [capacity] nodes.
+static void trail_init(Trail* trail, int capacity) {
+  trail->length = 0;
+  if (capacity <= TRAIL_INLINE_LENGTH) {
+    trail->nodes = trail->inline_nodes;
+    trail->moves = trail->inline_moves;
+  }
+  else {
+    trail->nodes = (Node**) safe_malloc(capacity * sizeof(Node*));
+    trail->moves = (unsigned int*) safe_malloc(capacity * sizeof(unsigned int));
+  }
+}
+
+static void trail_destroy(Trail* trail) {
+  if (trail->nodes != trail->inline_nodes) {
+    free(trail->nodes);
+    free(trail->moves);
+  }
+}
+
+// Adds [node] to [trail]. Calling thread has to occupy [node]'s parent.
+static void trail_add(Trail* trail, Node* node) {
+  trail->nodes[trail->length] = node;
+  trail->moves[trail->length] = node_get_moves(node);
+  trail->length++;
+}
+
+// Returns true if no node in [trail] has been moved since it was passed.
+static bool trail_check(Trail* trail) {
+  for (int i = 0; i < trail->length; i++) {
+    if (node_get_moves(trail->nodes[i]) != trail->moves[i]) return false;
+  }
+  return true;
+}
+
+// Does the same as reach_node() locking every node on the path, adding nodes
+// passed below the root to [trail].
+static Node* walk_locking(Tree* tree, const ParsedPath* path, int depth, bool as_reader, Trail* trail) {
   Node* current_node = tree->root;
   Node* next_node;
 
-  if (strcmp(path, "/") == 0 && !as_reader) {
+  if (depth == 0 && !as_reader) {
     start_writing(current_node);
   }
   else {
     start_reading(current_node);
   }
 
-  while ((subpath = split_path(subpath, next_node_name)) != NULL) {
-    next_node = hmap_get(node_get_children(current_node), next_node_name);
+  for (int i = 0; i < depth; i++) {
+    next_node = hmap_get_key(node_get_children(current_node), path_name_key(path, i));
     if (next_node == NULL) {
       finish_reading(current_node);
       return NULL;
     }
-    else if (strcmp(subpath, "/") != 0 || as_reader){
+    else if (i + 1 < depth || as_reader){
       start_reading(next_node);
     }
     else {
       start_writing(next_node);
     }
+    trail_add(trail, next_node);
 
     // Finishing reading in [current_node] after starting reading/writing
     // in [next_node] is necessary. Without this, for example, other thread
@@ -120,27 +792,76 @@ static Node* reach_node(Tree* tree, const char* path, bool as_reader) {
   return current_node;
 }
 
-// Similar function to reach_node(). This time searching starts in Node [start]
-// which has to be in writing state by calling thread. Wanted Node, if exists,
-// is always in writing state after function call.
-static Node* reach_node_from(Node* start, const char* path) {
-  char next_node_name[MAX_FOLDER_NAME_LENGTH + 1];
-  const char* subpath = path;
+// Does the same as reach_node() without using the path cache.
+static Node* walk_to_node(Tree* tree, const ParsedPath* path, int depth, bool as_reader) {
+  Node* result;
+  for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+    if (reach_node_optimistic(tree, path, depth, as_reader, &result))
+      return result;
+  }
+
+  // Nodes left behind may be moved in the meantime, which makes the path
+  // invalid.
+  Trail trail;
+  trail_init(&trail, depth);
+  while (true) {
+    result = walk_locking(tree, path, depth, as_reader, &trail);
+    if (trail_check(&trail)) break;
+    if (result != NULL) finish_occupying(result, as_reader);
+    trail.length = 0;
+  }
+  trail_destroy(&trail);
+
+  return result;
+}
+
+// Function finding Node which represents folder made of the first [depth]
+// folders of [path] in tree [tree]. If wanted Node does not exist, function
+// returns NULL. Otherwise,
+// function returns pointer to wanted Node in occupied state. If [as_reader]
+// is equal to true, the Node is in reading state. If [as_reader] is equal to
+// false, the Node is in writing state. Calling thread should finish
+// reading/writing if wanted Node exists. Calling thread has to be in epoch
+// critical section.
+static Node* reach_node(Tree* tree, const ParsedPath* path, int depth, bool as_reader) {
+  if (tree->cache == NULL || depth == 0)
+    return walk_to_node(tree, path, depth, as_reader);
+
+  CacheScope* scope = cache_scope(tree, path->path, &path->names[0].hash);
+  Node* result;
+  bool hit = reach_node_cached(tree, path, depth, scope, as_reader, &result);
+  pcache_count(tree->cache, hit);
+  if (hit) return result;
+
+  unsigned long moves = atomic_load(&scope->moves_done);
+  unsigned long created = atomic_load(&scope->paths_created);
+  result = walk_to_node(tree, path, depth, as_reader);
+  cache_node(tree, path, depth, result, scope, moves, created);
+  return result;
+}
+
+// Similar function to walk_locking(). This time searching starts in Node
+// [start] at [start_depth] of [path], which has to be in writing state by
+// calling thread. Wanted Node, if exists, is always in writing state after
+// function call.
+static Node* reach_node_from(Node* start, const ParsedPath* path, int start_depth, int depth,
+                             Trail* trail) {
   Node* current_node = start;
   Node* next_node;
 
-  while ((subpath = split_path(subpath, next_node_name)) != NULL) {
-    next_node = hmap_get(node_get_children(current_node), next_node_name);
+  for (int i = start_depth; i < depth; i++) {
+    next_node = hmap_get_key(node_get_children(current_node), path_name_key(path, i));
     if (next_node == NULL) {
       if (current_node != start) finish_reading(current_node);
       return NULL;
     }
-    else if (strcmp(subpath, "/") != 0) {
+    else if (i + 1 < depth) {
       start_reading(next_node);
     }
     else {
       start_writing(next_node);
     }
+    trail_add(trail, next_node);
 
     if (current_node != start) finish_reading(current_node);
 
@@ -150,156 +871,2207 @@ static Node* reach_node_from(Node* start, const char* path) {
   return current_node;
 }
 
-char* tree_list(Tree* tree, const char* path) {
-  if (!is_path_valid(path)) return NULL;
+// Functions list_folder(), create_folder(), remove_folder() and move_folder()
+// implement corresponding tree operations. Calling thread has to be in epoch
+// critical section.
 
-  Node* node = reach_node(tree, path, true);
-  if (node == NULL) return NULL;
+static int list_folder(Tree* tree, const char* path, char* buffer, size_t capacity, size_t* size) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
 
-  char* result = make_map_contents_string(node_get_children(node));
+  Node* node = reach_node(tree, &parsed, parsed.depth, true);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
+
+  *size = node_copy_listing(node, buffer, capacity);
 
   finish_reading(node);
 
-  return result;
+  return *size <= capacity ? 0 : ERANGE;
 }
 
-int tree_create(Tree* tree, const char* path) {
-  if (!is_path_valid(path)) return EINVAL;
-  if (strcmp(path, "/") == 0) return EEXIST;
+// Does list_folder() into a buffer of the listing's size, stored in
+// [*listing].
+static int list_folder_copy(Tree* tree, const char* path, char** listing) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
 
-  char node_name[MAX_FOLDER_NAME_LENGTH + 1];
-  char* path_to_parent = make_path_to_parent(path, node_name);
-  Node* parent = reach_node(tree, path_to_parent, false);
-  free(path_to_parent);
+  Node* node = reach_node(tree, &parsed, parsed.depth, true);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
 
-  if (parent == NULL) return ENOENT;
+  // The listing cannot change while calling thread is a reader in [node].
+  size_t size = node_copy_listing(node, NULL, 0);
+  *listing = (char*) safe_malloc(size);
+  node_copy_listing(node, *listing, size);
 
-  if (hmap_get(node_get_children(parent), node_name) != NULL) {
-    finish_writing(parent);
-    return EEXIST;
+  finish_reading(node);
+
+  return 0;
+}
+
+static int list_folder_foreach(Tree* tree, const char* path,
+                               void (*callback)(const char*, void*), void* context) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+
+  Node* node = reach_node(tree, &parsed, parsed.depth, true);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
+
+  const char* child_name;
+  void* child;
+  HashMapIterator it = hmap_iterator(node_get_children(node));
+  while (hmap_next(node_get_children(node), &it, &child_name, &child))
+    callback(child_name, context);
+
+  finish_reading(node);
+
+  return 0;
+}
+
+static int stat_folder(Tree* tree, const char* path, TreeFolderInfo* info) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+
+  Node* node = reach_node(tree, &parsed, parsed.depth, true);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
+
+  info->children = hmap_size(node_get_children(node));
+  info->descendants = node_get_descendants(node);
+
+  finish_reading(node);
+
+  return 0;
+}
+
+// Returns generation to tag a change of [tree] with, done by calling thread
+// as a writer in the changed folders: the generation of the newest snapshot,
+// or 0 if no snapshot is live. Snapshots of this generation and older ones do
+// not see the change.
+static uint64_t current_generation(Tree* tree) {
+  uint64_t generation = atomic_load(&tree->snapshot_generation);
+  return atomic_load(&tree->live_snapshots) == 0 ? 0 : generation;
+}
+
+// Child of a folder paired with its name, to be sorted by names.
+typedef struct NamedChild {
+  const char* name;
+  Node* node;
+} NamedChild;
+
+static int compare_named_children(const void* a, const void* b) {
+  return strcmp(((const NamedChild*) a)->name, ((const NamedChild*) b)->name);
+}
+
+// Returns copy of children of [node] of [generation]. Calling thread has to
+// occupy [node].
+static FolderCopy* make_copy(Node* node, uint64_t generation) {
+  HashMap* children = node_get_children(node);
+  size_t count = hmap_size(children);
+  NamedChild* sorted = (NamedChild*) safe_malloc((count + 1) * sizeof(NamedChild));
+  size_t listing_size = 1;
+  const char* child_name;
+  void* child;
+  size_t i = 0;
+  HashMapIterator it = hmap_iterator(children);
+  while (hmap_next(children, &it, &child_name, &child)) {
+    sorted[i].name = child_name;
+    sorted[i].node = (Node*) child;
+    listing_size += strlen(child_name) + 1;
+    i++;
   }
-  else {
-    Node* node = node_new();
-    hmap_insert(node_get_children(parent), node_name, node);
-    finish_writing(parent);
-    return 0;
+  if (!hmap_is_sorted(children))
+    qsort(sorted, count, sizeof(NamedChild), compare_named_children);
+  if (count > 0) listing_size--;
+
+  FolderCopy* copy = (FolderCopy*) safe_malloc(sizeof(FolderCopy) + count * sizeof(Node*) +
+                                               (count + 1) * sizeof(uint32_t) + listing_size);
+  copy->generation = generation;
+  copy->older = NULL;
+  copy->count = count;
+  copy->children = (Node**) (copy + 1);
+  copy->name_offsets = (uint32_t*) (copy->children + count);
+  copy->listing = (char*) (copy->name_offsets + count + 1);
+  size_t offset = 0;
+  for (i = 0; i < count; i++) {
+    size_t length = strlen(sorted[i].name);
+    copy->children[i] = sorted[i].node;
+    copy->name_offsets[i] = offset;
+    memcpy(copy->listing + offset, sorted[i].name, length);
+    copy->listing[offset + length] = ',';
+    offset += length + 1;
   }
+  copy->name_offsets[count] = listing_size;
+  copy->listing[listing_size - 1] = '\0';
+
+  free(sorted);
+  return copy;
 }
 
-int tree_remove(Tree* tree, const char* path) {
-  if (!is_path_valid(path)) return EINVAL;
-  if (strcmp(path, "/") == 0) return EBUSY;
+// Returns child [name] in [copy], or NULL if there is none.
+static Node* copy_get(FolderCopy* copy, HashMapKey name) {
+  size_t begin = 0;
+  size_t end = copy->count;
+  while (begin < end) {
+    size_t middle = (begin + end) / 2;
+    size_t length = copy->name_offsets[middle + 1] - copy->name_offsets[middle] - 1;
+    int order = memcmp(name.str, copy->listing + copy->name_offsets[middle],
+                       name.length < length ? name.length : length);
+    if (order == 0) order = (name.length > length) - (name.length < length);
+    if (order == 0) return copy->children[middle];
+    if (order < 0)
+      end = middle;
+    else
+      begin = middle + 1;
+  }
+  return NULL;
+}
 
-  char node_name[MAX_FOLDER_NAME_LENGTH + 1];
-  char* path_to_parent = make_path_to_parent(path, node_name);
-  Node* parent = reach_node(tree, path_to_parent, false);
-  free(path_to_parent);
-  if (parent == NULL) return ENOENT;
+// Returns copy of children [node] had when snapshot of [generation] was taken,
+// or NULL if they have not changed since. Copies of a folder are made in
+// order of generations, so it is the oldest one of [generation] or newer.
+// Calling thread has to occupy [node].
+static FolderCopy* find_copy(Node* node, uint64_t generation) {
+  FolderCopy* found = NULL;
+  for (FolderCopy* copy = (FolderCopy*) node_get_copies(node);
+       copy != NULL && copy->generation >= generation; copy = copy->older)
+    found = copy;
+  return found;
+}
 
-  if (hmap_get(node_get_children(parent), node_name) == NULL) {
-    finish_writing(parent);
-    return ENOENT;
+// Returns node of folder [path] in snapshot of [generation] of [tree], or NULL
+// if it did not exist.
+static Node* find_in_view(Tree* tree, const ParsedPath* path, uint64_t generation) {
+  Node* node = tree->root;
+  for (int i = 0; i < path->depth && node != NULL; i++) {
+    start_reading(node);
+    FolderCopy* copy = find_copy(node, generation);
+    HashMapKey name = path_name_key(path, i);
+    Node* child = copy != NULL ? copy_get(copy, name)
+                               : (Node*) hmap_get_key(node_get_children(node), name);
+    finish_reading(node);
+    node = child;
   }
+  return node;
+}
 
-  Node* node = (Node*) hmap_get(node_get_children(parent), node_name);
-  if (node == NULL) {
-    finish_writing(parent);
-    return ENOENT;
+// Keeps [copy] of children of [node], or [node] itself if [copy] is NULL,
+// until no snapshot of [generation] or older is live. Returns false if none
+// is live already, in which case nothing is kept.
+static bool retain(Tree* tree, uint64_t generation, Node* node, FolderCopy* copy) {
+  if (pthread_mutex_lock(&tree->snapshots_lock) != 0)
+    fatal("lock failed");
+  bool needed = tree->oldest_snapshot != NULL && tree->oldest_snapshot->generation <= generation;
+  if (needed) {
+    if (tree->retained_count == tree->retained_capacity) {
+      tree->retained_capacity = tree->retained_capacity == 0 ? 64 : 2 * tree->retained_capacity;
+      tree->retained = (Retained*) safe_realloc(tree->retained,
+                                                tree->retained_capacity * sizeof(Retained));
+    }
+    Retained* item = &tree->retained[tree->retained_count++];
+    item->generation = generation;
+    item->node = node;
+    item->copy = copy;
+  }
+  if (pthread_mutex_unlock(&tree->snapshots_lock) != 0)
+    fatal("unlock failed");
+  return needed;
+}
+
+// Called by a writer in [node] before a change of its children tagged with
+// [generation]. Copies the children for snapshots that must not see the
+// change, unless a change of this generation has copied them already.
+static void preserve_folder(Tree* tree, Node* node, uint64_t generation) {
+  FolderCopy* newest = (FolderCopy*) node_get_copies(node);
+  if (generation == 0 || (newest != NULL && newest->generation >= generation)) return;
+
+  FolderCopy* copy = make_copy(node, generation);
+  copy->older = newest;
+  if (retain(tree, generation, node, copy))
+    node_set_copies(node, copy);
+  else
+    free(copy);
+}
+
+// Called by a thread occupying [node] before marking it as "to_delete" in
+// a change tagged with [generation]. Keeps [node] in memory for snapshots
+// that still see it, and as long as its copies are kept, which are unlinked
+// from it when they are freed.
+static void preserve_node(Tree* tree, Node* node, uint64_t generation) {
+  FolderCopy* newest = (FolderCopy*) node_get_copies(node);
+  if (newest != NULL && newest->generation > generation) generation = newest->generation;
+  if (generation > 0 && retain(tree, generation, node, NULL)) node_pin(node);
+}
+
+// Appends to the journal of [tree] record of change [type] of folder [name] in
+// [parent], moved to [target_name] in [target_parent] for JOURNAL_MOVE.
+// Returns identifier of the created folder for JOURNAL_CREATE.
+static uint64_t log_change(Tree* tree, JournalRecordType type, Node* parent, HashMapKey name,
+                           Node* target_parent, HashMapKey target_name) {
+  JournalRecord record;
+  record.type = type;
+  record.parent = node_get_id(parent);
+  record.name = name;
+  record.target_parent = target_parent == NULL ? 0 : node_get_id(target_parent);
+  record.target_name = target_name;
+  record.id = 0;
+  return journal_append(tree->journal, &record);
+}
+
+// Makes [notice] of a change as described at Notice, with no events.
+static void init_notice(Notice* notice, TreeEventType type, const char* path, size_t length,
+                        const char* target, size_t target_length) {
+  notice->type = type;
+  notice->path = path;
+  notice->length = length;
+  notice->target = target;
+  notice->target_length = target_length;
+  notice->list = NULL;
+  notice->events = notice->inline_events;
+}
+
+static bool reports(TreeWatch* watch, const Notice* notice) {
+  return watch_matches(watch, notice->path, notice->length) ||
+         (notice->target != NULL && watch_matches(watch, notice->target, notice->target_length));
+}
+
+static TreeEvent* make_event(const Notice* notice) {
+  return watch_event_new(notice->type, notice->path, notice->length, notice->target,
+                         notice->target_length);
+}
+
+// Makes events of [notice] initialized by init_notice() for the current
+// watches of [tree]. Calling thread has to be in epoch critical section until
+// finish_notice().
+static void prepare_notice(Tree* tree, Notice* notice) {
+  notice->list = atomic_load(&tree->watches);
+  if (notice->list == NULL) return;
+  if (notice->list->count > NOTICE_INLINE_EVENTS)
+    notice->events = (TreeEvent**) safe_malloc(notice->list->count * sizeof(TreeEvent*));
+  for (size_t i = 0; i < notice->list->count; i++)
+    notice->events[i] = reports(notice->list->watches[i], notice) ? make_event(notice) : NULL;
+}
+
+// Reports change of [notice] to watches of [tree]. Calling thread has to be in
+// epoch critical section and occupy the changed folders, so that changes of
+// every folder are reported in order. Events made beforehand are only pushed,
+// except for watches added after they were made.
+static void notify(Tree* tree, Notice* notice) {
+  WatchList* list = atomic_load(&tree->watches);
+  if (list == NULL) return;
+  for (size_t i = 0; i < list->count; i++) {
+    TreeWatch* watch = list->watches[i];
+    size_t j = 0;
+    if (list == notice->list) {
+      j = i;
+    }
+    else {
+      size_t count = notice->list == NULL ? 0 : notice->list->count;
+      while (j < count && notice->list->watches[j] != watch) j++;
+      if (j == count) {
+        if (!reports(watch, notice)) continue;
+        TreeEvent* event = make_event(notice);
+        if (!watch_push(watch, event)) free(event);
+        continue;
+      }
+    }
+
+    TreeEvent* event = notice->events[j];
+    // Event dropped by a full watch is freed with the others not pushed.
+    if (event != NULL && watch_push(watch, event)) notice->events[j] = NULL;
   }
+}
+
+// Frees events of [notice] that have not been pushed.
+static void finish_notice(Notice* notice) {
+  if (notice->list == NULL) return;
+  for (size_t i = 0; i < notice->list->count; i++)
+    free(notice->events[i]);
+  if (notice->events != notice->inline_events) free(notice->events);
+}
+
+// Finishes tree_create of folder of [notice], when calling thread is a writer
+// in [parent]. Returns result of tree_create and leaves [parent] occupied.
+// Adds the change of number of descendants of [parent] to [*descendants], for
+// the caller to count.
+static int create_locked(Tree* tree, Node* parent, HashMapKey node_name, Notice* notice,
+                         long* descendants) {
+  if (hmap_get_key(node_get_children(parent), node_name) != NULL) return EEXIST;
+
+  preserve_folder(tree, parent, current_generation(tree));
+  Node* node = node_new(tree->nodes);
+  if (tree->journal != NULL)
+    node_set_id(node, log_change(tree, JOURNAL_CREATE, parent, node_name, NULL, node_name));
+  node_set_parent(node, parent);
+  *descendants += 1;
+  hmap_insert_key(node_get_children(parent), node_name, node);
+  CacheScope* scope = cache_scope(tree, notice->path, NULL);
+  if (scope != NULL) atomic_fetch_add(&scope->paths_created, 1);
+  notify(tree, notice);
+  if (tree->journal != NULL) journal_commit(tree->journal, true);
+  return 0;
+}
+
+// Finishes tree_remove of folder of [notice], when calling thread is a writer
+// in [parent]. Returns result of tree_remove and leaves [parent] occupied.
+// Adds the change of number of descendants of [parent] to [*descendants], for
+// the caller to count.
+static int remove_locked(Tree* tree, Node* parent, HashMapKey node_name, Notice* notice,
+                         long* descendants) {
+  Node* node = (Node*) hmap_get_key(node_get_children(parent), node_name);
+  if (node == NULL) return ENOENT;
 
+  // Writers waiting in [node] have not checked yet if their paths are still
+  // valid (the others would keep [parent] occupied), so they are ignored.
   start_reading(node);
-  if (hmap_size(node_get_children(node)) + node_get_waiting_writers(node) > 0) {
+  if (hmap_size(node_get_children(node)) > 0) {
     finish_reading(node);
-    finish_writing(parent);
     return ENOTEMPTY;
   }
-  else {
-    hmap_remove(node_get_children(parent), node_name);
-    node_set_to_delete(node);
-    finish_reading(node);
+
+  uint64_t generation = current_generation(tree);
+  preserve_folder(tree, parent, generation);
+  preserve_node(tree, node, generation);
+  if (tree->journal != NULL)
+    log_change(tree, JOURNAL_REMOVE, parent, node_name, NULL, node_name);
+  hmap_remove_key(node_get_children(parent), node_name);
+  *descendants -= node_set_parent(node, NULL);
+  node_set_to_delete(node);
+  if (tree->cache != NULL) pcache_erase(tree->cache, notice->path, notice->length);
+  notify(tree, notice);
+  finish_reading(node);
+  if (tree->journal != NULL) journal_commit(tree->journal, true);
+  return 0;
+}
+
+static int create_folder(Tree* tree, const char* path) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+  if (parsed.depth == 0) return EEXIST;
+
+  Notice notice;
+  init_notice(&notice, TREE_EVENT_CREATE, path, parsed.length, NULL, 0);
+  prepare_notice(tree, &notice);
+  Node* parent = reach_node(tree, &parsed, parsed.depth - 1, false);
+  int result = ENOENT;
+  if (parent != NULL) {
+    long descendants = 0;
+    result = create_locked(tree, parent, path_name_key(&parsed, parsed.depth - 1), &notice,
+                           &descendants);
+    count_descendants(tree, parent, descendants);
     finish_writing(parent);
-    return 0;
   }
+  finish_notice(&notice);
+  path_destroy(&parsed);
+  return result;
 }
 
-// Function forcing calling thread to wait until all operations in [node]'s
-// subtree are finished. [node] has to be in writing state by calling thread.
-static void finish_operations_in_subtree(Node* node) {
-  start_cleaning(node);
+static int remove_folder(Tree* tree, const char* path) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+  if (parsed.depth == 0) return EBUSY;
 
-  const char* child_name;
-  void* child;
-  HashMapIterator it = hmap_iterator(node_get_children(node));
-  while (hmap_next(node_get_children(node), &it, &child_name, &child))
-    finish_operations_in_subtree((Node*) child);
+  Notice notice;
+  init_notice(&notice, TREE_EVENT_REMOVE, path, parsed.length, NULL, 0);
+  prepare_notice(tree, &notice);
+  Node* parent = reach_node(tree, &parsed, parsed.depth - 1, false);
+  int result = ENOENT;
+  if (parent != NULL) {
+    long descendants = 0;
+    result = remove_locked(tree, parent, path_name_key(&parsed, parsed.depth - 1), &notice,
+                           &descendants);
+    count_descendants(tree, parent, descendants);
+    finish_writing(parent);
+  }
+  finish_notice(&notice);
+  path_destroy(&parsed);
+  return result;
 }
 
-// Function freeing memory pointed by 3 pointers to char. It shortens tree_move.
-static void free_three_strings(char* string1, char* string2, char* string3) {
-  free(string1);
-  free(string2);
-  free(string3);
-}
+// Detaches folder [path] and its descendants from the tree and stores its node
+// in [*detached] and generation of the change in [*generation]. Returns result
+// of tree_remove_recursive.
+static int detach_folder(Tree* tree, const char* path, Node** detached, uint64_t* generation) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+  if (parsed.depth == 0) return EBUSY;
 
-int tree_move(Tree* tree, const char* source, const char* target) {
-  if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
-  if (strcmp(source, "/") == 0) return EBUSY;
-  if (strcmp(target, "/") == 0) return EEXIST;
-  if (strncmp(source, target, strlen(source)) == 0 && strcmp(source, target) != 0) return EMOVETOSUBTREE;
-
-  char source_name[MAX_FOLDER_NAME_LENGTH + 1];
-  char* path_to_source_parent = make_path_to_parent(source, source_name);
-  char target_name[MAX_FOLDER_NAME_LENGTH + 1];
-  char* path_to_target_parent = make_path_to_parent(target, target_name);
-  char* path_to_lca = make_path_to_lca(path_to_source_parent, path_to_target_parent);
-
-  Node* lca = reach_node(tree, path_to_lca, false);
-  if (lca == NULL) {
-    free_three_strings(path_to_source_parent, path_to_target_parent, path_to_lca);
+  Notice notice;
+  init_notice(&notice, TREE_EVENT_REMOVE, path, parsed.length, NULL, 0);
+  prepare_notice(tree, &notice);
+  Node* parent = reach_node(tree, &parsed, parsed.depth - 1, false);
+  if (parent == NULL) {
+    finish_notice(&notice);
+    path_destroy(&parsed);
     return ENOENT;
   }
 
-  Node* source_parent = reach_node_from(lca, path_to_source_parent + strlen(path_to_lca) - 1);
-  if (source_parent == NULL) {
-    finish_writing(lca);
-    free_three_strings(path_to_source_parent, path_to_target_parent, path_to_lca);
-    return ENOENT;
+  HashMapKey node_name = path_name_key(&parsed, parsed.depth - 1);
+  Node* node = (Node*) hmap_get_key(node_get_children(parent), node_name);
+  if (node != NULL) {
+    // Cached paths in the subtree become invalid, as after tree_move.
+    CacheScope* scope = cache_scope(tree, path, &parsed.names[0].hash);
+    if (scope != NULL) atomic_fetch_add(&scope->moves_begun, 1);
+    *generation = current_generation(tree);
+    preserve_folder(tree, parent, *generation);
+    if (tree->journal != NULL)
+      log_change(tree, JOURNAL_REMOVE_RECURSIVE, parent, node_name, NULL, node_name);
+    hmap_remove_key(node_get_children(parent), node_name);
+    count_descendants(tree, parent, -node_set_parent(node, NULL));
+    if (scope != NULL) atomic_fetch_add(&scope->moves_done, 1);
+    notify(tree, &notice);
+    if (tree->journal != NULL) journal_commit(tree->journal, true);
   }
+  finish_writing(parent);
+  finish_notice(&notice);
+  path_destroy(&parsed);
 
-  Node* target_parent = reach_node_from(lca, path_to_target_parent + strlen(path_to_lca) - 1);
-  free_three_strings(path_to_source_parent, path_to_target_parent, path_to_lca);
-  if (target_parent == NULL) {
-    finish_writing(lca);
-    if (lca != source_parent) finish_writing(source_parent);
-    return ENOENT;
+  *detached = node;
+  return node == NULL ? ENOENT : 0;
+}
+
+// Frees [node] and its descendants, detached by a change tagged with
+// [generation]. No one else frees them, so they stay in memory until they are
+// reached here.
+static void reclaim_subtree(Tree* tree, Node* node, uint64_t generation) {
+  size_t count = 1;
+  size_t capacity = 64;
+  Node** stack = (Node**) safe_malloc(capacity * sizeof(Node*));
+  stack[0] = node;
+
+  while (count > 0) {
+    Node* current = stack[--count];
+    start_writing(current);
+    node_count_move(current);
+
+    const char* child_name;
+    void* child;
+    HashMapIterator it = hmap_iterator(node_get_children(current));
+    while (hmap_next(node_get_children(current), &it, &child_name, &child)) {
+      if (count == capacity) {
+        capacity *= 2;
+        stack = (Node**) safe_realloc(stack, capacity * sizeof(Node*));
+      }
+      stack[count++] = (Node*) child;
+      // Pending differences of the child are not passed to [current], which
+      // may be freed before them.
+      node_set_parent((Node*) child, NULL);
+    }
+
+    // Last thread leaving [current] frees it.
+    preserve_node(tree, current, generation);
+    node_set_to_delete(current);
+    finish_writing(current);
   }
 
-  Node* source_node = (Node*) hmap_get(node_get_children(source_parent), source_name);
+  free(stack);
+}
 
-  if (source_node == NULL) {
-    finish_writing(lca);
-    if (lca != source_parent) finish_writing(source_parent);
-    if (lca != target_parent) finish_writing(target_parent);
-    return ENOENT;
+// Frees subtrees detached from [tree] until it is freed.
+static void* run_reclaimer(void* data) {
+  Tree* tree = (Tree*) data;
+  if (pthread_mutex_lock(&tree->reclaimer_lock) != 0)
+    fatal("lock failed");
+  while (true) {
+    while (!tree->reclaimer_closing && tree->detached_count == 0) {
+      if (pthread_cond_wait(&tree->reclaimer_wakeup, &tree->reclaimer_lock) != 0)
+        fatal("cond wait failed");
+    }
+    if (tree->detached_count == 0) break;
+    Detached detached = tree->detached[--tree->detached_count];
+    if (pthread_mutex_unlock(&tree->reclaimer_lock) != 0)
+      fatal("unlock failed");
+    // Waits for operations in the subtree are still waits of the removal.
+    COUNTING_START(tree, TREE_STATS_REMOVE_RECURSIVE);
+    reclaim_subtree(tree, detached.node, detached.generation);
+    COUNTING_FINISH();
+    if (pthread_mutex_lock(&tree->reclaimer_lock) != 0)
+      fatal("lock failed");
   }
+  if (pthread_mutex_unlock(&tree->reclaimer_lock) != 0)
+    fatal("unlock failed");
 
-  if (hmap_get(node_get_children(target_parent), target_name) != NULL) {
-    finish_writing(lca);
-    if (lca != source_parent) finish_writing(source_parent);
-    if (lca != target_parent) finish_writing(target_parent);
+  return tree;
+}
 
-    if (strcmp(source, target) == 0) return 0;
-    return EEXIST;
+// Makes the reclaimer of [tree] free [node] and its descendants, detached by
+// a change tagged with [generation], starting the reclaimer if it does not
+// run yet.
+static void hand_to_reclaimer(Tree* tree, Node* node, uint64_t generation) {
+  if (pthread_mutex_lock(&tree->reclaimer_lock) != 0)
+    fatal("lock failed");
+  if (!tree->has_reclaimer) {
+    if (pthread_create(&tree->reclaimer, NULL, run_reclaimer, tree) != 0)
+      fatal("pthread_create failed");
+    tree->has_reclaimer = true;
   }
+  if (tree->detached_count == tree->detached_capacity) {
+    tree->detached_capacity = tree->detached_capacity == 0 ? 8 : 2 * tree->detached_capacity;
+    tree->detached = (Detached*) safe_realloc(tree->detached,
+                                              tree->detached_capacity * sizeof(Detached));
+  }
+  tree->detached[tree->detached_count].node = node;
+  tree->detached[tree->detached_count].generation = generation;
+  tree->detached_count++;
+  if (pthread_cond_signal(&tree->reclaimer_wakeup) != 0)
+    fatal("cond signal failed");
+  if (pthread_mutex_unlock(&tree->reclaimer_lock) != 0)
+    fatal("unlock failed");
+}
+
+// Finishes tree_move of [source_path] to [target_path], when calling thread is
+// a writer in [source_parent] and [target_parent] (one node if they are
+// equal), reporting it with [notice]. Returns result of tree_move and leaves
+// both nodes occupied.
+static int move_locked(Tree* tree, Node* source_parent, const ParsedPath* source_path,
+                       Node* target_parent, const ParsedPath* target_path, bool same_path,
+                       Notice* notice) {
+  HashMapKey source_name = path_name_key(source_path, source_path->depth - 1);
+  HashMapKey target_name = path_name_key(target_path, target_path->depth - 1);
+  Node* source_node = (Node*) hmap_get_key(node_get_children(source_parent), source_name);
+  if (source_node == NULL) return ENOENT;
+
+  if (hmap_get_key(node_get_children(target_parent), target_name) != NULL)
+    return same_path ? 0 : EEXIST;
 
-  finish_operations_in_subtree(source_node);
+  // From now on cached paths in source's subtree are invalid, and threads
+  // walking them locking every node will notice that their paths changed.
+  CacheScope* source_scope = cache_scope(tree, source_path->path, &source_path->names[0].hash);
+  CacheScope* target_scope = cache_scope(tree, target_path->path, &target_path->names[0].hash);
+  if (source_scope != NULL) atomic_fetch_add(&source_scope->moves_begun, 1);
+  node_count_move(source_node);
 
-  hmap_insert(node_get_children(target_parent), target_name, source_node);
-  hmap_remove(node_get_children(source_parent), source_name);
+  uint64_t generation = current_generation(tree);
+  preserve_folder(tree, source_parent, generation);
+  if (target_parent != source_parent) preserve_folder(tree, target_parent, generation);
 
-  finish_writing(lca);
-  if (lca != source_parent) finish_writing(source_parent);
-  if (lca != target_parent) finish_writing(target_parent);
+  if (tree->journal != NULL)
+    log_change(tree, JOURNAL_MOVE, source_parent, source_name, target_parent, target_name);
+  hmap_insert_key(node_get_children(target_parent), target_name, source_node);
+  hmap_remove_key(node_get_children(source_parent), source_name);
+  if (target_parent != source_parent) {
+    long count = node_set_parent(source_node, target_parent);
+    count_descendants(tree, source_parent, -count);
+    count_descendants(tree, target_parent, count);
+  }
+
+  if (source_scope != NULL) {
+    atomic_fetch_add(&target_scope->paths_created, 1);
+    atomic_fetch_add(&source_scope->moves_done, 1);
+  }
+  notify(tree, notice);
+  if (tree->journal != NULL) journal_commit(tree->journal, true);
 
   return 0;
 }
+
+// Tries to do tree_move of [source_path] to [target_path] locking only
+// source's parent and target's parent, found without locking. Returns false if
+// concurrent operations interfered, in which case nothing changed. Otherwise,
+// returns true and sets [*result] to the result of tree_move. Calling thread
+// has to be in epoch critical section.
+static bool move_optimistic(Tree* tree, const ParsedPath* source_path,
+                            const ParsedPath* target_path, bool same_path, Notice* notice,
+                            int* result) {
+  Location source, target;
+  if (!locate_node(tree, source_path, source_path->depth - 1, &source) ||
+      !locate_node(tree, target_path, target_path->depth - 1, &target))
+    return false;
+  if (source.node == NULL || target.node == NULL) {
+    *result = ENOENT;
+    return true;
+  }
+
+  // Waiting for the second node while holding the first one could deadlock
+  // with threads locking nodes from the root down, so the second one is only
+  // tried. Nodes are taken in order of addresses, so two moves of the same
+  // pair of parents wait for each other instead of failing both.
+  Node* first = source.node < target.node ? source.node : target.node;
+  Node* second = source.node < target.node ? target.node : source.node;
+  start_writing(first);
+  if (second != first && !try_start_writing(second)) {
+    finish_writing(first);
+    return false;
+  }
+
+  if (!check_location(&source, target.node) || !check_location(&target, source.node)) {
+    finish_writing(first);
+    if (second != first) finish_writing(second);
+    return false;
+  }
+
+  *result = move_locked(tree, source.node, source_path, target.node, target_path, same_path,
+                        notice);
+
+  finish_writing(first);
+  if (second != first) finish_writing(second);
+  return true;
+}
+
+// Tries to do tree_move being a writer in lca(source's parent, target's
+// parent) and locking every node on the way. Returns false if a node on the
+// way was moved in the meantime, in which case nothing changed. Otherwise,
+// returns true and sets [*result] to the result of tree_move. Calling thread
+// has to be in epoch critical section.
+static bool move_through_lca(Tree* tree, const ParsedPath* source_path,
+                             const ParsedPath* target_path, bool same_path, Notice* notice,
+                             int* result) {
+  int source_parent_depth = source_path->depth - 1;
+  int target_parent_depth = target_path->depth - 1;
+  int lca_depth = path_common_depth(source_path, source_parent_depth,
+                                    target_path, target_parent_depth);
+  Trail trail;
+  trail_init(&trail, source_parent_depth + target_parent_depth);
+  Node* lca = NULL;
+  Node* source_parent = NULL;
+  Node* target_parent = NULL;
+
+  lca = walk_locking(tree, source_path, lca_depth, false, &trail);
+  if (lca != NULL)
+    source_parent = reach_node_from(lca, source_path, lca_depth, source_parent_depth, &trail);
+  if (source_parent != NULL)
+    target_parent = reach_node_from(lca, target_path, lca_depth, target_parent_depth, &trail);
+
+  bool valid = trail_check(&trail);
+  trail_destroy(&trail);
+  if (valid) {
+    if (target_parent == NULL)
+      *result = ENOENT;
+    else
+      *result = move_locked(tree, source_parent, source_path, target_parent, target_path,
+                            same_path, notice);
+  }
+
+  if (lca != NULL) finish_writing(lca);
+  if (source_parent != NULL && lca != source_parent) finish_writing(source_parent);
+  if (target_parent != NULL && lca != target_parent) finish_writing(target_parent);
+
+  return valid;
+}
+
+// Does move_folder() with parsed paths.
+static int move_parsed(Tree* tree, const ParsedPath* source_path, const ParsedPath* target_path) {
+  if (source_path->depth == 0) return EBUSY;
+  if (target_path->depth == 0) return EEXIST;
+  bool same_path = source_path->length == target_path->length &&
+                   memcmp(source_path->path, target_path->path, source_path->length) == 0;
+  if (source_path->length < target_path->length &&
+      memcmp(source_path->path, target_path->path, source_path->length) == 0)
+    return EMOVETOSUBTREE;
+
+  Notice notice;
+  init_notice(&notice, TREE_EVENT_MOVE, source_path->path, source_path->length,
+              target_path->path, target_path->length);
+  prepare_notice(tree, &notice);
+  int result;
+  bool done = false;
+  for (int attempt = 0; attempt < MOVE_ATTEMPTS && !done; attempt++) {
+    done = move_optimistic(tree, source_path, target_path, same_path, &notice, &result);
+    if (!done) sched_yield();
+  }
+  while (!done) {
+    done = move_through_lca(tree, source_path, target_path, same_path, &notice, &result);
+  }
+  finish_notice(&notice);
+
+  return result;
+}
+
+static int move_folder(Tree* tree, const char* source, const char* target) {
+  ParsedPath source_path, target_path;
+  if (!parse_path(source, &source_path)) return EINVAL;
+  if (!parse_path(target, &target_path)) {
+    path_destroy(&source_path);
+    return EINVAL;
+  }
+
+  int result = move_parsed(tree, &source_path, &target_path);
+  path_destroy(&source_path);
+  path_destroy(&target_path);
+  return result;
+}
+
+// Parses path of [op] into [*path] and returns depth of the folder [op] is
+// done in: the listed folder or the parent of the folder to create or remove.
+// If [op] can be finished without reaching any folder, does it and returns -1,
+// and otherwise [*path] has to be freed by path_destroy().
+static int get_batch_folder_depth(TreeOp* op, ParsedPath* path) {
+  op->result = -1; // not done yet
+  op->listing = NULL;
+  if (!parse_path(op->path, path)) {
+    op->result = EINVAL;
+    return -1;
+  }
+
+  if (op->type == TREE_LIST) return path->depth;
+
+  if (path->depth == 0) {
+    op->result = op->type == TREE_CREATE ? EEXIST : EBUSY;
+    return -1;
+  }
+  return path->depth - 1;
+}
+
+// Makes [notice] of [op] creating or removing a folder, with no events.
+static void init_batch_notice(Notice* notice, const TreeOp* op) {
+  init_notice(notice, op->type == TREE_CREATE ? TREE_EVENT_CREATE : TREE_EVENT_REMOVE, op->path,
+              strlen(op->path), NULL, 0);
+}
+
+// Does [op] in folder [node] of length [folder_length] occupied by calling
+// thread, as a reader if [as_reader], reporting a change with [notice] (or
+// with no events made beforehand if it is NULL). Adds the change of number of
+// descendants of [node] to [*descendants].
+static void do_batch_op(Tree* tree, TreeOp* op, Node* node, size_t folder_length, bool as_reader,
+                        Notice* notice, long* descendants) {
+  if (op->type == TREE_LIST) {
+    if (as_reader) {
+      size_t size = node_copy_listing(node, NULL, 0);
+      op->listing = (char*) safe_malloc(size);
+      node_copy_listing(node, op->listing, size);
+    }
+    else {
+      // Listing cached in [node] is stamped with a version that does not
+      // change until calling thread leaves.
+      op->listing = make_map_contents_string(node_get_children(node));
+    }
+    op->result = 0;
+    return;
+  }
+
+  Notice empty;
+  if (notice == NULL) {
+    init_batch_notice(&empty, op);
+    notice = &empty;
+  }
+
+  // Path of [op] has been validated, so the rest of it is a name and '/'.
+  HashMapKey node_name;
+  node_name.str = op->path + folder_length;
+  node_name.length = notice->length - folder_length - 1;
+  node_name.hash = hmap_hash(node_name.str, node_name.length);
+
+  if (op->type == TREE_CREATE)
+    op->result = create_locked(tree, node, node_name, notice, descendants);
+  else
+    op->result = remove_locked(tree, node, node_name, notice, descendants);
+}
+
+// Does operations [ops], all done in folder made of the first [depth] folders
+// of [path], reaching it once. Calling thread has to be in epoch critical
+// section.
+static void do_batch_group(Tree* tree, const ParsedPath* path, int depth, TreeOp* ops, size_t count) {
+  bool as_reader = true;
+  for (size_t i = 0; i < count; i++) {
+    if (ops[i].type != TREE_LIST) as_reader = false;
+  }
+
+  // Events of changes are made before reaching the folder, if there are
+  // watches to report them to.
+  Notice* notices = NULL;
+  if (!as_reader && atomic_load(&tree->watches) != NULL) {
+    notices = (Notice*) safe_malloc(count * sizeof(Notice));
+    for (size_t i = 0; i < count; i++) {
+      init_batch_notice(&notices[i], &ops[i]);
+      if (ops[i].result == -1 && ops[i].type != TREE_LIST) prepare_notice(tree, &notices[i]);
+    }
+  }
+
+  size_t folder_length = path_prefix_length(path, depth);
+  Node* node = reach_node(tree, path, depth, as_reader);
+  // Changes of numbers of descendants of ancestors are counted once for the
+  // whole group.
+  long descendants = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (ops[i].result == -1) {
+      if (node == NULL)
+        ops[i].result = ENOENT;
+      else
+        do_batch_op(tree, &ops[i], node, folder_length, as_reader,
+                    notices == NULL ? NULL : &notices[i], &descendants);
+    }
+  }
+  if (node != NULL) {
+    count_descendants(tree, node, descendants);
+    finish_occupying(node, as_reader);
+  }
+
+  if (notices != NULL) {
+    for (size_t i = 0; i < count; i++)
+      finish_notice(&notices[i]);
+    free(notices);
+  }
+}
+
+char* tree_list(Tree* tree, const char* path) {
+  COUNTING_START(tree, TREE_STATS_LIST);
+  epoch_enter();
+  char* listing = NULL;
+  int result = list_folder_copy(tree, path, &listing);
+  epoch_exit();
+  COUNT(TREE_STATS_LIST, result);
+  COUNTING_FINISH();
+  return listing;
+}
+
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity, size_t* size) {
+  COUNTING_START(tree, TREE_STATS_LIST);
+  epoch_enter();
+  int result = list_folder(tree, path, buffer, capacity, size);
+  epoch_exit();
+  COUNT(TREE_STATS_LIST, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+int tree_list_foreach(Tree* tree, const char* path,
+                      void (*callback)(const char* name, void* context), void* context) {
+  COUNTING_START(tree, TREE_STATS_LIST);
+  epoch_enter();
+  int result = list_folder_foreach(tree, path, callback, context);
+  epoch_exit();
+  COUNT(TREE_STATS_LIST, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+int tree_stat(Tree* tree, const char* path, TreeFolderInfo* info) {
+  COUNTING_START(tree, TREE_STATS_STAT);
+  epoch_enter();
+  int result = stat_folder(tree, path, info);
+  epoch_exit();
+  COUNT(TREE_STATS_STAT, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+void tree_fold_counts(Tree* tree) {
+  epoch_enter();
+  fold_all_counts(tree);
+  epoch_exit();
+}
+
+// Starts operation changing [tree], which tree_checkpoint waits for.
+static void start_changing(Tree* tree) {
+  if (tree->journal != NULL && pthread_rwlock_rdlock(&tree->checkpoint_lock) != 0)
+    fatal("rdlock failed");
+  epoch_enter();
+}
+
+// Wakes the checkpointer of [tree] if its journal has grown to [size] and it
+// has not been woken yet.
+static void request_checkpoint(Tree* tree, uint64_t size) {
+  if (tree->checkpoint_size == 0 || size < tree->checkpoint_size ||
+      atomic_load(&tree->checkpoint_due) || atomic_exchange(&tree->checkpoint_due, true))
+    return;
+  if (pthread_mutex_lock(&tree->checkpointer_lock) != 0)
+    fatal("lock failed");
+  if (pthread_cond_signal(&tree->checkpointer_wakeup) != 0)
+    fatal("cond signal failed");
+  if (pthread_mutex_unlock(&tree->checkpointer_lock) != 0)
+    fatal("unlock failed");
+}
+
+// Finishes operation changing [tree], waiting for its changes to be durable
+// if durability of [tree] requires it. Its records are appended already, so a
+// checkpoint does not wait for them to be synced.
+static void finish_changing(Tree* tree) {
+  // Someone else folding makes the list short again anyway.
+  if (fold_due == tree) {
+    fold_due = NULL;
+    if (pthread_mutex_trylock(&tree->fold_lock) == 0) {
+      fold_counts(tree);
+      if (pthread_mutex_unlock(&tree->fold_lock) != 0)
+        fatal("unlock failed");
+    }
+  }
+  epoch_exit();
+  if (tree->journal != NULL) {
+    // A checkpoint cutting the journal later sees a smaller size.
+    request_checkpoint(tree, journal_last_size(tree->journal));
+    if (pthread_rwlock_unlock(&tree->checkpoint_lock) != 0)
+      fatal("unlock failed");
+    journal_commit(tree->journal, false);
+  }
+}
+
+int tree_create(Tree* tree, const char* path) {
+  COUNTING_START(tree, TREE_STATS_CREATE);
+  start_changing(tree);
+  int result = create_folder(tree, path);
+  finish_changing(tree);
+  COUNT(TREE_STATS_CREATE, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+int tree_remove(Tree* tree, const char* path) {
+  COUNTING_START(tree, TREE_STATS_REMOVE);
+  start_changing(tree);
+  int result = remove_folder(tree, path);
+  finish_changing(tree);
+  COUNT(TREE_STATS_REMOVE, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+int tree_remove_recursive(Tree* tree, const char* path) {
+  Node* detached;
+  uint64_t generation;
+  COUNTING_START(tree, TREE_STATS_REMOVE_RECURSIVE);
+  start_changing(tree);
+  int result = detach_folder(tree, path, &detached, &generation);
+  finish_changing(tree);
+
+  if (result == 0) hand_to_reclaimer(tree, detached, generation);
+  COUNT(TREE_STATS_REMOVE_RECURSIVE, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+int tree_move(Tree* tree, const char* source, const char* target) {
+  COUNTING_START(tree, TREE_STATS_MOVE);
+  start_changing(tree);
+  int result = move_folder(tree, source, target);
+  finish_changing(tree);
+  COUNT(TREE_STATS_MOVE, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+void tree_batch(Tree* tree, TreeOp* ops, size_t count) {
+  // Parsed paths of the first operation of the current group, which leads to
+  // its folder, and of the operation being grouped.
+  ParsedPath paths[2];
+  ParsedPath* group_path = &paths[0];
+  ParsedPath* op_path = &paths[1];
+  size_t begin = 0;
+  COUNTING_START(tree, TREE_STATS_LIST);
+  while (begin < count) {
+    // Group consists of consecutive operations done in the same folder.
+    // Operations finished without reaching it stay in the group.
+    int folder_depth = -1;
+    size_t folder_length = 0;
+    size_t end = begin;
+    for (; end < count; end++) {
+      int depth = get_batch_folder_depth(&ops[end], op_path);
+      if (depth < 0) continue;
+      size_t length = path_prefix_length(op_path, depth);
+      if (folder_depth < 0) {
+        folder_depth = depth;
+        folder_length = length;
+        ParsedPath* swap = group_path;
+        group_path = op_path;
+        op_path = swap;
+        continue;
+      }
+      bool same_folder = length == folder_length &&
+                         memcmp(ops[end].path, group_path->path, length) == 0;
+      path_destroy(op_path);
+      if (!same_folder) break;
+    }
+
+    if (folder_depth >= 0) {
+#ifdef TREE_STATS
+      // Group enters its folder as a writer for its first changing operation.
+      TreeStatsOp group_op = TREE_STATS_LIST;
+      for (size_t i = end; i-- > begin;) {
+        if (ops[i].type != TREE_LIST) group_op = counted_ops[ops[i].type];
+      }
+      COUNTING_AS(group_op);
+#endif
+      start_changing(tree);
+      do_batch_group(tree, group_path, folder_depth, ops + begin, end - begin);
+      finish_changing(tree);
+      path_destroy(group_path);
+    }
+    begin = end;
+  }
+
+#ifdef TREE_STATS
+  for (size_t i = 0; i < count; i++)
+    COUNT(counted_ops[ops[i].type], ops[i].result);
+#endif
+  COUNTING_FINISH();
+}
+
+/********************************** WALKS *************************************/
+
+// Folder waiting to be walked by tree_walk.
+typedef struct WalkEntry {
+  Node* node;
+  int depth;              // relative to the walked folder
+  size_t name_offset;     // in names of the Walker holding the entry
+  size_t name_length;
+} WalkEntry;
+
+typedef struct Walk Walk;
+
+// Thread of tree_walk. Its entries form a stack of folders to walk, whose
+// parents are all on the path it is walking, so their paths are made by
+// appending a name to a prefix of [path]. Other threads steal entries from the
+// bottom of the stack, the least deep ones, which likely have the biggest
+// subtrees.
+typedef struct Walker {
+  Walk* walk;
+  pthread_mutex_t lock;   // protects the fields below
+  WalkEntry* entries;     // [begin, end) are waiting
+  size_t begin;
+  size_t end;
+  size_t capacity;
+  char* names;            // names of entries, dropped when the stack empties
+  size_t names_size;
+  size_t names_capacity;
+  char* path;             // path of the folder being walked
+  size_t path_capacity;
+  size_t* prefix_lengths; // length of the path of its ancestor at every depth
+  int max_depth;          // number of elements of [prefix_lengths]
+} Walker;
+
+struct Walk {
+  uint64_t generation;    // of the snapshot being walked
+  bool (*callback)(const char* path, int depth, void* context);
+  void* context;
+  Walker* walkers;
+  int count;
+  atomic_long pending;    // number of entries waiting or being walked
+  atomic_bool stopped;    // true once [callback] has returned false
+};
+
+static void walker_init(Walker* walker, Walk* walk) {
+  walker->walk = walk;
+  if (pthread_mutex_init(&walker->lock, 0) != 0)
+    fatal("mutex init failed");
+  walker->entries = NULL;
+  walker->begin = 0;
+  walker->end = 0;
+  walker->capacity = 0;
+  walker->names = NULL;
+  walker->names_size = 0;
+  walker->names_capacity = 0;
+  walker->path = NULL;
+  walker->path_capacity = 0;
+  walker->prefix_lengths = NULL;
+  walker->max_depth = 0;
+}
+
+static void walker_destroy(Walker* walker) {
+  if (pthread_mutex_destroy(&walker->lock) != 0)
+    fatal("mutex destroy failed");
+  free(walker->entries);
+  free(walker->names);
+  free(walker->path);
+  free(walker->prefix_lengths);
+}
+
+// Sets path of [walker] at [depth] to [length] bytes of [prefix] followed by
+// [name] of [name_length] and '/'. [prefix] may be the path itself.
+static void walker_set_path(Walker* walker, int depth, const char* prefix, size_t length,
+                            const char* name, size_t name_length) {
+  size_t new_length = length + name_length + 1;
+  if (new_length + 1 > walker->path_capacity) {
+    walker->path_capacity = 2 * (new_length + 1);
+    char* path = (char*) safe_malloc(walker->path_capacity);
+    memcpy(path, prefix, length);
+    free(walker->path);
+    walker->path = path;
+  }
+  else if (prefix != walker->path) {
+    memcpy(walker->path, prefix, length);
+  }
+  memcpy(walker->path + length, name, name_length);
+  walker->path[new_length - 1] = '/';
+  walker->path[new_length] = '\0';
+
+  if (depth >= walker->max_depth) {
+    walker->max_depth = 2 * depth + 1;
+    walker->prefix_lengths = (size_t*) safe_realloc(walker->prefix_lengths,
+                                                    walker->max_depth * sizeof(size_t));
+  }
+  walker->prefix_lengths[depth] = new_length;
+}
+
+// Makes room for [count] more entries on the stack of [walker], whose lock
+// calling thread holds.
+static void walker_reserve(Walker* walker, size_t count) {
+  if (walker->begin > 0 && walker->end + count > walker->capacity) {
+    memmove(walker->entries, walker->entries + walker->begin,
+            (walker->end - walker->begin) * sizeof(WalkEntry));
+    walker->end -= walker->begin;
+    walker->begin = 0;
+  }
+  while (walker->end + count > walker->capacity) {
+    walker->capacity = walker->capacity == 0 ? 64 : 2 * walker->capacity;
+    walker->entries = (WalkEntry*) safe_realloc(walker->entries, walker->capacity * sizeof(WalkEntry));
+  }
+}
+
+// Pushes folder of [node] named [name] of [length] at [depth] on the stack of
+// [walker], whose lock calling thread holds and which has room for it.
+static void walker_add(Walker* walker, Node* node, const char* name, size_t length, int depth) {
+  while (walker->names_size + length > walker->names_capacity) {
+    walker->names_capacity = walker->names_capacity == 0 ? 4096 : 2 * walker->names_capacity;
+    walker->names = (char*) safe_realloc(walker->names, walker->names_capacity);
+  }
+  WalkEntry* entry = &walker->entries[walker->end++];
+  entry->node = node;
+  entry->depth = depth;
+  entry->name_offset = walker->names_size;
+  entry->name_length = length;
+  memcpy(walker->names + walker->names_size, name, length);
+  walker->names_size += length;
+}
+
+// Pushes children [node] at [depth] had in the walked snapshot on the stack of
+// [walker].
+static void walker_push_children(Walker* walker, Node* node, int depth) {
+  if (pthread_mutex_lock(&walker->lock) != 0)
+    fatal("lock failed");
+  start_reading(node);
+  FolderCopy* copy = find_copy(node, walker->walk->generation);
+  if (copy != NULL) {
+    walker_reserve(walker, copy->count);
+    for (size_t i = 0; i < copy->count; i++) {
+      walker_add(walker, copy->children[i], copy->listing + copy->name_offsets[i],
+                 copy->name_offsets[i + 1] - copy->name_offsets[i] - 1, depth + 1);
+    }
+    atomic_fetch_add(&walker->walk->pending, copy->count);
+  }
+  else {
+    HashMap* children = node_get_children(node);
+    walker_reserve(walker, hmap_size(children));
+    const char* child_name;
+    void* child;
+    HashMapIterator it = hmap_iterator(children);
+    while (hmap_next(children, &it, &child_name, &child))
+      walker_add(walker, (Node*) child, child_name, strlen(child_name), depth + 1);
+    atomic_fetch_add(&walker->walk->pending, hmap_size(children));
+  }
+  finish_reading(node);
+  if (pthread_mutex_unlock(&walker->lock) != 0)
+    fatal("unlock failed");
+}
+
+// Takes the top entry of [walker]'s own stack into [*entry] and sets its path.
+// Returns false if the stack is empty.
+static bool walker_pop(Walker* walker, WalkEntry* entry) {
+  if (pthread_mutex_lock(&walker->lock) != 0)
+    fatal("lock failed");
+  bool found = walker->begin < walker->end;
+  if (found) {
+    *entry = walker->entries[--walker->end];
+    walker_set_path(walker, entry->depth, walker->path, walker->prefix_lengths[entry->depth - 1],
+                    walker->names + entry->name_offset, entry->name_length);
+    walker->names_size = entry->name_offset;
+    if (walker->begin == walker->end) {
+      walker->begin = walker->end = 0;
+      walker->names_size = 0;
+    }
+  }
+  if (pthread_mutex_unlock(&walker->lock) != 0)
+    fatal("unlock failed");
+  return found;
+}
+
+// Takes the bottom entry of another walker's stack into [*entry] and sets its
+// path as the path of [thief]. Returns false if all stacks are empty.
+static bool walker_steal(Walker* thief, WalkEntry* entry) {
+  Walk* walk = thief->walk;
+  int self = thief - walk->walkers;
+  bool found = false;
+  for (int i = 1; i < walk->count && !found; i++) {
+    Walker* victim = &walk->walkers[(self + i) % walk->count];
+    if (pthread_mutex_lock(&victim->lock) != 0)
+      fatal("lock failed");
+    found = victim->begin < victim->end;
+    if (found) {
+      *entry = victim->entries[victim->begin++];
+      walker_set_path(thief, entry->depth, victim->path, victim->prefix_lengths[entry->depth - 1],
+                      victim->names + entry->name_offset, entry->name_length);
+      if (victim->begin == victim->end) {
+        victim->begin = victim->end = 0;
+        victim->names_size = 0;
+      }
+    }
+    if (pthread_mutex_unlock(&victim->lock) != 0)
+      fatal("unlock failed");
+  }
+  return found;
+}
+
+// Reports folder of [node] at [depth] to the callback, with path of
+// [walker], and pushes its children.
+static void walker_visit(Walker* walker, Node* node, int depth) {
+  walker_push_children(walker, node, depth);
+
+  Walk* walk = walker->walk;
+  if (!walk->callback(walker->path, depth, walk->context))
+    atomic_store(&walk->stopped, true);
+}
+
+// Walks folders of [walker]'s stack and of others' until none is left.
+static void walker_run(Walker* walker) {
+  Walk* walk = walker->walk;
+  while (!atomic_load(&walk->stopped)) {
+    WalkEntry entry;
+    if (!walker_pop(walker, &entry) && !walker_steal(walker, &entry)) {
+      // Folders being walked by others may still have children.
+      if (atomic_load(&walk->pending) == 0) break;
+      sched_yield();
+      continue;
+    }
+    walker_visit(walker, entry.node, entry.depth);
+    atomic_fetch_sub(&walk->pending, 1);
+  }
+}
+
+static void* walker_thread(void* data) {
+  walker_run((Walker*) data);
+  return NULL;
+}
+
+// Does tree_walk on [snapshot] of [tree]. Nodes waiting on stacks are kept in
+// memory by the snapshot, so no walker has to stay in epoch critical section
+// while it calls [callback].
+static int walk_folder(Tree* tree, TreeSnapshot* snapshot, const char* path,
+                       bool (*callback)(const char* path, int depth, void* context),
+                       void* context, int flags) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+
+  Node* node = find_in_view(tree, &parsed, snapshot->generation);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
+
+  Walk walk;
+  walk.generation = snapshot->generation;
+  walk.callback = callback;
+  walk.context = context;
+  walk.count = 1;
+  if (flags & TREE_WALK_PARALLEL) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.count = processors < 1 ? 1 : processors > MAX_WALK_THREADS ? MAX_WALK_THREADS : processors;
+  }
+  walk.walkers = (Walker*) safe_malloc(walk.count * sizeof(Walker));
+  for (int i = 0; i < walk.count; i++)
+    walker_init(&walk.walkers[i], &walk);
+  atomic_init(&walk.pending, 0);
+  atomic_init(&walk.stopped, false);
+
+  // Calling thread is the first walker.
+  Walker* first = &walk.walkers[0];
+  walker_set_path(first, 0, path, parsed.length - 1, "", 0);
+  walker_visit(first, node, 0);
+
+  // Walkers left without a thread, if any, have empty stacks.
+  pthread_t threads[MAX_WALK_THREADS];
+  int started = 1;
+  for (; started < walk.count; started++) {
+    if (pthread_create(&threads[started], NULL, walker_thread, &walk.walkers[started]) != 0)
+      break;
+  }
+  walker_run(first);
+  for (int i = 1; i < started; i++) {
+    if (pthread_join(threads[i], NULL) != 0)
+      fatal("join failed");
+  }
+
+  int result = atomic_load(&walk.stopped) ? ECANCELED : 0;
+  for (int i = 0; i < walk.count; i++)
+    walker_destroy(&walk.walkers[i]);
+  free(walk.walkers);
+  return result;
+}
+
+int tree_walk(Tree* tree, const char* path,
+              bool (*callback)(const char* path, int depth, void* context), void* context,
+              int flags) {
+  COUNTING_START(tree, TREE_STATS_WALK);
+  TreeSnapshot* snapshot = tree_snapshot(tree);
+  int result = walk_folder(tree, snapshot, path, callback, context, flags);
+  tree_snapshot_free(snapshot);
+  COUNT(TREE_STATS_WALK, result);
+  COUNTING_FINISH();
+  return result;
+}
+
+/************************** POINT-IN-TIME SNAPSHOTS ***************************/
+
+// Returns children [node] had when snapshot of [generation] was taken. The
+// copy is made now and has to be freed by caller if [*temporary] is set.
+static FolderCopy* view_folder(Node* node, uint64_t generation, bool* temporary) {
+  start_reading(node);
+  FolderCopy* copy = find_copy(node, generation);
+  *temporary = copy == NULL;
+  if (copy == NULL) copy = make_copy(node, generation);
+  finish_reading(node);
+  return copy;
+}
+
+TreeSnapshot* tree_snapshot(Tree* tree) {
+  TreeSnapshot* snapshot = (TreeSnapshot*) safe_malloc(sizeof(TreeSnapshot));
+  snapshot->tree = tree;
+  snapshot->newer = NULL;
+
+  if (pthread_mutex_lock(&tree->snapshots_lock) != 0)
+    fatal("lock failed");
+  // Changes are tagged with the new generation only once the snapshot is
+  // counted as live.
+  atomic_fetch_add(&tree->live_snapshots, 1);
+  snapshot->generation = atomic_fetch_add(&tree->snapshot_generation, 1) + 1;
+  snapshot->older = tree->newest_snapshot;
+  if (tree->newest_snapshot != NULL)
+    tree->newest_snapshot->newer = snapshot;
+  else
+    tree->oldest_snapshot = snapshot;
+  tree->newest_snapshot = snapshot;
+  if (pthread_mutex_unlock(&tree->snapshots_lock) != 0)
+    fatal("unlock failed");
+
+  return snapshot;
+}
+
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return NULL;
+  Node* node = find_in_view(snapshot->tree, &parsed, snapshot->generation);
+  path_destroy(&parsed);
+  if (node == NULL) return NULL;
+
+  char* listing;
+  start_reading(node);
+  FolderCopy* copy = find_copy(node, snapshot->generation);
+  if (copy != NULL) {
+    listing = (char*) safe_malloc(copy->name_offsets[copy->count]);
+    memcpy(listing, copy->listing, copy->name_offsets[copy->count]);
+  }
+  else {
+    listing = make_map_contents_string(node_get_children(node));
+  }
+  finish_reading(node);
+  return listing;
+}
+
+// State of tree_snapshot_walk.
+typedef struct SnapshotWalk {
+  uint64_t generation;
+  bool (*callback)(const char* path, int depth, void* context);
+  void* context;
+  char* path;             // of the folder being walked
+  size_t capacity;
+} SnapshotWalk;
+
+// Walks folder of [node] at [depth], whose path of [length] is in [walk].
+// Returns false if the callback stopped the walk.
+static bool walk_view(SnapshotWalk* walk, Node* node, size_t length, int depth) {
+  if (!walk->callback(walk->path, depth, walk->context)) return false;
+
+  bool temporary;
+  FolderCopy* copy = view_folder(node, walk->generation, &temporary);
+  bool go_on = true;
+  for (size_t i = 0; i < copy->count && go_on; i++) {
+    size_t name_length = copy->name_offsets[i + 1] - copy->name_offsets[i] - 1;
+    if (length + name_length + 2 > walk->capacity) {
+      walk->capacity = 2 * (length + name_length + 2);
+      walk->path = (char*) safe_realloc(walk->path, walk->capacity);
+    }
+    memcpy(walk->path + length, copy->listing + copy->name_offsets[i], name_length);
+    walk->path[length + name_length] = '/';
+    walk->path[length + name_length + 1] = '\0';
+    go_on = walk_view(walk, copy->children[i], length + name_length + 1, depth + 1);
+  }
+  walk->path[length] = '\0';
+
+  if (temporary) free(copy);
+  return go_on;
+}
+
+int tree_snapshot_walk(TreeSnapshot* snapshot, const char* path,
+                       bool (*callback)(const char* path, int depth, void* context),
+                       void* context) {
+  ParsedPath parsed;
+  if (!parse_path(path, &parsed)) return EINVAL;
+  Node* node = find_in_view(snapshot->tree, &parsed, snapshot->generation);
+  path_destroy(&parsed);
+  if (node == NULL) return ENOENT;
+
+  SnapshotWalk walk;
+  walk.generation = snapshot->generation;
+  walk.callback = callback;
+  walk.context = context;
+  walk.capacity = 2 * (parsed.length + 1);
+  walk.path = (char*) safe_malloc(walk.capacity);
+  memcpy(walk.path, path, parsed.length + 1);
+  bool finished = walk_view(&walk, node, parsed.length, 0);
+  free(walk.path);
+
+  return finished ? 0 : ECANCELED;
+}
+
+void tree_snapshot_free(TreeSnapshot* snapshot) {
+  Tree* tree = snapshot->tree;
+  // A node whose copies are freed here may be freed concurrently, if no live
+  // snapshot needs it, but not before calling thread leaves it.
+  epoch_enter();
+  if (pthread_mutex_lock(&tree->snapshots_lock) != 0)
+    fatal("lock failed");
+  if (snapshot->older != NULL)
+    snapshot->older->newer = snapshot->newer;
+  else
+    tree->oldest_snapshot = snapshot->newer;
+  if (snapshot->newer != NULL)
+    snapshot->newer->older = snapshot->older;
+  else
+    tree->newest_snapshot = snapshot->older;
+  atomic_fetch_sub(&tree->live_snapshots, 1);
+
+  // Only snapshots older than the remaining ones may have needed what is
+  // retained for older generations.
+  uint64_t oldest = tree->oldest_snapshot == NULL ? UINT64_MAX : tree->oldest_snapshot->generation;
+  size_t released_count = 0;
+  Retained* released = (Retained*) safe_malloc((tree->retained_count + 1) * sizeof(Retained));
+  size_t kept = 0;
+  for (size_t i = 0; i < tree->retained_count; i++) {
+    if (tree->retained[i].generation < oldest)
+      released[released_count++] = tree->retained[i];
+    else
+      tree->retained[kept++] = tree->retained[i];
+  }
+  tree->retained_count = kept;
+  if (pthread_mutex_unlock(&tree->snapshots_lock) != 0)
+    fatal("unlock failed");
+
+  // Copies of a node have to be unlinked before it is unpinned.
+  for (size_t i = 0; i < released_count; i++) {
+    FolderCopy* copy = released[i].copy;
+    if (copy == NULL) continue;
+    Node* node = released[i].node;
+    start_writing(node);
+    FolderCopy* newer = (FolderCopy*) node_get_copies(node);
+    if (newer == copy) {
+      node_set_copies(node, copy->older);
+    }
+    else {
+      while (newer->older != copy) newer = newer->older;
+      newer->older = copy->older;
+    }
+    finish_writing(node);
+    free(copy);
+  }
+  for (size_t i = 0; i < released_count; i++) {
+    if (released[i].copy == NULL) node_unpin(released[i].node);
+  }
+  epoch_exit();
+
+  free(released);
+  free(snapshot);
+}
+
+/********************************** WATCHES ***********************************/
+
+// Replaces watches of [tree] with the current ones without [removed] and with
+// [added], if not NULL. The old list is freed once no change can be reporting
+// events through it.
+static void replace_watches(Tree* tree, TreeWatch* removed, TreeWatch* added) {
+  if (pthread_mutex_lock(&tree->watches_lock) != 0)
+    fatal("lock failed");
+  WatchList* old = atomic_load(&tree->watches);
+  size_t old_count = old == NULL ? 0 : old->count;
+  WatchList* list = (WatchList*) safe_malloc(sizeof(WatchList) + (old_count + 1) * sizeof(TreeWatch*));
+  list->count = 0;
+  for (size_t i = 0; i < old_count; i++) {
+    if (old->watches[i] != removed) list->watches[list->count++] = old->watches[i];
+  }
+  if (added != NULL) list->watches[list->count++] = added;
+  if (list->count == 0) {
+    free(list);
+    list = NULL;
+  }
+  atomic_store(&tree->watches, list);
+  if (pthread_mutex_unlock(&tree->watches_lock) != 0)
+    fatal("unlock failed");
+
+  if (old != NULL) epoch_retire_free(old);
+}
+
+static void destroy_watch(void* watch) {
+  watch_free((TreeWatch*) watch);
+}
+
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive) {
+  if (!is_path_valid(path)) return NULL;
+  TreeWatch* watch = watch_new(tree, path, strlen(path), recursive, WATCH_CAPACITY);
+  replace_watches(tree, NULL, watch);
+  return watch;
+}
+
+size_t tree_watch_read(TreeWatch* watch, TreeEvent** events, size_t capacity, bool* overflowed) {
+  return watch_read(watch, events, capacity, overflowed);
+}
+
+void tree_watch_free(TreeWatch* watch) {
+  replace_watches(watch_get_tree(watch), watch, NULL);
+  // Changes that have found [watch] in the old list may still push events.
+  epoch_retire(watch, destroy_watch);
+}
+
+/******************************** SNAPSHOTS ***********************************/
+
+// A snapshot file consists of:
+//  - SnapshotHeader,
+//  - SnapshotFolder of every folder, in breadth-first order starting with the
+//    root, so children of every folder are consecutive and folders are sorted
+//    by depth,
+//  - names of all folders but the root, concatenated without separators.
+// Numbers are stored in native byte order, which is checked when loading.
+// Every folder carries its identifier in the journal (see node_get_id), so a
+// checkpoint can be made while the journal goes on naming folders by them.
+
+#define SNAPSHOT_MAGIC "FOLDTREE"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct SnapshotHeader {
+  char magic[8];          // SNAPSHOT_MAGIC without the terminating null byte
+  uint32_t version;       // SNAPSHOT_VERSION
+  uint32_t byte_order;    // SNAPSHOT_BYTE_ORDER as written by the saving machine
+  uint64_t folders;       // number of SnapshotFolders
+  uint64_t names_size;    // total length of names
+  uint64_t next_id;       // greater than identifiers of all folders
+} SnapshotHeader;
+
+typedef struct SnapshotFolder {
+  uint64_t name_offset;   // in names
+  uint64_t first_child;   // index of the first child, if there are children
+  uint64_t id;            // 0 for the root
+  uint32_t child_count;
+  uint32_t name_length;   // 0 for the root
+} SnapshotFolder;
+
+// Snapshot being collected in memory by tree_save and tree_checkpoint.
+typedef struct Snapshot {
+  SnapshotFolder* folders;
+  Node** nodes;           // node of every folder, valid while it is collected
+  size_t count;
+  size_t capacity;
+  char* names;
+  size_t names_size;
+  size_t names_capacity;
+} Snapshot;
+
+// Adds folder of [node] named [name] of [length] to [snapshot].
+static void snapshot_add(Snapshot* snapshot, Node* node, const char* name, size_t length) {
+  if (snapshot->count == snapshot->capacity) {
+    snapshot->capacity = snapshot->capacity == 0 ? 1024 : 2 * snapshot->capacity;
+    snapshot->folders = (SnapshotFolder*) safe_realloc(snapshot->folders,
+                                                       snapshot->capacity * sizeof(SnapshotFolder));
+    snapshot->nodes = (Node**) safe_realloc(snapshot->nodes, snapshot->capacity * sizeof(Node*));
+  }
+  while (snapshot->names_size + length > snapshot->names_capacity) {
+    snapshot->names_capacity = snapshot->names_capacity == 0 ? 4096 : 2 * snapshot->names_capacity;
+    snapshot->names = (char*) safe_realloc(snapshot->names, snapshot->names_capacity);
+  }
+
+  SnapshotFolder* folder = &snapshot->folders[snapshot->count];
+  folder->name_offset = snapshot->names_size;
+  folder->name_length = length;
+  folder->first_child = 0;
+  folder->id = node_get_id(node);
+  folder->child_count = 0;
+  snapshot->nodes[snapshot->count] = node;
+  snapshot->count++;
+  // Root's name is empty, and [names] can still be NULL then.
+  if (length > 0)
+    memcpy(snapshot->names + snapshot->names_size, name, length);
+  snapshot->names_size += length;
+}
+
+// Collects folders of [tree] as seen by snapshot of [generation] (see
+// find_copy) into empty [snapshot], reading one folder at a time. Nodes of
+// the folders stay in memory as long as the snapshot is live.
+static void collect_snapshot(Tree* tree, Snapshot* snapshot, uint64_t generation) {
+  snapshot_add(snapshot, tree->root, "", 0);
+  for (size_t i = 0; i < snapshot->count; i++) {
+    Node* node = snapshot->nodes[i];
+    start_reading(node);
+    snapshot->folders[i].first_child = snapshot->count;
+    FolderCopy* copy = find_copy(node, generation);
+    if (copy != NULL) {
+      snapshot->folders[i].child_count = copy->count;
+      for (size_t c = 0; c < copy->count; c++)
+        snapshot_add(snapshot, copy->children[c], copy->listing + copy->name_offsets[c],
+                     copy->name_offsets[c + 1] - copy->name_offsets[c] - 1);
+    }
+    else {
+      snapshot->folders[i].child_count = hmap_size(node_get_children(node));
+      const char* child_name;
+      void* child;
+      HashMapIterator it = hmap_iterator(node_get_children(node));
+      while (hmap_next(node_get_children(node), &it, &child_name, &child))
+        snapshot_add(snapshot, (Node*) child, child_name, strlen(child_name));
+    }
+    finish_reading(node);
+  }
+}
+
+// Writes [snapshot], whose identifiers are all below [next_id], to file
+// [path]. Returns 0 or error code.
+static int write_snapshot(Snapshot* snapshot, uint64_t next_id, const char* path) {
+  SnapshotHeader header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.folders = snapshot->count;
+  header.names_size = snapshot->names_size;
+  header.next_id = next_id;
+
+  // The file appears under [path] only when it is complete.
+  size_t path_length = strlen(path);
+  char* temporary_path = (char*) safe_malloc(path_length + 5);
+  memcpy(temporary_path, path, path_length);
+  memcpy(temporary_path + path_length, ".tmp", 5);
+
+  int error = 0;
+  FILE* file = fopen(temporary_path, "wb");
+  if (file == NULL) {
+    error = errno;
+    free(temporary_path);
+    return error;
+  }
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(snapshot->folders, sizeof(SnapshotFolder), snapshot->count, file) != snapshot->count ||
+      // [names] of a tree of just the root can be NULL.
+      (snapshot->names_size > 0 &&
+       fwrite(snapshot->names, 1, snapshot->names_size, file) != snapshot->names_size) ||
+      fflush(file) != 0 || fsync(fileno(file)) != 0)
+    error = errno;
+  if (fclose(file) != 0 && error == 0)
+    error = errno;
+  if (error == 0 && rename(temporary_path, path) != 0)
+    error = errno;
+  if (error != 0)
+    unlink(temporary_path);
+
+  free(temporary_path);
+  return error;
+}
+
+int tree_save(Tree* tree, const char* path) {
+  Snapshot snapshot = { NULL, NULL, 0, 0, NULL, 0, 0 };
+  TreeSnapshot* view = tree_snapshot(tree);
+  collect_snapshot(tree, &snapshot, view->generation);
+  tree_snapshot_free(view);
+
+  // Folders of a tree without a journal have no identifiers, so they are
+  // numbered in order.
+  for (size_t i = 0; i < snapshot.count; i++)
+    snapshot.folders[i].id = i;
+  int result = write_snapshot(&snapshot, snapshot.count, path);
+
+  free(snapshot.folders);
+  free(snapshot.nodes);
+  free(snapshot.names);
+  return result;
+}
+
+// Returns true if [name] of [length] is a valid folder name.
+static bool is_name_valid(const char* name, size_t length) {
+  if (length == 0 || length > MAX_FOLDER_NAME_LENGTH) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (name[i] < 'a' || name[i] > 'z') return false;
+  }
+  return true;
+}
+
+// Checks that [size] bytes at [data] are a snapshot and returns its header, or
+// NULL if they are not.
+static const SnapshotHeader* check_snapshot(const char* data, size_t size) {
+  if (size < sizeof(SnapshotHeader)) return NULL;
+  const SnapshotHeader* header = (const SnapshotHeader*) data;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER)
+    return NULL;
+
+  size_t body = size - sizeof(SnapshotHeader);
+  if (header->folders == 0 || header->folders > body / sizeof(SnapshotFolder) ||
+      header->names_size != body - header->folders * sizeof(SnapshotFolder))
+    return NULL;
+
+  // Children of consecutive folders have to be consecutive, following the
+  // root, so that every folder but the root has exactly one parent, and a
+  // parent comes before its children.
+  const SnapshotFolder* folders = (const SnapshotFolder*) (header + 1);
+  const char* names = (const char*) (folders + header->folders);
+  uint64_t next_child = 1;
+  for (uint64_t i = 0; i < header->folders; i++) {
+    const SnapshotFolder* folder = &folders[i];
+    if (folder->name_offset > header->names_size ||
+        folder->name_length > header->names_size - folder->name_offset)
+      return NULL;
+    if (i == 0 ? folder->name_length != 0 || folder->id != 0
+               : !is_name_valid(names + folder->name_offset, folder->name_length))
+      return NULL;
+    if (folder->id >= header->next_id) return NULL;
+    if (folder->child_count > 0) {
+      if (folder->first_child != next_child || folder->first_child <= i) return NULL;
+      next_child += folder->child_count;
+    }
+  }
+  if (next_child != header->folders) return NULL;
+
+  return header;
+}
+
+// Creates folders of [header] in empty [tree], all at once, storing their
+// nodes in [nodes], in order of the snapshot. Returns false if a folder has
+// two children with the same name.
+static bool build_tree(Tree* tree, const SnapshotHeader* header, Node** nodes) {
+  const SnapshotFolder* folders = (const SnapshotFolder*) (header + 1);
+  const char* names = (const char*) (folders + header->folders);
+  nodes[0] = tree->root;
+
+  bool valid = true;
+  for (uint64_t i = 0; i < header->folders && valid; i++) {
+    HashMap* children = node_get_children(nodes[i]);
+    for (uint64_t c = folders[i].first_child; c < folders[i].first_child + folders[i].child_count; c++) {
+      HashMapKey name;
+      name.str = names + folders[c].name_offset;
+      name.length = folders[c].name_length;
+      name.hash = hmap_hash(name.str, name.length);
+      nodes[c] = node_new(tree->nodes);
+      node_set_id(nodes[c], folders[c].id);
+      if (!hmap_insert_key(children, name, nodes[c])) {
+        node_free(nodes[c]);
+        valid = false;
+        break;
+      }
+      node_set_parent(nodes[c], nodes[i]);
+    }
+  }
+
+  // Children come after their parents, so numbers of descendants are summed
+  // from the last folder back.
+  for (uint64_t i = header->folders; i-- > 0 && valid;) {
+    long descendants = 0;
+    for (uint64_t c = folders[i].first_child; c < folders[i].first_child + folders[i].child_count; c++)
+      descendants += node_get_descendants(nodes[c]) + 1;
+    node_add_descendants(nodes[i], descendants);
+  }
+
+  return valid;
+}
+
+// Node of a loaded folder with its identifier.
+typedef struct LoadedNode {
+  uint64_t id;
+  Node* node;
+} LoadedNode;
+
+static int compare_loaded_nodes(const void* a, const void* b) {
+  uint64_t first = ((const LoadedNode*) a)->id;
+  uint64_t second = ((const LoadedNode*) b)->id;
+  return (first > second) - (first < second);
+}
+
+// Does tree_load, storing nodes of the loaded tree, sorted by identifiers, in
+// [*nodes], their number in [*count] and the identifier of the next folder to
+// create in [*next_id]. The array has to be freed by caller.
+static Tree* load_snapshot(const char* path, LoadedNode** nodes, size_t* count,
+                           uint64_t* next_id) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return NULL;
+  }
+  size_t size = st.st_size;
+  char* data = size == 0 ? NULL : (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  if (data != NULL) madvise(data, size, MADV_SEQUENTIAL);
+
+  Tree* tree = NULL;
+  const SnapshotHeader* header = check_snapshot(data, size);
+  if (header != NULL) {
+    tree = tree_new();
+    Node** built = (Node**) safe_malloc(header->folders * sizeof(Node*));
+    bool valid = build_tree(tree, header, built);
+    const SnapshotFolder* folders = (const SnapshotFolder*) (header + 1);
+    *nodes = (LoadedNode*) safe_malloc(header->folders * sizeof(LoadedNode));
+    *count = header->folders;
+    *next_id = header->next_id;
+    for (uint64_t i = 0; i < header->folders && valid; i++) {
+      (*nodes)[i].id = folders[i].id;
+      (*nodes)[i].node = built[i];
+    }
+    free(built);
+    if (valid) {
+      qsort(*nodes, *count, sizeof(LoadedNode), compare_loaded_nodes);
+      for (size_t i = 1; i < *count && valid; i++)
+        valid = (*nodes)[i - 1].id != (*nodes)[i].id;
+    }
+    if (!valid) {
+      tree_free(tree);
+      free(*nodes);
+      tree = NULL;
+    }
+  }
+
+  if (data != NULL) munmap(data, size);
+  if (tree == NULL) errno = EINVAL;
+  return tree;
+}
+
+Tree* tree_load(const char* path) {
+  LoadedNode* nodes;
+  size_t count;
+  uint64_t next_id;
+  Tree* tree = load_snapshot(path, &nodes, &count, &next_id);
+  if (tree != NULL) free(nodes);
+  return tree;
+}
+
+/********************************* JOURNAL ************************************/
+
+// Returns name of checkpoint file of [generation] of journal in file [path].
+static char* make_checkpoint_path(const char* path, uint64_t generation) {
+  size_t size = strlen(path) + 22;
+  char* result = (char*) safe_malloc(size);
+  snprintf(result, size, "%s.%llu", path, (unsigned long long) generation);
+  return result;
+}
+
+// Returns true if a checkpoint or a kept journal of [generation] of journal in
+// file [path] exists.
+static bool has_generation(const char* path, uint64_t generation) {
+  char* checkpoint_path = make_checkpoint_path(path, generation);
+  char* journal_path = journal_kept_path(path, generation);
+  bool exists = access(checkpoint_path, F_OK) == 0 || access(journal_path, F_OK) == 0;
+  free(journal_path);
+  free(checkpoint_path);
+  return exists;
+}
+
+// Removes checkpoints and kept journals of journal in file [path] of
+// generations older than [generation], which recovery does not need anymore.
+static void remove_older(const char* path, uint64_t generation) {
+  // Files are removed from the oldest, so ones left by a crash are still next
+  // to [generation] later.
+  uint64_t oldest = generation;
+  while (oldest > 0 && has_generation(path, oldest - 1))
+    oldest--;
+  for (; oldest < generation; oldest++) {
+    char* checkpoint_path = make_checkpoint_path(path, oldest);
+    char* journal_path = journal_kept_path(path, oldest);
+    unlink(checkpoint_path);
+    unlink(journal_path);
+    free(journal_path);
+    free(checkpoint_path);
+  }
+}
+
+// Tree being recovered by tree_open.
+typedef struct Recovery {
+  Tree* tree;
+  LoadedNode* loaded;     // loaded from the checkpoint, sorted by identifiers,
+                          // with NULL nodes for removed folders
+  size_t loaded_count;
+  uint64_t first_id;      // of the first folder created by the journals
+  Node** created;         // created by the journals, indexed by identifiers
+                          // from [first_id], NULL for removed folders
+  size_t created_count;
+  size_t created_capacity;
+  // Subtrees removed by tree_remove_recursive, which records of operations
+  // that reached them earlier can still change, freed after replaying.
+  Node** detached;
+  size_t detached_count;
+  size_t detached_capacity;
+} Recovery;
+
+// Returns where node of folder [id] is kept by [recovery], or NULL if there is
+// no such folder.
+static Node** recovered_slot(Recovery* recovery, uint64_t id) {
+  if (id >= recovery->first_id) {
+    return id - recovery->first_id < recovery->created_count
+      ? &recovery->created[id - recovery->first_id] : NULL;
+  }
+  LoadedNode key;
+  key.id = id;
+  LoadedNode* found = (LoadedNode*) bsearch(&key, recovery->loaded, recovery->loaded_count,
+                                            sizeof(LoadedNode), compare_loaded_nodes);
+  return found == NULL ? NULL : &found->node;
+}
+
+static Node* recovered_node(Recovery* recovery, uint64_t id) {
+  Node** slot = recovered_slot(recovery, id);
+  return slot == NULL ? NULL : *slot;
+}
+
+// Returns true if [ancestor] is [node] or one of its ancestors.
+static bool is_ancestor(Node* ancestor, Node* node) {
+  for (; node != NULL; node = node_get_parent(node)) {
+    if (node == ancestor) return true;
+  }
+  return false;
+}
+
+// Adds [delta] to numbers of descendants of [node] and all its ancestors at
+// once. Recovery frees removed nodes at once, so none of them can stay listed
+// (see count_descendants).
+static void count_at_once(Node* node, long delta) {
+  while (node != NULL)
+    node = node_add_descendants(node, delta);
+}
+
+// Applies [record] to the tree of [context], a Recovery. Returns false if it
+// does not fit the tree.
+static bool apply_record(const JournalRecord* record, void* context) {
+  Recovery* recovery = (Recovery*) context;
+  Node* parent = recovered_node(recovery, record->parent);
+  if (parent == NULL || !is_name_valid(record->name.str, record->name.length)) return false;
+  HashMap* children = node_get_children(parent);
+  Node* node = (Node*) hmap_get_key(children, record->name);
+
+  switch (record->type) {
+    case JOURNAL_CREATE:
+      if (node != NULL || record->id != recovery->first_id + recovery->created_count) return false;
+      if (recovery->created_count == recovery->created_capacity) {
+        recovery->created_capacity =
+          recovery->created_capacity == 0 ? 64 : 2 * recovery->created_capacity;
+        recovery->created = (Node**) safe_realloc(recovery->created,
+                                                  recovery->created_capacity * sizeof(Node*));
+      }
+      node = node_new(recovery->tree->nodes);
+      node_set_id(node, record->id);
+      hmap_insert_key(children, record->name, node);
+      node_set_parent(node, parent);
+      count_at_once(parent, 1);
+      recovery->created[recovery->created_count++] = node;
+      return true;
+
+    case JOURNAL_REMOVE:
+      if (node == NULL || hmap_size(node_get_children(node)) > 0) return false;
+      hmap_remove_key(children, record->name);
+      count_at_once(parent, -node_set_parent(node, NULL));
+      *recovered_slot(recovery, node_get_id(node)) = NULL;
+      node_free(node);
+      return true;
+
+    case JOURNAL_REMOVE_RECURSIVE:
+      if (node == NULL) return false;
+      hmap_remove_key(children, record->name);
+      count_at_once(parent, -node_set_parent(node, NULL));
+      if (recovery->detached_count == recovery->detached_capacity) {
+        recovery->detached_capacity =
+          recovery->detached_capacity == 0 ? 16 : 2 * recovery->detached_capacity;
+        recovery->detached = (Node**) safe_realloc(recovery->detached,
+                                                   recovery->detached_capacity * sizeof(Node*));
+      }
+      recovery->detached[recovery->detached_count++] = node;
+      return true;
+
+    default: {
+      // A folder cannot be moved into its own subtree.
+      Node* target_parent = recovered_node(recovery, record->target_parent);
+      if (node == NULL || target_parent == NULL || is_ancestor(node, target_parent) ||
+          !is_name_valid(record->target_name.str, record->target_name.length) ||
+          hmap_get_key(node_get_children(target_parent), record->target_name) != NULL)
+        return false;
+      hmap_insert_key(node_get_children(target_parent), record->target_name, node);
+      hmap_remove_key(children, record->name);
+      long count = node_set_parent(node, target_parent);
+      count_at_once(parent, -count);
+      count_at_once(target_parent, count);
+      return true;
+    }
+  }
+}
+
+// Starts tree of [recovery] from the newest checkpoint of journal in file
+// [path] not newer than [*generation], which is set to its generation, or
+// from an empty tree if there is none. Returns 0 or error code.
+static int load_checkpoint(Recovery* recovery, const char* path, uint64_t* generation) {
+  for (; *generation > 0; (*generation)--) {
+    char* checkpoint_path = make_checkpoint_path(path, *generation);
+    recovery->tree = load_snapshot(checkpoint_path, &recovery->loaded, &recovery->loaded_count,
+                                   &recovery->first_id);
+    free(checkpoint_path);
+    if (recovery->tree != NULL) return 0;
+    if (errno != ENOENT) return errno;
+  }
+
+  recovery->tree = tree_new();
+  recovery->loaded = (LoadedNode*) safe_malloc(sizeof(LoadedNode));
+  recovery->loaded[0].id = 0;
+  recovery->loaded[0].node = recovery->tree->root;
+  recovery->loaded_count = 1;
+  recovery->first_id = 1;
+  return 0;
+}
+
+// Checkpoints [tree] whenever its journal grows over its checkpoint size.
+static void* run_checkpointer(void* data) {
+  Tree* tree = (Tree*) data;
+  if (pthread_mutex_lock(&tree->checkpointer_lock) != 0)
+    fatal("lock failed");
+  while (true) {
+    while (!tree->closing && !atomic_load(&tree->checkpoint_due)) {
+      if (pthread_cond_wait(&tree->checkpointer_wakeup, &tree->checkpointer_lock) != 0)
+        fatal("cond wait failed");
+    }
+    if (tree->closing) break;
+    if (pthread_mutex_unlock(&tree->checkpointer_lock) != 0)
+      fatal("unlock failed");
+    // A checkpoint that failed is tried again once another change is made.
+    tree_checkpoint(tree);
+    if (pthread_mutex_lock(&tree->checkpointer_lock) != 0)
+      fatal("lock failed");
+  }
+  if (pthread_mutex_unlock(&tree->checkpointer_lock) != 0)
+    fatal("unlock failed");
+  return NULL;
+}
+
+Tree* tree_open(const char* path, TreeDurability durability) {
+  Journal* journal = journal_open(path, durability);
+  if (journal == NULL) return NULL;
+
+  // A checkpoint that did not finish leaves journals of generations since
+  // the last one that did, which are replayed on it in order.
+  Recovery recovery;
+  uint64_t generation = journal_generation(journal);
+  uint64_t checkpointed = generation;
+  int error = load_checkpoint(&recovery, path, &checkpointed);
+  if (error != 0) {
+    journal_close(journal);
+    errno = error;
+    return NULL;
+  }
+  recovery.created = NULL;
+  recovery.created_count = 0;
+  recovery.created_capacity = 0;
+  recovery.detached = NULL;
+  recovery.detached_count = 0;
+  recovery.detached_capacity = 0;
+
+  for (uint64_t kept = checkpointed; kept < generation && error == 0; kept++) {
+    error = journal_replay_kept(path, kept, apply_record, &recovery);
+    if (error == ENOENT) error = EINVAL;
+  }
+  if (error == 0)
+    error = journal_replay(journal, apply_record, &recovery);
+  for (size_t i = 0; i < recovery.detached_count; i++)
+    reclaim_subtree(recovery.tree, recovery.detached[i], 0);
+  free(recovery.detached);
+  free(recovery.loaded);
+  free(recovery.created);
+  if (error != 0) {
+    tree_free(recovery.tree);
+    journal_close(journal);
+    errno = error;
+    return NULL;
+  }
+  remove_older(path, checkpointed);
+
+  Tree* tree = recovery.tree;
+  tree->journal = journal;
+  if (pthread_create(&tree->checkpointer, NULL, run_checkpointer, tree) != 0)
+    fatal("pthread_create failed");
+  tree->has_checkpointer = true;
+  return tree;
+}
+
+// Does tree_checkpoint when calling thread holds checkpoint_mutex of [tree].
+static int checkpoint(Tree* tree) {
+  Journal* journal = tree->journal;
+  int result = journal_prepare_restart(journal);
+  if (result != 0) {
+    atomic_store(&tree->checkpoint_due, false);
+    return result;
+  }
+
+  // Changing operations wait only while the journal is cut and the snapshot
+  // taken, which touches no file, so that the snapshot sees exactly the
+  // changes recorded before the cut.
+  if (pthread_rwlock_wrlock(&tree->checkpoint_lock) != 0)
+    fatal("wrlock failed");
+  uint64_t next_id = journal_cut(journal);
+  TreeSnapshot* view = tree_snapshot(tree);
+  atomic_store(&tree->checkpoint_due, false);
+  if (pthread_rwlock_unlock(&tree->checkpoint_lock) != 0)
+    fatal("unlock failed");
+  journal_finish_cut(journal);
+
+  Snapshot snapshot = { NULL, NULL, 0, 0, NULL, 0, 0 };
+  collect_snapshot(tree, &snapshot, view->generation);
+  tree_snapshot_free(view);
+
+  // Files of older generations are removed only once the checkpoint is sure
+  // to be found.
+  uint64_t generation = journal_generation(journal);
+  char* path = make_checkpoint_path(journal_path(journal), generation);
+  result = write_snapshot(&snapshot, next_id, path);
+  if (result == 0)
+    result = journal_sync_directory(path);
+  if (result == 0)
+    remove_older(journal_path(journal), generation);
+
+  free(path);
+  free(snapshot.folders);
+  free(snapshot.nodes);
+  free(snapshot.names);
+  return result;
+}
+
+int tree_checkpoint(Tree* tree) {
+  if (tree->journal == NULL) return EINVAL;
+
+  if (pthread_mutex_lock(&tree->checkpoint_mutex) != 0)
+    fatal("lock failed");
+  int result = checkpoint(tree);
+  if (pthread_mutex_unlock(&tree->checkpoint_mutex) != 0)
+    fatal("unlock failed");
+  return result;
+}
+
+void tree_set_checkpoint_size(Tree* tree, size_t size) {
+  tree->checkpoint_size = size;
+}
+
+int tree_stats(Tree* tree, TreeStats* stats) {
+  memset(stats, 0, sizeof(TreeStats));
+#ifdef TREE_STATS
+  stats_collect(tree->stats, stats);
+  return 0;
+#else
+  (void) tree;
+  return ENOTSUP;
+#endif
+}
+
+void tree_enable_path_cache(Tree* tree, size_t entries) {
+  tree->cache = pcache_new(entries);
+  tree->cache_scopes = (CacheScope*) aligned_alloc(_Alignof(CacheScope),
+                                                   CACHE_SCOPES * sizeof(CacheScope));
+  if (tree->cache_scopes == NULL) fatal("aligned_alloc failed");
+  for (int i = 0; i < CACHE_SCOPES; i++) {
+    atomic_init(&tree->cache_scopes[i].moves_begun, 0);
+    atomic_init(&tree->cache_scopes[i].moves_done, 0);
+    atomic_init(&tree->cache_scopes[i].paths_created, 0);
+  }
+}
+
+void tree_path_cache_stats(Tree* tree, unsigned long* hits, unsigned long* misses) {
+  if (tree->cache == NULL) {
+    *hits = 0;
+    *misses = 0;
+    return;
+  }
+  pcache_stats(tree->cache, hits, misses);
+}
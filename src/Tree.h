@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
 Tree* tree_new();
@@ -8,8 +11,242 @@ void tree_free(Tree*);
 
 char* tree_list(Tree* tree, const char* path);
 
+// Copies what tree_list would return into [buffer] of [capacity] bytes and
+// stores its size, including the terminating null byte, in [*size]. Returns 0
+// on success, ERANGE if the listing does not fit (nothing is copied then),
+// EINVAL if [path] is invalid and ENOENT if it does not exist. Does not
+// allocate memory unless the folder has changed since it was last listed.
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity, size_t* size);
+
+// Calls [callback] with name of every child of folder [path], in no particular
+// order, and [context]. Folder does not change during the calls, which must
+// not operate on [tree]. Returns 0 on success, EINVAL if [path] is invalid and
+// ENOENT if it does not exist. Does not allocate memory.
+int tree_list_foreach(Tree* tree, const char* path,
+                      void (*callback)(const char* name, void* context), void* context);
+
+// Sizes of a folder reported by tree_stat.
+typedef struct TreeFolderInfo {
+  size_t children;
+  size_t descendants; // all folders below it, at any depth
+} TreeFolderInfo;
+
+// Stores sizes of folder [path] in [*info], without visiting its descendants
+// or counting anything. Changes of children of the folder are counted in its
+// number of descendants at once, changes deeper below it in batches: it may
+// miss those made since changes last counted them, which they do whenever one
+// of the tree's lists of folders with changes not counted yet grows to about a
+// thousand. tree_fold_counts counts them all. Returns 0 on success, EINVAL if
+// [path] is invalid and ENOENT if it does not exist.
+int tree_stat(Tree* tree, const char* path, TreeFolderInfo* info);
+
+// Counts changes of numbers of descendants not counted yet (see tree_stat), so
+// that tree_stat is exact until the next change. Takes time proportional to
+// the number of folders changed since changes last counted them.
+void tree_fold_counts(Tree* tree);
+
 int tree_create(Tree* tree, const char* path);
 
 int tree_remove(Tree* tree, const char* path);
 
-int tree_move(Tree* tree, const char* source, const char* target);
\ No newline at end of file
+// Removes folder [path] together with all its descendants at once. Operations
+// that reached them before finish as if they were done before the removal.
+// Returns without waiting for them: the removed folders are freed by
+// a thread of [tree], started by the first call, which waits. Returns 0 on
+// success, EINVAL if [path] is invalid, ENOENT if it does not exist and EBUSY
+// if it is "/".
+int tree_remove_recursive(Tree* tree, const char* path);
+
+int tree_move(Tree* tree, const char* source, const char* target);
+
+typedef enum TreeOpType { TREE_LIST, TREE_CREATE, TREE_REMOVE } TreeOpType;
+
+// Operation of tree_batch.
+typedef struct TreeOp {
+  TreeOpType type;
+  const char* path;
+  int result;       // result of tree_create or tree_remove, for TREE_LIST 0,
+                    // EINVAL or ENOENT
+  char* listing;    // for TREE_LIST, what tree_list would return
+} TreeOp;
+
+// Does [count] operations [ops] one after another, storing their results in
+// them. Consecutive operations done in the same folder (listing it, creating or
+// removing its children) reach it only once and occupy it together, so each of
+// them is atomic, but the batch is not. Listings have to be freed by caller.
+void tree_batch(Tree* tree, TreeOp* ops, size_t count);
+
+// Flags of tree_walk.
+typedef enum TreeWalkFlags {
+  TREE_WALK_PARALLEL = 1, // walk with a thread for every processor
+} TreeWalkFlags;
+
+// Calls [callback] with path and depth (0 for [path] itself) of folder [path]
+// and of every its descendant at the moment of the call, until [callback]
+// returns false, and [context]. The walk sees a snapshot of [tree], as
+// tree_snapshot_walk does, so changes made during the call are not reported.
+// No folder is occupied during the calls, which may operate on [tree]. Parents are reported before their children, unless flags have
+// TREE_WALK_PARALLEL, in which case threads walking sibling subtrees call
+// [callback] concurrently. Returns 0 on success, EINVAL if [path] is invalid,
+// ENOENT if it does not exist and ECANCELED if [callback] stopped the walk.
+int tree_walk(Tree* tree, const char* path,
+              bool (*callback)(const char* path, int depth, void* context), void* context,
+              int flags);
+
+typedef struct TreeSnapshot TreeSnapshot;
+
+// Returns a read-only view of [tree] as it is at the moment of the call, which
+// concurrent operations do not change. Nothing is copied until they change
+// folders: then every changed folder has its children copied once for all
+// views that still see them. Every view has to be freed by tree_snapshot_free
+// before [tree] is freed.
+TreeSnapshot* tree_snapshot(Tree* tree);
+
+// Returns what tree_list would return for [path] at the moment [snapshot] was
+// taken.
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path);
+
+// Calls [callback] with path and depth (0 for [path] itself) of folder [path]
+// and of every its descendant at the moment [snapshot] was taken, until
+// [callback] returns false, and [context]. Parents are reported before their
+// children and siblings in order of names. The calls may operate on the tree.
+// Returns 0 on success, EINVAL if [path] is invalid, ENOENT if it did not exist
+// and ECANCELED if [callback] stopped the walk.
+int tree_snapshot_walk(TreeSnapshot* snapshot, const char* path,
+                       bool (*callback)(const char* path, int depth, void* context),
+                       void* context);
+
+// Frees [snapshot] and copies of folders that no other view sees.
+void tree_snapshot_free(TreeSnapshot* snapshot);
+
+typedef struct TreeWatch TreeWatch;
+
+typedef enum TreeEventType {
+  TREE_EVENT_CREATE, // by tree_create
+  TREE_EVENT_REMOVE, // by tree_remove, or tree_remove_recursive of the folder
+                     // together with its descendants
+  TREE_EVENT_MOVE,   // by tree_move
+} TreeEventType;
+
+// Change reported by tree_watch_read, freed by a single call of free.
+typedef struct TreeEvent {
+  TreeEventType type;
+  char* path;   // of the created or removed folder, or of the moved one
+                // before the move
+  char* target; // of the moved folder after the move, NULL for other events
+} TreeEvent;
+
+// Starts watching folder [path] of [tree], which does not have to exist:
+// every change of its children, or of all its descendants if [recursive], is
+// reported as an event, a move if its old or new path is watched. Events of
+// changes of the same folder are reported in order of the changes. Changing
+// operations never wait for the watch: when it holds 4096 events that have
+// not been read, further ones are dropped. Returns NULL if [path] is
+// invalid. The watch has to be freed by tree_watch_free before [tree] is
+// freed.
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive);
+
+// Moves up to [capacity] oldest events of [watch] to [events] and returns
+// their number, 0 if there are none. Sets [*overflowed] to true if events have
+// been dropped since the previous call because [watch] was full: changes made
+// after the ones whose events it held then are partly missing, so watched
+// folders have to be listed anew to learn their state. Only one thread at
+// a time can read events of [watch].
+size_t tree_watch_read(TreeWatch* watch, TreeEvent** events, size_t capacity, bool* overflowed);
+
+// Stops watching and frees [watch] with its events that have not been read.
+void tree_watch_free(TreeWatch* watch);
+
+// Saves snapshot of [tree] to file [path], replacing it only once the whole
+// snapshot is written. The tree is saved as it was at the start of the call
+// (see tree_snapshot), so concurrent operations can continue. Returns 0 on
+// success or the error of a failed file operation.
+int tree_save(Tree* tree, const char* path);
+
+// Returns a new tree with folders of snapshot saved by tree_save to file
+// [path], or NULL with errno set if it cannot be read, which is EINVAL if the
+// file is not a valid snapshot of this version saved on a machine with the
+// same byte order.
+Tree* tree_load(const char* path);
+
+// When changes of a tree opened by tree_open become durable in its journal.
+typedef enum TreeDurability {
+  TREE_DURABILITY_NONE,    // journal is written in batches and never synced,
+                           // so changes survive a crash of the process only
+  TREE_DURABILITY_BATCHED, // operation returns once its change is synced, but
+                           // others may see the change before
+  TREE_DURABILITY_PER_OP,  // no one sees a change before it is synced
+} TreeDurability;
+
+// Returns tree recovered from the journal in file [path] and the last
+// checkpoint it refers to, or a new empty tree with a new journal if there is
+// no such file. Further changes of the tree are appended to the journal, which
+// concurrent threads write and sync together, so that one sync covers many
+// operations. The tree checkpoints itself whenever its journal grows over a
+// size (see tree_set_checkpoint_size), so that recovery replays little of it.
+// Returns NULL with errno set if they cannot be read, which is EINVAL if they
+// are corrupted (a record torn by a crash is not).
+Tree* tree_open(const char* path, TreeDurability durability);
+
+// Saves snapshot of [tree] opened by tree_open to checkpoint file "[path].[n]",
+// where [path] is its journal and [n] the next generation, and starts its
+// journal anew from it, removing the previous checkpoint. Operations changing
+// the tree wait only until the journal is cut: the snapshot is written while
+// they go on. Returns 0, EINVAL if [tree] has no journal or the error of a
+// failed file operation, in which case recovery replays the journal since the
+// previous checkpoint.
+int tree_checkpoint(Tree* tree);
+
+// Makes [tree] opened by tree_open checkpoint itself in the background
+// whenever its journal grows over [size] bytes, or never if [size] is 0. The
+// default is 64 MiB. Has to be called before other operations on [tree].
+void tree_set_checkpoint_size(Tree* tree, size_t size);
+
+// Operations counted by tree_stats. Operations of tree_batch are counted as
+// the same operations done separately.
+typedef enum TreeStatsOp {
+  TREE_STATS_LIST,        // tree_list, tree_list_into and tree_list_foreach
+  TREE_STATS_CREATE,
+  TREE_STATS_REMOVE,
+  TREE_STATS_REMOVE_RECURSIVE,
+  TREE_STATS_MOVE,
+  TREE_STATS_WALK,
+  TREE_STATS_STAT,
+  TREE_STATS_OPS,         // number of counted operations
+} TreeStatsOp;
+
+// Number of buckets of histograms of wait times. Bucket i counts waits of
+// [2^i, 2^(i + 1)) nanoseconds, the last one also all longer waits.
+#define TREE_STATS_BUCKETS 32
+
+// Counters of tree_stats, indexed by TreeStatsOp. Waits are waits of threads
+// doing operations to enter nodes as readers or writers. Waits of a group of
+// operations of tree_batch done in one folder are counted for its first
+// operation changing the folder, or for TREE_STATS_LIST if there is none.
+typedef struct TreeStats {
+  unsigned long ops[TREE_STATS_OPS];
+  unsigned long enoent[TREE_STATS_OPS];     // operations failed with ENOENT
+  unsigned long eexist[TREE_STATS_OPS];     // with EEXIST
+  unsigned long enotempty[TREE_STATS_OPS];  // with ENOTEMPTY
+  unsigned long reader_waits[TREE_STATS_OPS];
+  unsigned long writer_waits[TREE_STATS_OPS];
+  unsigned long reader_wait_ns[TREE_STATS_OPS]; // total time of reader_waits
+  unsigned long writer_wait_ns[TREE_STATS_OPS];
+  unsigned long reader_wait_histogram[TREE_STATS_OPS][TREE_STATS_BUCKETS];
+  unsigned long writer_wait_histogram[TREE_STATS_OPS][TREE_STATS_BUCKETS];
+} TreeStats;
+
+// Stores counters of operations on [tree] since it was created in [*stats].
+// Counting is compiled in only with TREE_STATS defined (cmake -DTREE_STATS=ON),
+// otherwise returns ENOTSUP and zeros. Every thread counts separately and the
+// counters are summed here, so they may miss operations still running.
+int tree_stats(Tree* tree, TreeStats* stats);
+
+// Makes [tree] cache results of finding folders by path in [entries] entries,
+// so repeated operations on the same paths do not walk them. Has to be called
+// before any other operation on [tree].
+void tree_enable_path_cache(Tree* tree, size_t entries);
+
+// Stores numbers of path lookups answered and not answered by the path cache
+// of [tree] in [*hits] and [*misses].
+void tree_path_cache_stats(Tree* tree, unsigned long* hits, unsigned long* misses);
@@ -0,0 +1,140 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Watch.h"
+#include "err.h"
+#include "safe_alloc.h"
+
+#define CACHE_LINE 64
+
+typedef struct Slot {
+  // Equal to its position in the ring when the slot is free for a push at
+  // this position, to the position plus one when it holds the event pushed
+  // there.
+  atomic_ulong sequence;
+  TreeEvent* event;
+} Slot;
+
+struct TreeWatch {
+  _Alignas(CACHE_LINE) atomic_ulong tail; // position of the next push
+  _Alignas(CACHE_LINE) unsigned long head; // position of the next read
+  atomic_bool overflowed;  // true if an event was dropped since the last read
+  Tree* tree;
+  char* path;
+  size_t length;           // of path
+  bool recursive;
+  size_t mask;             // number of slots - 1, number of slots is a power of two
+  Slot* slots;
+};
+
+TreeWatch* watch_new(Tree* tree, const char* path, size_t length, bool recursive,
+                     size_t capacity) {
+  TreeWatch* watch = (TreeWatch*) aligned_alloc(CACHE_LINE, sizeof(TreeWatch));
+  if (watch == NULL) fatal("aligned_alloc failed");
+
+  size_t slots = 1;
+  while (slots < capacity) slots *= 2;
+
+  atomic_init(&watch->tail, 0);
+  watch->head = 0;
+  atomic_init(&watch->overflowed, false);
+  watch->tree = tree;
+  watch->path = (char*) safe_malloc(length + 1);
+  memcpy(watch->path, path, length);
+  watch->path[length] = '\0';
+  watch->length = length;
+  watch->recursive = recursive;
+  watch->mask = slots - 1;
+  watch->slots = (Slot*) safe_malloc(slots * sizeof(Slot));
+  for (size_t i = 0; i < slots; i++) {
+    atomic_init(&watch->slots[i].sequence, i);
+    watch->slots[i].event = NULL;
+  }
+
+  return watch;
+}
+
+void watch_free(TreeWatch* watch) {
+  size_t count;
+  TreeEvent* event;
+  bool overflowed;
+  do {
+    count = watch_read(watch, &event, 1, &overflowed);
+    if (count > 0) free(event);
+  } while (count > 0);
+
+  free(watch->slots);
+  free(watch->path);
+  free(watch);
+}
+
+Tree* watch_get_tree(TreeWatch* watch) {
+  return watch->tree;
+}
+
+bool watch_matches(TreeWatch* watch, const char* path, size_t length) {
+  if (length <= watch->length || memcmp(path, watch->path, watch->length) != 0) return false;
+  // Only the last name of a child follows the watched path.
+  return watch->recursive ||
+         memchr(path + watch->length, '/', length - watch->length - 1) == NULL;
+}
+
+// Paths of the event are kept in the same block of memory.
+TreeEvent* watch_event_new(TreeEventType type, const char* path, size_t length,
+                           const char* target, size_t target_length) {
+  size_t size = sizeof(TreeEvent) + length + 1 + (target == NULL ? 0 : target_length + 1);
+  TreeEvent* event = (TreeEvent*) safe_malloc(size);
+  event->type = type;
+  event->path = (char*) (event + 1);
+  memcpy(event->path, path, length);
+  event->path[length] = '\0';
+  event->target = NULL;
+  if (target != NULL) {
+    event->target = event->path + length + 1;
+    memcpy(event->target, target, target_length);
+    event->target[target_length] = '\0';
+  }
+  return event;
+}
+
+bool watch_push(TreeWatch* watch, TreeEvent* event) {
+  unsigned long position = atomic_load_explicit(&watch->tail, memory_order_relaxed);
+  Slot* slot;
+  while (true) {
+    slot = &watch->slots[position & watch->mask];
+    unsigned long sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    long difference = (long) (sequence - position);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&watch->tail, &position, position + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (difference < 0) {
+      // The slot still holds the event pushed a lap ago.
+      atomic_store_explicit(&watch->overflowed, true, memory_order_relaxed);
+      return false;
+    }
+    else {
+      position = atomic_load_explicit(&watch->tail, memory_order_relaxed);
+    }
+  }
+
+  slot->event = event;
+  atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+  return true;
+}
+
+size_t watch_read(TreeWatch* watch, TreeEvent** events, size_t capacity, bool* overflowed) {
+  size_t count = 0;
+  *overflowed = atomic_exchange_explicit(&watch->overflowed, false, memory_order_relaxed);
+  while (count < capacity) {
+    Slot* slot = &watch->slots[watch->head & watch->mask];
+    // A slot claimed by a push that has not finished yet ends the batch.
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != watch->head + 1) break;
+    events[count++] = slot->event;
+    atomic_store_explicit(&slot->sequence, watch->head + watch->mask + 1, memory_order_release);
+    watch->head++;
+  }
+  return count;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Tree.h"
+
+// Subscription of tree_watch: events of changes of children of a folder, or of
+// all its descendants, kept in a bounded ring until they are read. Any number
+// of threads push events concurrently without locks, claiming slots of the
+// ring in order, and one thread at a time reads them. Every slot has a
+// sequence number telling whether it is free or holds an event pushed in the
+// current lap. A push never waits: if the ring is full, the event is dropped
+// and the watch is marked as overflowed.
+
+// Paths are given as first [length] characters of [path], which does not have
+// to be null-terminated there.
+
+// Returns a new watch of folder [path] of [tree], reporting changes of its
+// children, or of all its descendants if [recursive], with room for at least
+// [capacity] events.
+TreeWatch* watch_new(Tree* tree, const char* path, size_t length, bool recursive,
+                     size_t capacity);
+
+// Frees [watch] and its events that have not been read. No one can use
+// [watch] concurrently.
+void watch_free(TreeWatch* watch);
+
+// Returns the tree [watch] was created for.
+Tree* watch_get_tree(TreeWatch* watch);
+
+// Returns true if [watch] reports changes of folder [path].
+bool watch_matches(TreeWatch* watch, const char* path, size_t length);
+
+// Returns event of change [type] of folder [path], moved to [target] for
+// TREE_EVENT_MOVE (NULL otherwise), to be pushed and freed by its reader.
+TreeEvent* watch_event_new(TreeEventType type, const char* path, size_t length,
+                           const char* target, size_t target_length);
+
+// Pushes [event] and returns true, unless [watch] is full, in which case
+// returns false and [event] stays with the caller. Never allocates memory.
+bool watch_push(TreeWatch* watch, TreeEvent* event);
+
+// Does tree_watch_read.
+size_t watch_read(TreeWatch* watch, TreeEvent** events, size_t capacity, bool* overflowed);
@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "err.h"
+#include "safe_alloc.h"
+
+// Classic three-epoch scheme. Global epoch can advance from e to e + 1 only
+// when every thread in critical section has entered it during epoch e. Thus,
+// when global epoch reaches e + 2, no thread can still be in critical section
+// started before global epoch became e + 1, so memory retired during epoch e
+// (after being unlinked) is unreachable.
+//
+// Every thread owns a record kept in a global list. Records are never freed,
+// when a thread exits its record is released and can be taken over by a new
+// thread together with memory still waiting there to be destroyed.
+
+// Number of retired pointers after which owner tries to destroy some of them.
+#define COLLECT_THRESHOLD 64
+
+// Maximum number of spare entries of retired pointers kept by a record's owner
+// for next retires, so that retiring usually does not allocate memory.
+#define MAX_SPARE COLLECT_THRESHOLD
+
+typedef struct Retired Retired;
+
+struct Retired {
+  void* ptr;
+  void (*destroy)(void*);
+  unsigned long epoch; // global epoch at the moment of retiring
+  Retired* next;
+};
+
+typedef struct Record Record;
+
+struct Record {
+  // (epoch << 1) | 1 while owner is in critical section, 0 otherwise
+  atomic_ulong state;
+  atomic_bool owned;   // true if some thread uses this record
+  pthread_mutex_t lock; // protects list of retired pointers
+  Retired* head;       // oldest retired pointer
+  Retired* tail;       // newest retired pointer
+  size_t count;        // number of retired pointers
+  Retired* spare;      // unused entries, touched only by owner
+  size_t spare_count;
+  Record* next;        // next record in the global list
+};
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(Record*) records = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key; // its destructor releases record of exiting thread
+
+static _Thread_local Record* self = NULL;
+static _Thread_local int nesting = 0;
+
+static void release_record(void* record) {
+  atomic_store(&((Record*) record)->owned, false);
+}
+
+static void create_key() {
+  if (pthread_key_create(&key, release_record) != 0)
+    fatal("key create failed");
+}
+
+static Record* acquire_record() {
+  if (pthread_once(&key_once, create_key) != 0)
+    fatal("once failed");
+
+  Record* record = NULL;
+  for (Record* r = atomic_load(&records); r != NULL && record == NULL; r = r->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&r->owned, &expected, true))
+      record = r;
+  }
+
+  if (record == NULL) {
+    record = (Record*) safe_malloc(sizeof(Record));
+    atomic_init(&record->state, 0);
+    atomic_init(&record->owned, true);
+    if (pthread_mutex_init(&record->lock, 0) != 0)
+      fatal("mutex init failed");
+    record->head = NULL;
+    record->tail = NULL;
+    record->count = 0;
+    record->spare = NULL;
+    record->spare_count = 0;
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record));
+  }
+
+  if (pthread_setspecific(key, record) != 0)
+    fatal("setspecific failed");
+  return record;
+}
+
+// Advances global epoch if all threads in critical sections entered them in
+// current epoch. Returns global epoch.
+static unsigned long try_advance() {
+  unsigned long epoch = atomic_load(&global_epoch);
+  for (Record* r = atomic_load(&records); r != NULL; r = r->next) {
+    unsigned long state = atomic_load(&r->state);
+    if ((state & 1) && (state >> 1) != epoch)
+      return epoch;
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+    return epoch + 1;
+  return epoch; // Someone else has advanced it.
+}
+
+// Destroys pointers from [record] retired at least two epochs ago.
+static void collect(Record* record) {
+  unsigned long epoch = atomic_load(&global_epoch);
+
+  if (pthread_mutex_lock(&record->lock) != 0)
+    fatal("lock failed");
+  Retired* first = record->head;
+  Retired* last = NULL;
+  while (record->head != NULL && record->head->epoch + 2 <= epoch) {
+    last = record->head;
+    record->head = record->head->next;
+    record->count--;
+  }
+  if (record->head == NULL)
+    record->tail = NULL;
+  if (pthread_mutex_unlock(&record->lock) != 0)
+    fatal("unlock failed");
+
+  // Destroying outside of the lock, as destroy functions may retire more.
+  if (last == NULL)
+    return;
+  last->next = NULL;
+  while (first != NULL) {
+    Retired* next = first->next;
+    first->destroy(first->ptr);
+    if (record == self && self->spare_count < MAX_SPARE) {
+      first->next = self->spare;
+      self->spare = first;
+      self->spare_count++;
+    }
+    else {
+      free(first);
+    }
+    first = next;
+  }
+}
+
+void epoch_enter() {
+  if (nesting++ > 0)
+    return;
+  if (self == NULL)
+    self = acquire_record();
+
+  // Announced epoch has to be current after announcing, otherwise global
+  // epoch could have advanced past it unnoticed.
+  unsigned long epoch;
+  do {
+    epoch = atomic_load(&global_epoch);
+    atomic_store(&self->state, (epoch << 1) | 1);
+  } while (atomic_load(&global_epoch) != epoch);
+}
+
+void epoch_exit() {
+  if (--nesting > 0)
+    return;
+  atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+void epoch_retire(void* ptr, void (*destroy)(void*)) {
+  if (self == NULL)
+    self = acquire_record();
+
+  Retired* retired = self->spare;
+  if (retired != NULL) {
+    self->spare = retired->next;
+    self->spare_count--;
+  }
+  else {
+    retired = (Retired*) safe_malloc(sizeof(Retired));
+  }
+  retired->ptr = ptr;
+  retired->destroy = destroy;
+  retired->epoch = atomic_load(&global_epoch);
+  retired->next = NULL;
+
+  if (pthread_mutex_lock(&self->lock) != 0)
+    fatal("lock failed");
+  if (self->tail != NULL)
+    self->tail->next = retired;
+  else
+    self->head = retired;
+  self->tail = retired;
+  bool full = ++self->count >= COLLECT_THRESHOLD;
+  if (pthread_mutex_unlock(&self->lock) != 0)
+    fatal("unlock failed");
+
+  if (full) {
+    try_advance();
+    collect(self);
+  }
+}
+
+void epoch_retire_free(void* ptr) {
+  epoch_retire(ptr, free);
+}
+
+void epoch_barrier() {
+  unsigned long target = atomic_load(&global_epoch) + 2;
+  while (try_advance() < target)
+    sched_yield();
+
+  for (Record* r = atomic_load(&records); r != NULL; r = r->next)
+    collect(r);
+}
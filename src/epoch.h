@@ -0,0 +1,23 @@
+#pragma once
+
+// Epoch-based memory reclamation. Threads reading shared structures without
+// locks do it inside a critical section (between epoch_enter and epoch_exit).
+// Memory unlinked from shared structures is passed to epoch_retire and freed
+// only after every critical section active at that moment has finished.
+
+// Starts critical section of calling thread. Critical sections can be nested.
+void epoch_enter();
+
+// Finishes critical section of calling thread.
+void epoch_exit();
+
+// Schedules call of [destroy] on [ptr] after all critical sections active at
+// the moment of calling epoch_retire finish.
+void epoch_retire(void* ptr, void (*destroy)(void*));
+
+// Schedules call of free on [ptr], same as epoch_retire(ptr, free).
+void epoch_retire_free(void* ptr);
+
+// Waits until all memory retired before the call is destroyed. Calling thread
+// must not be in critical section.
+void epoch_barrier();
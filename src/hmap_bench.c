@@ -0,0 +1,240 @@
+// Micro-benchmark comparing HashMap with the fixed 8-bucket chained map it
+// replaced. For every map size it measures lookups of present keys, inserts
+// and removes. The chained map degrades linearly with size, so it runs fewer
+// operations on big maps to keep the run short; throughput is per operation
+// either way.
+//
+// Usage: ./hmap_bench [size...]   (default sizes: 3 10 1000 1000000)
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "HashMap.h"
+
+/****************** THE CHAINED MAP REPLACED BY HashMap.c *********************/
+
+#define N_BUCKETS 8
+
+typedef struct Pair Pair;
+
+struct Pair {
+  char* key;
+  void* value;
+  Pair* next;
+};
+
+typedef struct {
+  Pair* buckets[N_BUCKETS];
+  size_t size;
+} ChainedMap;
+
+static unsigned int chained_hash(const char* key) {
+  unsigned int hash = 17;
+  while (*key) {
+    hash = (hash << 3) + hash + *key;
+    ++key;
+  }
+  return hash % N_BUCKETS;
+}
+
+static ChainedMap* chained_new() {
+  return calloc(1, sizeof(ChainedMap));
+}
+
+static void chained_free(ChainedMap* map) {
+  for (int h = 0; h < N_BUCKETS; ++h) {
+    for (Pair* p = map->buckets[h]; p;) {
+      Pair* q = p;
+      p = p->next;
+      free(q->key);
+      free(q);
+    }
+  }
+  free(map);
+}
+
+static Pair* chained_find(ChainedMap* map, int h, const char* key) {
+  for (Pair* p = map->buckets[h]; p; p = p->next) {
+    if (strcmp(key, p->key) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+static void* chained_get(ChainedMap* map, const char* key) {
+  Pair* p = chained_find(map, chained_hash(key), key);
+  return p ? p->value : NULL;
+}
+
+// Insert without the duplicate check, used only to prefill big maps.
+static void chained_prepend(ChainedMap* map, const char* key, void* value) {
+  int h = chained_hash(key);
+  Pair* new_p = malloc(sizeof(Pair));
+  new_p->key = strdup(key);
+  new_p->value = value;
+  new_p->next = map->buckets[h];
+  map->buckets[h] = new_p;
+  map->size++;
+}
+
+static bool chained_insert(ChainedMap* map, const char* key, void* value) {
+  if (chained_find(map, chained_hash(key), key))
+    return false;
+  chained_prepend(map, key, value);
+  return true;
+}
+
+static bool chained_remove(ChainedMap* map, const char* key) {
+  Pair** pp = &(map->buckets[chained_hash(key)]);
+  while (*pp) {
+    Pair* p = *pp;
+    if (strcmp(key, p->key) == 0) {
+      *pp = p->next;
+      free(p->key);
+      free(p);
+      map->size--;
+      return true;
+    }
+    pp = &(p->next);
+  }
+  return false;
+}
+
+/********************************* BENCHMARK **********************************/
+
+// Number of operations timed per phase for the open addressing map.
+#define OPS 1000000
+
+// Number of key comparisons the chained map may spend per phase.
+#define CHAINED_BUDGET 20000000
+
+// Folder-like names: lowercase letters, 3 to 8 characters.
+static char** make_keys(size_t n) {
+  char** keys = malloc(n * sizeof(char*));
+  for (size_t i = 0; i < n; ++i) {
+    char buf[16];
+    size_t x = i;
+    int len = 0;
+    do {
+      buf[len++] = 'a' + x % 26;
+      x /= 26;
+    } while (x > 0 || len < 3);
+    buf[len] = '\0';
+    keys[i] = strdup(buf);
+  }
+  return keys;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static size_t rng(size_t bound) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % bound;
+}
+
+static void report(const char* map, size_t n, const char* op, size_t ops, double seconds) {
+  printf("%-8s %8zu %-7s %12.0f ops/s\n", map, n, op, ops / seconds);
+}
+
+// Timed phases: random lookups of present keys, then removing and
+// re-inserting a random sample of keys. [ops] bounds the number of
+// operations per phase.
+static void bench_hmap(char** keys, size_t n, size_t ops) {
+  HashMap* map = hmap_new();
+  for (size_t i = 0; i < n; ++i)
+    hmap_insert(map, keys[i], keys[i]);
+
+  size_t found = 0;
+  double start = now();
+  for (size_t i = 0; i < ops; ++i)
+    found += hmap_get(map, keys[rng(n)]) != NULL;
+  report("hmap", n, "lookup", ops, now() - start);
+
+  size_t sample = ops < n ? ops : n;
+  size_t* picked = malloc(sample * sizeof(size_t));
+  for (size_t i = 0; i < sample; ++i)
+    picked[i] = (i * (n / sample)) % n;
+
+  start = now();
+  for (size_t i = 0; i < sample; ++i)
+    hmap_remove(map, keys[picked[i]]);
+  report("hmap", n, "remove", sample, now() - start);
+
+  start = now();
+  for (size_t i = 0; i < sample; ++i)
+    hmap_insert(map, keys[picked[i]], keys[picked[i]]);
+  report("hmap", n, "insert", sample, now() - start);
+
+  if (found != ops || hmap_size(map) != n)
+    fprintf(stderr, "hmap: inconsistent result\n");
+  free(picked);
+  hmap_free(map);
+}
+
+static void bench_chained(char** keys, size_t n, size_t ops) {
+  ChainedMap* map = chained_new();
+  for (size_t i = 0; i < n; ++i)
+    chained_prepend(map, keys[i], keys[i]);
+
+  size_t found = 0;
+  double start = now();
+  for (size_t i = 0; i < ops; ++i)
+    found += chained_get(map, keys[rng(n)]) != NULL;
+  report("chained", n, "lookup", ops, now() - start);
+
+  size_t sample = ops < n ? ops : n;
+  size_t* picked = malloc(sample * sizeof(size_t));
+  for (size_t i = 0; i < sample; ++i)
+    picked[i] = (i * (n / sample)) % n;
+
+  start = now();
+  for (size_t i = 0; i < sample; ++i)
+    chained_remove(map, keys[picked[i]]);
+  report("chained", n, "remove", sample, now() - start);
+
+  start = now();
+  for (size_t i = 0; i < sample; ++i)
+    chained_insert(map, keys[picked[i]], keys[picked[i]]);
+  report("chained", n, "insert", sample, now() - start);
+
+  if (found != ops || map->size != n)
+    fprintf(stderr, "chained: inconsistent result\n");
+  free(picked);
+  chained_free(map);
+}
+
+int main(int argc, char** argv) {
+  size_t default_sizes[] = { 3, 10, 1000, 1000000 };
+  size_t n_sizes = argc > 1 ? (size_t) argc - 1 : 4;
+
+  printf("%-8s %8s %-7s %16s\n", "map", "keys", "op", "throughput");
+  for (size_t s = 0; s < n_sizes; ++s) {
+    size_t n = argc > 1 ? strtoul(argv[s + 1], NULL, 10) : default_sizes[s];
+    if (n == 0)
+      continue;
+    char** keys = make_keys(n);
+
+    bench_hmap(keys, n, OPS);
+    // Keep the chained map's work around CHAINED_BUDGET key comparisons.
+    size_t chain = n / N_BUCKETS + 1;
+    size_t chained_ops = CHAINED_BUDGET / chain;
+    bench_chained(keys, n, chained_ops > OPS ? OPS : chained_ops < 100 ? 100 : chained_ops);
+
+    for (size_t i = 0; i < n; ++i)
+      free(keys[i]);
+    free(keys);
+  }
+  return 0;
+}
@@ -0,0 +1,203 @@
+// Micro-benchmark of the reading room protocol implemented in Node.c.
+// Measures latency of uncontended start/finish pairs of readers and writers,
+// throughput of threads hammering a single node, latency percentiles of
+// threads holding a node for a short while, with spinning before waiting and
+// without it, and memory used per folder of a tree.
+//
+// Usage: ./lock_bench [threads]   (default: 4)
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Node.h"
+#include "Tree.h"
+#include "epoch.h"
+
+// Number of start/finish pairs per measurement.
+#define PAIRS 10000000
+
+// Number of start/finish pairs per thread whose latency is measured.
+#define LATENCY_PAIRS 200000
+
+// Iterations of work done inside the node by threads measuring latency, a few
+// hundred nanoseconds, like creating or removing a folder.
+#define HOLD_WORK 200
+
+// Number of folders created to measure memory.
+#define FOLDERS 100000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_uncontended() {
+  Slab* slab = slab_new(node_memory_size());
+  Node* node = node_new(slab);
+
+  double start = now();
+  for (int i = 0; i < PAIRS; ++i) {
+    start_reading(node);
+    finish_reading(node);
+  }
+  printf("uncontended read pair   %8.1f ns\n", (now() - start) * 1e9 / PAIRS);
+
+  start = now();
+  for (int i = 0; i < PAIRS; ++i) {
+    start_writing(node);
+    finish_writing(node);
+  }
+  printf("uncontended write pair  %8.1f ns\n", (now() - start) * 1e9 / PAIRS);
+
+  node_free(node);
+  slab_free(slab);
+}
+
+typedef struct {
+  Node* node;
+  int pairs;
+  int write_every; // every write_every-th pair is a write pair, 0 for never
+} Worker;
+
+static void* worker(void* arg) {
+  Worker* w = arg;
+  epoch_enter();
+  for (int i = 0; i < w->pairs; ++i) {
+    if (w->write_every && i % w->write_every == 0) {
+      start_writing(w->node);
+      finish_writing(w->node);
+    }
+    else {
+      start_reading(w->node);
+      finish_reading(w->node);
+    }
+  }
+  epoch_exit();
+  return NULL;
+}
+
+static void bench_contended(int threads, int write_every, const char* name) {
+  Slab* slab = slab_new(node_memory_size());
+  Node* node = node_new(slab);
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  Worker w = { node, PAIRS / threads, write_every };
+
+  double start = now();
+  for (int i = 0; i < threads; ++i)
+    pthread_create(&ids[i], NULL, worker, &w);
+  for (int i = 0; i < threads; ++i)
+    pthread_join(ids[i], NULL);
+  double seconds = now() - start;
+  printf("%d threads, %-13s %8.1f Mpairs/s\n", threads, name, w.pairs * threads / seconds / 1e6);
+
+  free(ids);
+  node_free(node);
+  slab_free(slab);
+}
+
+typedef struct {
+  Node* node;
+  uint64_t* latencies; // of LATENCY_PAIRS pairs, in nanoseconds
+} LatencyWorker;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* latency_worker(void* arg) {
+  LatencyWorker* w = arg;
+  volatile int work = 0;
+  for (int i = 0; i < LATENCY_PAIRS; ++i) {
+    uint64_t start = now_ns();
+    bool writing = i % 10 == 0;
+    if (writing)
+      start_writing(w->node);
+    else
+      start_reading(w->node);
+    for (int j = 0; j < HOLD_WORK; ++j)
+      work++;
+    if (writing)
+      finish_writing(w->node);
+    else
+      finish_reading(w->node);
+    w->latencies[i] = now_ns() - start;
+  }
+  return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+// Measures latency of pairs with 10% writes holding a node for a short
+// while, spinning at most [spins] times before waiting.
+static void bench_latency(int threads, int spins) {
+  Slab* slab = slab_new(node_memory_size());
+  Node* node = node_new(slab);
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  LatencyWorker* workers = malloc(threads * sizeof(LatencyWorker));
+  uint64_t* latencies = malloc((size_t) threads * LATENCY_PAIRS * sizeof(uint64_t));
+  node_set_max_spins(spins);
+
+  double start = now();
+  for (int i = 0; i < threads; ++i) {
+    workers[i].node = node;
+    workers[i].latencies = latencies + (size_t) i * LATENCY_PAIRS;
+    pthread_create(&ids[i], NULL, latency_worker, &workers[i]);
+  }
+  for (int i = 0; i < threads; ++i)
+    pthread_join(ids[i], NULL);
+  double seconds = now() - start;
+
+  size_t count = (size_t) threads * LATENCY_PAIRS;
+  qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+  printf("%d threads, %4d spins   %8.1f Mpairs/s  p50 %6lu ns  p99 %8lu ns  p999 %8lu ns\n",
+         threads, spins, count / seconds / 1e6, latencies[count / 2], latencies[count * 99 / 100],
+         latencies[count * 999 / 1000]);
+
+  free(latencies);
+  free(workers);
+  free(ids);
+  node_free(node);
+  slab_free(slab);
+}
+
+static void bench_memory() {
+  struct mallinfo2 before = mallinfo2();
+  Tree* tree = tree_new();
+  char path[16];
+  for (int i = 0; i < FOLDERS; ++i) {
+    int len = 0;
+    path[len++] = '/';
+    for (int x = i; len == 1 || x > 0; x /= 26)
+      path[len++] = 'a' + x % 26;
+    path[len++] = '/';
+    path[len] = '\0';
+    tree_create(tree, path);
+  }
+  struct mallinfo2 after = mallinfo2();
+  printf("memory per folder       %8.1f bytes\n", (double) (after.uordblks - before.uordblks) / FOLDERS);
+  tree_free(tree);
+}
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+
+  bench_uncontended();
+  bench_contended(threads, 0, "reads");
+  bench_contended(threads, 10, "10% writes");
+  bench_latency(threads, 0);
+  bench_latency(threads, NODE_MAX_SPINS);
+  bench_memory();
+  return 0;
+}
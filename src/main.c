@@ -1,13 +1,654 @@
-// Simple sequential test demonstrating usage of the folder tree.
+// Simple sequential test demonstrating usage of the folder tree, followed by
+// tests of invariants that have to hold under concurrent operations and
+// after crashes.
 
 #include "Tree.h"
+#include "path_utils.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <errno.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void count_child(const char* name, void* children) {
+  (void) name;
+  (*(int*) children)++;
+}
+
+// Counts folders up to depth 1 and stops the walk at a deeper one.
+static bool count_shallow(const char* path, int depth, void* folders) {
+  (void) path;
+  if (depth > 1) return false;
+  (*(int*) folders)++;
+  return true;
+}
+
+// Number of threads and of operations of each of them in concurrent tests.
+#define THREADS 4
+#define ROUNDS 2000
+
+// Thread of a concurrent test, owning folders named after [id].
+typedef struct Tester {
+  Tree* tree;
+  int id;
+} Tester;
+
+static void assert_listing(Tree* tree, const char* path, const char* expected) {
+  char* listing = tree_list(tree, path);
+  assert(listing != NULL && strcmp(listing, expected) == 0);
+  free(listing);
+}
+
+// Moves folder "t[id]/" of [tester] between "/a/" and "/b/", checking that
+// its old and new paths and a path inside it, found by the path cache, follow
+// it.
+static void* move_between_scopes(void* arg) {
+  Tester* tester = (Tester*) arg;
+  char paths[2][16], inner[2][16];
+  for (int side = 0; side < 2; side++) {
+    sprintf(paths[side], "/%c/t%c/", 'a' + side, 'a' + tester->id);
+    sprintf(inner[side], "%sx/", paths[side]);
+  }
+
+  for (int round = 0; round < ROUNDS; round++) {
+    int from = round % 2, to = 1 - from;
+    assert_listing(tester->tree, inner[from], "y");
+    assert(tree_list(tester->tree, inner[to]) == NULL);
+    assert(tree_move(tester->tree, paths[from], paths[to]) == 0);
+    assert(tree_list(tester->tree, paths[from]) == NULL);
+    assert(tree_list(tester->tree, inner[from]) == NULL);
+    assert_listing(tester->tree, inner[to], "y");
+  }
+  return NULL;
+}
+
+// Creates and removes folders in "/c/", unrelated to the others.
+static void* create_unrelated(void* arg) {
+  Tester* tester = (Tester*) arg;
+  for (int round = 0; round < ROUNDS; round++) {
+    assert(tree_create(tester->tree, "/c/k/") == 0);
+    assert(tree_remove(tester->tree, "/c/k/") == 0);
+  }
+  return NULL;
+}
+
+// Creates, lists and removes folder "/c/t[id]/" of [tester].
+static void* create_own(void* arg) {
+  Tester* tester = (Tester*) arg;
+  char path[16];
+  sprintf(path, "/c/t%c/", 'a' + tester->id);
+  for (int round = 0; round < ROUNDS; round++) {
+    assert(tree_create(tester->tree, path) == 0);
+    free(tree_list(tester->tree, "/c/"));
+    assert(tree_remove(tester->tree, path) == 0);
+  }
+  return NULL;
+}
+
+// Creates and removes folder "/w/t[id]/" of [tester] ROUNDS times.
+static void* churn_watched(void* arg) {
+  Tester* tester = (Tester*) arg;
+  char path[16];
+  sprintf(path, "/w/t%c/", 'a' + tester->id);
+  for (int round = 0; round < ROUNDS; round++) {
+    assert(tree_create(tester->tree, path) == 0);
+    assert(tree_remove(tester->tree, path) == 0);
+  }
+  return NULL;
+}
+
+// The same with ROUNDS / 4 rounds, which makes fewer events than a watch
+// holds.
+static void* churn_watched_briefly(void* arg) {
+  Tester* tester = (Tester*) arg;
+  char path[16];
+  sprintf(path, "/w/t%c/", 'a' + tester->id);
+  for (int round = 0; round < ROUNDS / 4; round++) {
+    assert(tree_create(tester->tree, path) == 0);
+    assert(tree_remove(tester->tree, path) == 0);
+  }
+  return NULL;
+}
+
+// Reader of a watch of "/w/" checking that events of every folder of
+// churn_watched() come in order of the changes.
+typedef struct WatchReader {
+  TreeWatch* watch;
+  atomic_bool done;       // set when no more events will be pushed
+  size_t count;           // of events read
+  bool overflowed;
+  TreeEventType expected[THREADS];
+} WatchReader;
+
+// Reads events of [reader] that are there, returns their number.
+static size_t read_events(WatchReader* reader) {
+  TreeEvent* events[64];
+  bool overflowed;
+  size_t count = tree_watch_read(reader->watch, events, 64, &overflowed);
+  reader->overflowed |= overflowed;
+  for (size_t i = 0; i < count; i++) {
+    int id = events[i]->path[4] - 'a';
+    assert(strncmp(events[i]->path, "/w/t", 4) == 0 && id >= 0 && id < THREADS);
+    assert(events[i]->type == reader->expected[id] && events[i]->target == NULL);
+    reader->expected[id] =
+        events[i]->type == TREE_EVENT_CREATE ? TREE_EVENT_REMOVE : TREE_EVENT_CREATE;
+    free(events[i]);
+  }
+  reader->count += count;
+  return count;
+}
+
+static void* read_watch(void* arg) {
+  WatchReader* reader = (WatchReader*) arg;
+  bool done;
+  do {
+    done = atomic_load(&reader->done);
+    while (read_events(reader) > 0) {}
+  } while (!done);
+  return NULL;
+}
+
+static void init_reader(WatchReader* reader, TreeWatch* watch) {
+  reader->watch = watch;
+  atomic_init(&reader->done, false);
+  reader->count = 0;
+  reader->overflowed = false;
+  for (int i = 0; i < THREADS; i++)
+    reader->expected[i] = TREE_EVENT_CREATE;
+}
+
+// Runs [THREADS] threads of [function] and one of [other] (unless it is NULL)
+// on [tree] and waits for them.
+static void run_testers(Tree* tree, void* (*function)(void*), void* (*other)(void*)) {
+  pthread_t threads[THREADS + 1];
+  Tester testers[THREADS + 1];
+  int count = other == NULL ? THREADS : THREADS + 1;
+  for (int i = 0; i < count; i++) {
+    testers[i].tree = tree;
+    testers[i].id = i;
+    assert(pthread_create(&threads[i], NULL, i < THREADS ? function : other, &testers[i]) == 0);
+  }
+  for (int i = 0; i < count; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+}
+
+// Lists "/r/s/k/" and "/r/t/k/" while swap_ancestors swaps their ancestors,
+// checking that a listing found is one of the two folders.
+static void* list_swapped(void* arg) {
+  Tester* tester = (Tester*) arg;
+  int found = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    char* listing = tree_list(tester->tree, (round + tester->id) % 2 ? "/r/s/k/" : "/r/t/k/");
+    if (listing != NULL) {
+      assert(strcmp(listing, "x") == 0 || strcmp(listing, "y") == 0);
+      found++;
+    }
+    free(listing);
+  }
+  assert(found > 0);
+  return NULL;
+}
+
+// Swaps "/r/s/" and "/r/t/" through "/r/u/".
+static void* swap_ancestors(void* arg) {
+  Tester* tester = (Tester*) arg;
+  for (int round = 0; round < ROUNDS; round++) {
+    assert(tree_move(tester->tree, "/r/s/", "/r/u/") == 0);
+    assert(tree_move(tester->tree, "/r/t/", "/r/s/") == 0);
+    assert(tree_move(tester->tree, "/r/u/", "/r/t/") == 0);
+  }
+  return NULL;
+}
+
+// Checks that lookups retried because ancestors of the paths moved meanwhile,
+// with and without the path cache, find only folders that were at the paths.
+static void test_moved_lookups() {
+  for (int cached = 0; cached < 2; cached++) {
+    Tree* tree = tree_new();
+    if (cached) tree_enable_path_cache(tree, 1024);
+    const char* paths[] = { "/r/", "/r/s/", "/r/s/k/", "/r/s/k/x/", "/r/t/", "/r/t/k/",
+                            "/r/t/k/y/" };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+      assert(tree_create(tree, paths[i]) == 0);
+
+    run_testers(tree, list_swapped, swap_ancestors);
+    // Every swap exchanges folders at the two paths.
+    assert_listing(tree, "/r/", "s,t");
+    assert_listing(tree, "/r/s/k/", ROUNDS % 2 ? "y" : "x");
+    assert_listing(tree, "/r/t/k/", ROUNDS % 2 ? "x" : "y");
+    tree_free(tree);
+  }
+}
+
+// Number of folders listed by test_listing, long enough for the listing not
+// to fit in any small buffer.
+#define LISTED 40
+
+// Checks that [name] is in the comma-separated [listing] of test_listing.
+static void find_listed(const char* name, void* listing) {
+  const char* found = strstr((const char*) listing, name);
+  assert(found != NULL && (found[strlen(name)] == ',' || found[strlen(name)] == '\0'));
+}
+
+// Checks listings copied into buffers of exactly their size or smaller, of an
+// empty folder and of a large one, and that every listing is counted once.
+static void test_listing() {
+  Tree* tree = tree_new();
+  char buffer[LISTED * 3];
+  size_t size;
+  assert(tree_list_into(tree, "/", NULL, 0, &size) == ERANGE && size == 1);
+  assert(tree_list_into(tree, "/", buffer, 1, &size) == 0 && size == 1);
+  assert(strcmp(buffer, "") == 0);
+  assert(tree_list_foreach(tree, "/", find_listed, NULL) == 0);
+
+  char path[8];
+  for (int i = 0; i < LISTED; i++) {
+    sprintf(path, "/%c%c/", 'a' + i / 26, 'a' + i % 26);
+    assert(tree_create(tree, path) == 0);
+  }
+  char* listing = tree_list(tree, "/");
+  assert(listing != NULL && strlen(listing) == LISTED * 3 - 1);
+  memset(buffer, 'x', sizeof(buffer));
+  assert(tree_list_into(tree, "/", buffer, LISTED * 3 - 1, &size) == ERANGE);
+  assert(size == LISTED * 3 && buffer[0] == 'x');
+  assert(tree_list_into(tree, "/", buffer, size, &size) == 0 && size == LISTED * 3);
+  assert(strcmp(buffer, listing) == 0);
+  int children = 0;
+  assert(tree_list_foreach(tree, "/", count_child, &children) == 0 && children == LISTED);
+  assert(tree_list_foreach(tree, "/", find_listed, listing) == 0);
+  free(listing);
+  assert(tree_list_foreach(tree, "/aa/", find_listed, NULL) == 0);
+  assert(tree_list_foreach(tree, "/g/", find_listed, NULL) == ENOENT);
+
+  TreeStats stats;
+  if (tree_stats(tree, &stats) == 0) {
+    assert(stats.ops[TREE_STATS_LIST] == 10);
+    assert(stats.enoent[TREE_STATS_LIST] == 1);
+  }
+  tree_free(tree);
+}
+
+// Checks that cached paths stay valid after changes elsewhere in the tree and
+// become invalid after moves, whichever scope they are in.
+static void test_path_cache() {
+  Tree* tree = tree_new();
+  tree_enable_path_cache(tree, 1024);
+  assert(tree_create(tree, "/a/") == 0);
+  assert(tree_create(tree, "/b/") == 0);
+  assert(tree_create(tree, "/c/") == 0);
+  char path[16];
+  for (int i = 0; i < THREADS; i++) {
+    sprintf(path, "/a/t%c/", 'a' + i);
+    assert(tree_create(tree, path) == 0);
+    sprintf(path, "/a/t%c/x/", 'a' + i);
+    assert(tree_create(tree, path) == 0);
+    sprintf(path, "/a/t%c/x/y/", 'a' + i);
+    assert(tree_create(tree, path) == 0);
+  }
+
+  unsigned long hits, misses, old_hits;
+  assert_listing(tree, "/a/ta/x/", "y");
+  tree_path_cache_stats(tree, &old_hits, &misses);
+  assert(tree_create(tree, "/c/d/") == 0);
+  assert(tree_move(tree, "/c/d/", "/c/e/") == 0);
+  assert_listing(tree, "/a/ta/x/", "y");
+  tree_path_cache_stats(tree, &hits, &misses);
+  assert(hits == old_hits + 1);
+  assert(tree_remove(tree, "/c/e/") == 0);
+
+  run_testers(tree, move_between_scopes, create_unrelated);
+  assert_listing(tree, "/a/", "ta,tb,tc,td");
+  assert_listing(tree, "/b/", "");
+  assert_listing(tree, "/c/", "");
+  tree_free(tree);
+}
+
+static unsigned long next_random(unsigned long* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Checks that every parser supported by the CPU, parse_path and is_path_valid
+// agree with the scalar parser on [path].
+static void check_parsers(const char* path) {
+  ParsedPath expected, actual;
+  bool valid = parse_path_using(PATH_PARSER_SCALAR, path, &expected);
+  for (int p = PATH_PARSER_SCALAR; p <= PATH_PARSER_AVX2 + 1; p++) {
+    if (p <= PATH_PARSER_AVX2 && !path_parser_supported(p)) continue;
+    // The last one is the default choice.
+    bool result = p <= PATH_PARSER_AVX2 ? parse_path_using(p, path, &actual)
+                                        : parse_path(path, &actual);
+    assert(result == valid);
+    if (result) {
+      assert(actual.length == expected.length && actual.depth == expected.depth);
+      assert(memcmp(actual.names, expected.names, expected.depth * sizeof(PathName)) == 0);
+      path_destroy(&actual);
+    }
+  }
+  assert(is_path_valid(path) == valid);
+  if (valid) path_destroy(&expected);
+}
+
+// Checks parsers on random paths, short and long, deep and shallow, placed at
+// every alignment, and on random mutations of them.
+static void test_path_parsers() {
+  static const char mutations[] = { '/', 'a', 'z', 'a' - 1, 'z' + 1, 'A', '\x80', ' ' };
+  static char buffer[2 * MAX_PATH_LENGTH + 64];
+  unsigned long state = 88172645463325252UL;
+  for (int i = 0; i < 20000; i++) {
+    char* path = buffer + i % 32;
+    int max_depth = i % 3 == 0 ? 300 : 8;
+    int max_name = i % 5 == 0 ? MAX_FOLDER_NAME_LENGTH : 12;
+    int depth = next_random(&state) % (max_depth + 1);
+    size_t length = 1;
+    path[0] = '/';
+    for (int j = 0; j < depth; j++) {
+      size_t name = 1 + next_random(&state) % max_name;
+      if (length + name + 1 > MAX_PATH_LENGTH) break;
+      for (size_t k = 0; k < name; k++)
+        path[length++] = 'a' + next_random(&state) % 26;
+      path[length++] = '/';
+    }
+    path[length] = '\0';
+    check_parsers(path);
+
+    size_t at = next_random(&state) % (length + 1);
+    switch (next_random(&state) % 3) {
+      case 0:
+        path[at] = '\0';
+        break;
+      case 1:
+        if (at < length) path[at] = mutations[next_random(&state) % sizeof(mutations)];
+        break;
+      default:
+        memset(path + length, 'x', MAX_PATH_LENGTH + 1 - length);
+        path[MAX_PATH_LENGTH] = '/';
+        path[MAX_PATH_LENGTH + 1] = '\0';
+        break;
+    }
+    check_parsers(path);
+  }
+}
+
+// Set by list_removed once it is in the listed folder, and by
+// test_remove_recursive once the removal has returned.
+static atomic_bool listing, removed;
+
+// Waits inside the listed folder until the removal of its parent returns.
+static void wait_for_removal(const char* name, void* context) {
+  (void) name;
+  (void) context;
+  atomic_store(&listing, true);
+  while (!atomic_load(&removed))
+    usleep(100);
+}
+
+static void* list_removed(void* arg) {
+  Tester* tester = (Tester*) arg;
+  assert(tree_list_foreach(tester->tree, "/r/s/", wait_for_removal, NULL) == 0);
+  return NULL;
+}
+
+// Checks that tree_remove_recursive returns while an operation is still in the
+// removed subtree.
+static void test_remove_recursive() {
+  Tree* tree = tree_new();
+  assert(tree_create(tree, "/r/") == 0);
+  assert(tree_create(tree, "/r/s/") == 0);
+  assert(tree_create(tree, "/r/s/k/") == 0);
+  atomic_init(&listing, false);
+  atomic_init(&removed, false);
+  Tester tester = { tree, 0 };
+  pthread_t lister;
+  assert(pthread_create(&lister, NULL, list_removed, &tester) == 0);
+  while (!atomic_load(&listing))
+    usleep(100);
+  assert(tree_remove_recursive(tree, "/r/") == 0);
+  atomic_store(&removed, true);
+  assert(pthread_join(lister, NULL) == 0);
+  assert(tree_list(tree, "/r/") == NULL);
+  assert_listing(tree, "/", "");
+  tree_free(tree);
+}
+
+// Checks events of concurrent changes read concurrently, and that a full
+// watch keeps the oldest events, dropping newer ones.
+static void test_watch() {
+  Tree* tree = tree_new();
+  assert(tree_create(tree, "/w/") == 0);
+  TreeWatch* watch = tree_watch(tree, "/w/", false);
+  WatchReader reader;
+
+  init_reader(&reader, watch);
+  pthread_t thread;
+  assert(pthread_create(&thread, NULL, read_watch, &reader) == 0);
+  run_testers(tree, churn_watched_briefly, NULL);
+  atomic_store(&reader.done, true);
+  assert(pthread_join(thread, NULL) == 0);
+  assert(!reader.overflowed && reader.count == 2 * THREADS * (ROUNDS / 4));
+
+  // Once the watch is full, nothing is pushed until events are read, so the
+  // events held are the oldest ones.
+  init_reader(&reader, watch);
+  run_testers(tree, churn_watched, NULL);
+  while (read_events(&reader) > 0) {}
+  assert(reader.overflowed && reader.count > 0 && reader.count < 2 * THREADS * ROUNDS);
+
+  init_reader(&reader, watch);
+  assert(tree_create(tree, "/w/ta/") == 0);
+  while (read_events(&reader) > 0) {}
+  assert(!reader.overflowed && reader.count == 1);
+
+  tree_watch_free(watch);
+  tree_free(tree);
+}
+
+// Number of crashes of test_recovery.
+#define CRASHES 8
+
+// Journal of test_recovery.
+#define CRASH_JOURNAL "main_crash"
+
+// Sets [path] to a random path of up to 3 folders named "a" to "c".
+static void random_path(char* path, unsigned long* state) {
+  int depth = 1 + next_random(state) % 3;
+  for (int i = 0; i < depth; i++) {
+    path[2 * i] = '/';
+    path[2 * i + 1] = 'a' + next_random(state) % 3;
+  }
+  path[2 * depth] = '/';
+  path[2 * depth + 1] = '\0';
+}
+
+// Makes a random change of [tree], which may fail.
+static void change_randomly(Tree* tree, unsigned long* state) {
+  char path[8], target[8];
+  random_path(path, state);
+  random_path(target, state);
+  switch (next_random(state) % 8) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+      tree_create(tree, path);
+      break;
+    case 4:
+      tree_remove(tree, path);
+      break;
+    case 5:
+      tree_remove_recursive(tree, path);
+      break;
+    default:
+      tree_move(tree, path, target);
+      break;
+  }
+}
+
+// Returns true if folder [path] of [length] has the same descendants in
+// [tree] and [other], both made by change_randomly.
+static bool same_folders(Tree* tree, Tree* other, char* path, size_t length) {
+  char* listing = tree_list(tree, path);
+  char* other_listing = tree_list(other, path);
+  bool same = true;
+  for (char name = 'a'; name <= 'c' && same; name++) {
+    bool found = strchr(listing, name) != NULL;
+    same = found == (strchr(other_listing, name) != NULL);
+    if (same && found) {
+      path[length] = name;
+      path[length + 1] = '/';
+      path[length + 2] = '\0';
+      same = same_folders(tree, other, path, length + 2);
+      path[length] = '\0';
+    }
+  }
+  free(listing);
+  free(other_listing);
+  return same;
+}
+
+// Returns true if a checkpoint of journal [path] exists. Removes them and the
+// journal if [remove].
+static bool find_checkpoints(const char* path, bool remove) {
+  size_t length = strlen(path);
+  bool found = false;
+  DIR* directory = opendir(".");
+  assert(directory != NULL);
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (strncmp(entry->d_name, path, length) != 0) continue;
+    if (entry->d_name[length] == '.' && entry->d_name[length + 1] >= '1' &&
+        entry->d_name[length + 1] <= '9' && strchr(entry->d_name + length + 1, '.') == NULL)
+      found = true;
+    if (remove) unlink(entry->d_name);
+  }
+  closedir(directory);
+  return found;
+}
+
+// Checks that a tree recovered after a crash at a random moment, with
+// checkpoints made in the background, has every change made before the crash
+// and maybe the one in progress, and that checkpoints are made.
+static void test_recovery() {
+  atomic_long* changes = (atomic_long*) mmap(NULL, sizeof(atomic_long), PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(changes != MAP_FAILED);
+  unsigned long state = 2463534242UL;
+  for (int crash = 0; crash < CRASHES; crash++) {
+    find_checkpoints(CRASH_JOURNAL, true);
+    unsigned long seed = next_random(&state);
+    long crash_at = 100 + next_random(&state) % 1000;
+    atomic_store(changes, 0);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+      Tree* tree = tree_open(CRASH_JOURNAL, TREE_DURABILITY_PER_OP);
+      tree_set_checkpoint_size(tree, 512);
+      for (long i = 1;; i++) {
+        change_randomly(tree, &seed);
+        atomic_store(changes, i);
+      }
+    }
+    while (atomic_load(changes) < crash_at) {
+      assert(waitpid(child, NULL, WNOHANG) == 0);
+      usleep(100);
+    }
+    assert(kill(child, SIGKILL) == 0 && waitpid(child, NULL, 0) == child);
+
+    Tree* tree = tree_open(CRASH_JOURNAL, TREE_DURABILITY_PER_OP);
+    assert(tree != NULL);
+    Tree* expected = tree_new();
+    long done = atomic_load(changes);
+    for (long i = 0; i < done; i++)
+      change_randomly(expected, &seed);
+    char path[MAX_PATH_LENGTH + 1] = "/";
+    bool same = same_folders(tree, expected, path, 1);
+    if (!same) {
+      change_randomly(expected, &seed);
+      same = same_folders(tree, expected, path, 1);
+    }
+    assert(same);
+    tree_free(expected);
+    tree_free(tree);
+  }
+  munmap(changes, sizeof(atomic_long));
+
+  find_checkpoints(CRASH_JOURNAL, true);
+  Tree* tree = tree_open(CRASH_JOURNAL, TREE_DURABILITY_NONE);
+  tree_set_checkpoint_size(tree, 512);
+  for (int i = 0; i < ROUNDS; i++)
+    change_randomly(tree, &state);
+  for (int i = 0; i < 10000 && !find_checkpoints(CRASH_JOURNAL, false); i++)
+    usleep(1000);
+  assert(find_checkpoints(CRASH_JOURNAL, false));
+  tree_free(tree);
+  find_checkpoints(CRASH_JOURNAL, true);
+}
+
+// Makes random changes of [tester]'s tree, moves racing removes of the same
+// folders.
+static void* change_concurrently(void* arg) {
+  Tester* tester = (Tester*) arg;
+  unsigned long state = 88172645463325252UL + tester->id;
+  for (int i = 0; i < ROUNDS; i++)
+    change_randomly(tester->tree, &state);
+  return NULL;
+}
+
+// Folds counts of descendants of [tester]'s tree while it changes.
+static void* stat_concurrently(void* arg) {
+  Tester* tester = (Tester*) arg;
+  TreeFolderInfo info;
+  for (int i = 0; i < ROUNDS; i++) {
+    tree_fold_counts(tester->tree);
+    assert(tree_stat(tester->tree, "/", &info) == 0);
+  }
+  return NULL;
+}
+
+// Returns number of descendants of folder [path] of [length] in [tree] made
+// by change_randomly, checking that tree_stat reports the same for it and
+// every descendant.
+static size_t recount(Tree* tree, char* path, size_t length) {
+  char* listing = tree_list(tree, path);
+  size_t descendants = 0;
+  for (char name = 'a'; name <= 'c'; name++) {
+    if (strchr(listing, name) != NULL) {
+      path[length] = name;
+      path[length + 1] = '/';
+      path[length + 2] = '\0';
+      descendants += 1 + recount(tree, path, length + 2);
+      path[length] = '\0';
+    }
+  }
+  free(listing);
+  TreeFolderInfo info;
+  assert(tree_stat(tree, path, &info) == 0 && info.descendants == descendants);
+  return descendants;
+}
+
+// Checks that numbers of descendants reported by tree_stat after concurrent
+// changes match the folders there are.
+static void test_counts() {
+  Tree* tree = tree_new();
+  char path[MAX_PATH_LENGTH + 1] = "/";
+  for (int round = 0; round < 4; round++) {
+    run_testers(tree, change_concurrently, stat_concurrently);
+    tree_fold_counts(tree);
+    recount(tree, path, 1);
+  }
+  tree_free(tree);
+}
 
 int main() {
   Tree *tree = tree_new();
@@ -28,6 +669,155 @@ int main() {
   list_content = tree_list(tree, "/b/");
   assert(strcmp(list_content, "c") == 0);
   free(list_content);
+  char buffer[2];
+  size_t size;
+  assert(tree_create(tree, "/b/a/") == 0);
+  assert(tree_list_into(tree, "/b/", buffer, sizeof(buffer), &size) == ERANGE);
+  assert(size == 4);
+  char larger_buffer[4];
+  assert(tree_list_into(tree, "/b/", larger_buffer, sizeof(larger_buffer), &size) == 0);
+  assert(strcmp(larger_buffer, "a,c") == 0);
+  assert(tree_list_into(tree, "/d/", larger_buffer, sizeof(larger_buffer), &size) == ENOENT);
+  int children = 0;
+  assert(tree_list_foreach(tree, "/b/", count_child, &children) == 0);
+  assert(children == 2);
+  TreeOp ops[] = {
+    { TREE_CREATE, "/b/a/x/", 0, NULL },
+    { TREE_CREATE, "/b/a/y/", 0, NULL },
+    { TREE_LIST, "/b/a/", 0, NULL },
+    { TREE_REMOVE, "/b/a/x/", 0, NULL },
+    { TREE_CREATE, "/e/f/", 0, NULL },
+  };
+  tree_batch(tree, ops, sizeof(ops) / sizeof(ops[0]));
+  assert(ops[0].result == 0 && ops[1].result == 0 && ops[3].result == 0);
+  assert(strcmp(ops[2].listing, "x,y") == 0);
+  free(ops[2].listing);
+  assert(ops[4].result == ENOENT);
+  int folders = 0;
+  assert(tree_walk(tree, "/b/a/", count_shallow, &folders, 0) == 0);
+  assert(folders == 2);
+  assert(tree_walk(tree, "/b/", count_shallow, &folders, 0) == ECANCELED);
+  assert(tree_walk(tree, "/d/", count_shallow, &folders, TREE_WALK_PARALLEL) == ENOENT);
+  TreeWatch* watch = tree_watch(tree, "/b/", false);
+  assert(tree_create(tree, "/b/w/") == 0);
+  assert(tree_create(tree, "/b/w/x/") == 0);
+  assert(tree_move(tree, "/b/w/", "/w/") == 0);
+  TreeEvent* events[4];
+  bool overflowed;
+  assert(tree_watch_read(watch, events, 4, &overflowed) == 2 && !overflowed);
+  assert(events[0]->type == TREE_EVENT_CREATE && strcmp(events[0]->path, "/b/w/") == 0);
+  assert(events[1]->type == TREE_EVENT_MOVE && strcmp(events[1]->target, "/w/") == 0);
+  free(events[0]);
+  free(events[1]);
+  tree_watch_free(watch);
+  assert(tree_remove_recursive(tree, "/w/") == 0);
+  TreeSnapshot* snapshot = tree_snapshot(tree);
+  assert(tree_create(tree, "/b/a/z/") == 0);
+  assert(tree_move(tree, "/b/a/", "/d/") == 0);
+  list_content = tree_snapshot_list(snapshot, "/b/a/");
+  assert(strcmp(list_content, "y") == 0);
+  free(list_content);
+  assert(tree_snapshot_list(snapshot, "/d/") == NULL);
+  folders = 0;
+  assert(tree_snapshot_walk(snapshot, "/", count_shallow, &folders) == ECANCELED);
+  assert(folders == 2);
+  tree_snapshot_free(snapshot);
+  assert(tree_move(tree, "/d/", "/b/a/") == 0);
+  assert(tree_remove(tree, "/b/a/z/") == 0);
+  assert(tree_save(tree, "main_snapshot") == 0);
+  tree_free(tree);
+  tree = tree_load("main_snapshot");
+  remove("main_snapshot");
+  assert(tree != NULL);
+  list_content = tree_list(tree, "/b/a/");
+  assert(strcmp(list_content, "y") == 0);
+  free(list_content);
+  assert(tree_load("main_snapshot") == NULL && errno == ENOENT);
+  tree_free(tree);
+  remove("main_journal");
+  tree = tree_open("main_journal", TREE_DURABILITY_BATCHED);
+  assert(tree != NULL);
+  assert(tree_create(tree, "/a/") == 0);
+  assert(tree_create(tree, "/a/b/") == 0);
+  assert(tree_checkpoint(tree) == 0);
+  assert(tree_move(tree, "/a/b/", "/c/") == 0);
+  assert(tree_create(tree, "/c/d/") == 0);
+  tree_free(tree);
+  tree = tree_open("main_journal", TREE_DURABILITY_BATCHED);
+  assert(tree != NULL);
+  list_content = tree_list(tree, "/c/");
+  assert(strcmp(list_content, "d") == 0);
+  free(list_content);
+  TreeFolderInfo info;
+  assert(tree_stat(tree, "/", &info) == 0);
+  assert(info.children == 2 && info.descendants == 3);
+  assert(tree_remove(tree, "/c/") == ENOTEMPTY);
+  assert(tree_remove_recursive(tree, "/c/") == 0);
+  assert(tree_stat(tree, "/", &info) == 0);
+  assert(info.children == 1 && info.descendants == 1);
+  assert(tree_remove_recursive(tree, "/c/") == ENOENT);
+  assert(tree_remove_recursive(tree, "/") == EBUSY);
+  tree_free(tree);
+  tree = tree_open("main_journal", TREE_DURABILITY_BATCHED);
+  assert(tree != NULL);
+  list_content = tree_list(tree, "/");
+  assert(strcmp(list_content, "a") == 0);
+  free(list_content);
+  tree_free(tree);
+  remove("main_journal");
+  remove("main_journal.1");
+
+  tree = tree_new();
+  assert(tree_create(tree, "/a/") == 0);
+  assert(tree_create(tree, "/a/b/") == 0);
+  assert(tree_create(tree, "/a/b/c/") == 0);
+  assert(tree_create(tree, "/d/") == 0);
+  // Changes of children are counted at once, deeper ones in batches.
+  assert(tree_stat(tree, "/a/b/", &info) == 0 && info.descendants == 1);
+  assert(tree_move(tree, "/a/b/", "/d/b/") == 0);
+  tree_fold_counts(tree);
+  assert(tree_stat(tree, "/", &info) == 0);
+  assert(info.children == 2 && info.descendants == 4);
+  assert(tree_stat(tree, "/a/", &info) == 0 && info.descendants == 0);
+  assert(tree_stat(tree, "/d/", &info) == 0);
+  assert(info.children == 1 && info.descendants == 2);
+  assert(tree_stat(tree, "/x/", &info) == ENOENT);
+  assert(tree_stat(tree, "x", &info) == EINVAL);
   tree_free(tree);
+
+  tree = tree_new();
+  assert(tree_create(tree, "/a/") == 0);
+  assert(tree_create(tree, "/a/") == EEXIST);
+  assert(tree_stat(tree, "/b/", &info) == ENOENT);
+  TreeStats stats;
+  if (tree_stats(tree, &stats) == 0) {
+    assert(stats.ops[TREE_STATS_CREATE] == 2);
+    assert(stats.eexist[TREE_STATS_CREATE] == 1);
+    assert(stats.ops[TREE_STATS_STAT] == 1 && stats.enoent[TREE_STATS_STAT] == 1);
+  }
+  else {
+    assert(stats.ops[TREE_STATS_CREATE] == 0);
+  }
+  assert(tree_create(tree, "/c/") == 0);
+  run_testers(tree, create_own, NULL);
+  if (tree_stats(tree, &stats) == 0) {
+    assert(stats.ops[TREE_STATS_CREATE] == 3 + THREADS * ROUNDS);
+    assert(stats.ops[TREE_STATS_LIST] == THREADS * ROUNDS);
+    // Waits are counted for the operations that waited, lists only read.
+    TreeStatsOp idle[] = { TREE_STATS_REMOVE_RECURSIVE, TREE_STATS_MOVE, TREE_STATS_WALK };
+    for (size_t i = 0; i < sizeof(idle) / sizeof(idle[0]); i++)
+      assert(stats.reader_waits[idle[i]] == 0 && stats.writer_waits[idle[i]] == 0);
+    assert(stats.writer_waits[TREE_STATS_LIST] == 0);
+  }
+  tree_free(tree);
+
+  test_listing();
+  test_path_parsers();
+  test_path_cache();
+  test_moved_lookups();
+  test_remove_recursive();
+  test_watch();
+  test_recovery();
+  test_counts();
   printf("OK\n");
 }
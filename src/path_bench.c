@@ -0,0 +1,211 @@
+// Benchmark of path parsing. For several distributions of path lengths it
+// measures every implementation of parse_path supported by the CPU and the one
+// parse_path chooses by default (reported as "default"), reporting
+// time per path of validation alone and of parsing (validation and hashing of
+// folder names), and throughput of both. Before measuring, it checks that all
+// of them agree with the scalar one on generated paths and on random mutations
+// of them, both valid and invalid, placed at every alignment.
+//
+// Usage: ./path_bench [paths] [mutations]   (default: 20000 1000000)
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "path_utils.h"
+
+// Number of times every set of paths is parsed by every implementation.
+#define ROUNDS 10
+
+typedef struct {
+  const char* name;
+  int min_depth, max_depth;
+  int min_name, max_name; // lengths of folder names
+} Distribution;
+
+static const Distribution distributions[] = {
+  { "short", 1, 6, 1, 12 },         // typed by people
+  { "deep", 20, 200, 4, 16 },       // generated by programs
+  { "long names", 4, 16, 64, 255 }, // close to the length limit
+};
+
+// Index of parse_path itself, after all implementations.
+#define DEFAULT_PARSER (PATH_PARSER_AVX2 + 1)
+
+static const char* parser_names[] = { "scalar", "sse2", "avx2", "default" };
+
+static ParsedPath expected, actual;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static int random_between(uint64_t* rng, int min, int max) {
+  return min + next_random(rng) % (max - min + 1);
+}
+
+// Writes a random valid path from [d] to [path], starting it at a random
+// offset within the first 32 bytes, so that all alignments are used. Returns
+// pointer to the path.
+static char* make_path(char* path, const Distribution* d, uint64_t* rng) {
+  path += next_random(rng) % 32;
+  size_t length = 1;
+  path[0] = '/';
+  int depth = random_between(rng, d->min_depth, d->max_depth);
+  for (int i = 0; i < depth; i++) {
+    int name = random_between(rng, d->min_name, d->max_name);
+    if (length + name + 1 > MAX_PATH_LENGTH) break;
+    for (int j = 0; j < name; j++)
+      path[length++] = 'a' + next_random(rng) % 26;
+    path[length++] = '/';
+  }
+  path[length] = '\0';
+  return path;
+}
+
+// Changes [path] a little, so that it is probably invalid.
+static void mutate(char* path, uint64_t* rng) {
+  static const char characters[] = { '/', 'a', 'z', 'a' - 1, 'z' + 1, 'A', '\x80', '\xff', ' ' };
+  size_t length = strlen(path);
+  size_t i = next_random(rng) % (length + 1);
+  switch (next_random(rng) % 4) {
+    case 0: // truncate
+      path[i] = '\0';
+      break;
+    case 1: // replace one character
+      if (i < length) path[i] = characters[next_random(rng) % sizeof(characters)];
+      break;
+    case 2: // make a name too long
+      memmove(path + i + 256, path + i, length - i + 1);
+      memset(path + i, 'q', 256);
+      break;
+    default: // make the path too long
+      while (length <= MAX_PATH_LENGTH) {
+        path[length++] = 'x';
+        path[length++] = '/';
+      }
+      path[length] = '\0';
+      break;
+  }
+}
+
+static bool same_result(bool valid1, ParsedPath* p1, bool valid2, ParsedPath* p2) {
+  if (valid1 != valid2) return false;
+  if (!valid1) return true;
+  if (p1->length != p2->length || p1->depth != p2->depth) return false;
+  return memcmp(p1->names, p2->names, p1->depth * sizeof(PathName)) == 0;
+}
+
+// Parses [path] with implementation [p], or with parse_path (is_path_valid if
+// [parsed] is NULL) for DEFAULT_PARSER.
+static bool parse_with(int p, const char* path, ParsedPath* parsed) {
+  if (p != DEFAULT_PARSER) return parse_path_using(p, path, parsed);
+  return parsed ? parse_path(path, parsed) : is_path_valid(path);
+}
+
+// Checks all implementations against the scalar one on [path].
+static void check(const char* path) {
+  bool valid = parse_path_using(PATH_PARSER_SCALAR, path, &expected);
+  for (int p = PATH_PARSER_SSE2; p <= PATH_PARSER_AVX2; p++) {
+    if (!path_parser_supported(p)) continue;
+    bool result = parse_path_using(p, path, &actual);
+    if (!same_result(valid, &expected, result, &actual)) {
+      printf("%s disagrees with scalar on \"%s\"\n", parser_names[p], path);
+      exit(1);
+    }
+    if (result)
+      path_destroy(&actual);
+  }
+  if (is_path_valid(path) != valid) {
+    printf("is_path_valid disagrees with scalar on \"%s\"\n", path);
+    exit(1);
+  }
+  if (valid)
+    path_destroy(&expected);
+}
+
+static void fuzz(long mutations) {
+  static char buffer[2 * MAX_PATH_LENGTH];
+  uint64_t rng = 88172645463325252ULL;
+  for (long i = 0; i < mutations; i++) {
+    const Distribution* d = &distributions[i % (sizeof(distributions) / sizeof(Distribution))];
+    char* path = make_path(buffer, d, &rng);
+    check(path);
+    mutate(path, &rng);
+    check(path);
+  }
+  printf("%ld mutated paths checked\n", mutations);
+}
+
+static void bench(const Distribution* d, long count) {
+  char** paths = malloc(count * sizeof(char*));
+  size_t total_length = 0;
+  uint64_t rng = 2463534242ULL;
+  char buffer[MAX_PATH_LENGTH + 32];
+  for (long i = 0; i < count; i++) {
+    // Path is copied to the same random offset from an aligned address.
+    size_t offset = make_path(buffer, d, &rng) - buffer;
+    size_t length = strlen(buffer + offset);
+    char* copy = aligned_alloc(32, (offset + length + 32) / 32 * 32);
+    memcpy(copy + offset, buffer + offset, length + 1);
+    paths[i] = copy + offset;
+    total_length += length;
+  }
+
+  printf("%-10s  mean length %4.0f   validate ns/path    GB/s   parse ns/path    GB/s\n",
+         d->name, (double) total_length / count);
+  for (int p = PATH_PARSER_SCALAR; p <= DEFAULT_PARSER; p++) {
+    if (p != DEFAULT_PARSER && !path_parser_supported(p)) continue;
+    double seconds[2];
+    for (int hashing = 0; hashing < 2; hashing++) {
+      long valid = 0;
+      double start = now();
+      for (int round = 0; round < ROUNDS; round++) {
+        for (long i = 0; i < count; i++) {
+          if (!hashing) {
+            valid += parse_with(p, paths[i], NULL);
+          } else if (parse_with(p, paths[i], &actual)) {
+            path_destroy(&actual);
+            valid++;
+          }
+        }
+      }
+      seconds[hashing] = now() - start;
+      if (valid != ROUNDS * count) {
+        printf("%s rejected valid paths\n", parser_names[p]);
+        exit(1);
+      }
+    }
+    printf("  %-8s %30.1f %8.2f %15.1f %8.2f\n", parser_names[p],
+           seconds[0] * 1e9 / (ROUNDS * count), ROUNDS * total_length / seconds[0] * 1e-9,
+           seconds[1] * 1e9 / (ROUNDS * count), ROUNDS * total_length / seconds[1] * 1e-9);
+  }
+
+  for (long i = 0; i < count; i++)
+    free(paths[i] - ((uintptr_t) paths[i] % 32));
+  free(paths);
+}
+
+int main(int argc, char** argv) {
+  long count = argc > 1 ? atol(argv[1]) : 20000;
+  long mutations = argc > 2 ? atol(argv[2]) : 1000000;
+
+  fuzz(mutations);
+  for (size_t i = 0; i < sizeof(distributions) / sizeof(Distribution); i++)
+    bench(&distributions[i], count);
+
+  return 0;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "HashMap.h"
 
@@ -10,12 +12,79 @@
 // Max length of folder name (excluding terminating null character).
 #define MAX_FOLDER_NAME_LENGTH 255
 
+// Max number of folder names in a valid path.
+#define MAX_PATH_DEPTH (MAX_PATH_LENGTH / 2)
+
+// A folder name in a parsed path.
+typedef struct PathName {
+  unsigned int hash; // Equal to hmap_hash of the name.
+  uint16_t offset;   // Index of the first character of the name in the path.
+  uint16_t length;
+} PathName;
+
+// Number of folder names a parsed path holds without allocating memory.
+#define PATH_INLINE_DEPTH 32
+
+// A valid path split into folder names. The path itself is not copied. Names
+// of deeper paths are kept in allocated memory, so a parsed path cannot be
+// copied and has to be freed by `path_destroy`.
+typedef struct ParsedPath {
+  const char* path;
+  size_t length;
+  int depth;       // Number of folder names, 0 for "/".
+  int capacity;    // Number of names `names` can hold.
+  PathName* names; // `inline_names` or allocated memory.
+  PathName inline_names[PATH_INLINE_DEPTH];
+} ParsedPath;
+
 // Return whether a path is valid.
 // Valid paths are '/'-separated sequences of folder names, always starting and ending with '/'.
 // Valid paths have length at most MAX_PATH_LENGTH (and at least 1). Valid folder names are are
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
+// Check whether `path` is valid (see `is_path_valid`) and, if it is, split it
+// into `parsed`. The path is validated and split in one scan, and then every
+// name found is read once more to hash it for the maps of children. Nothing is
+// allocated for paths of up to PATH_INLINE_DEPTH names, so `parsed` is
+// usually a local variable. If the path is valid, `parsed` has to be freed by
+// `path_destroy`.
+bool parse_path(const char* path, ParsedPath* parsed);
+
+// Free memory allocated by parsing a path into `parsed`. Its `path` and
+// `length` can still be used.
+void path_destroy(ParsedPath* parsed);
+
+// Implementations of `parse_path` and `is_path_valid`, which use scalar for
+// short paths and SSE2 for the others. Vectorized ones classify a block of
+// characters at a time and find folder names from a bitmask of '/' characters
+// in it.
+typedef enum PathParser {
+  PATH_PARSER_SCALAR, // One character at a time, supported everywhere.
+  PATH_PARSER_SSE2,   // 32 characters at a time, as two 16-byte halves.
+  PATH_PARSER_AVX2,   // 32 characters at a time.
+} PathParser;
+
+// Return whether `parser` can be used on this CPU.
+bool path_parser_supported(PathParser parser);
+
+// The same as `parse_path`, using `parser`, which should be supported. If
+// `parsed` is NULL, only checks whether `path` is valid, without hashing names.
+bool parse_path_using(PathParser parser, const char* path, ParsedPath* parsed);
+
+// Return the `i`-th (counting from 0) folder name of `parsed` as a key of the
+// maps of children.
+HashMapKey path_name_key(const ParsedPath* parsed, int i);
+
+// Return length of the prefix of `parsed` being the path to the folder at
+// `depth`, that is the path made of the first `depth` folder names.
+size_t path_prefix_length(const ParsedPath* parsed, int depth);
+
+// Return the depth of the lowest common ancestor of the folders at `depth1` in
+// `path1` and at `depth2` in `path2`, that is the number of leading folder
+// names they share.
+int path_common_depth(const ParsedPath* path1, int depth1, const ParsedPath* path2, int depth2);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).
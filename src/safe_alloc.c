@@ -20,3 +20,12 @@ void* safe_calloc(size_t num, size_t size) {
 
   return ptr;
 }
+
+void* safe_realloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+
+  if (ptr == NULL)
+    fatal("Error in allocation.");
+
+  return ptr;
+}
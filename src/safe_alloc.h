@@ -5,3 +5,5 @@
 void* safe_malloc(size_t size);
 
 void* safe_calloc(size_t num, size_t size);
+
+void* safe_realloc(void* ptr, size_t size);
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+#include "err.h"
+#include "safe_alloc.h"
+
+// Number of trees every thread keeps its shard of at hand. A thread that
+// evicts a shard, to count for another tree, gets a new one when it comes
+// back, while the old one is still collected.
+#define THREAD_SHARDS 4
+
+// Counters are written only by the owner of their shard and read by
+// stats_collect, so they are incremented without read-modify-write.
+struct StatsShard {
+  alignas(64) atomic_ulong ops[TREE_STATS_OPS];
+  atomic_ulong enoent[TREE_STATS_OPS];
+  atomic_ulong eexist[TREE_STATS_OPS];
+  atomic_ulong enotempty[TREE_STATS_OPS];
+  atomic_ulong waits[TREE_STATS_OPS][2]; // of readers and writers
+  atomic_ulong wait_ns[TREE_STATS_OPS][2];
+  atomic_ulong histograms[TREE_STATS_OPS][2][TREE_STATS_BUCKETS];
+  StatsShard* next;             // next shard of the same Stats
+};
+
+struct Stats {
+  unsigned long id;             // never reused, identifies stats in threads' caches
+  pthread_mutex_t lock;         // protects [shards]
+  StatsShard* shards;
+};
+
+typedef struct CachedShard {
+  unsigned long stats_id;       // 0 if unused
+  StatsShard* shard;
+} CachedShard;
+
+static atomic_ulong next_id = 1;
+static _Thread_local CachedShard cached_shards[THREAD_SHARDS];
+static _Thread_local int next_victim = 0;
+static _Thread_local StatsShard* current = NULL; // shard counting waits
+static _Thread_local TreeStatsOp current_op;      // operation they are counted for
+
+static void increase(atomic_ulong* counter, unsigned long value) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                        memory_order_relaxed);
+}
+
+Stats* stats_new() {
+  Stats* stats = (Stats*) safe_malloc(sizeof(Stats));
+  stats->id = atomic_fetch_add(&next_id, 1);
+  if (pthread_mutex_init(&stats->lock, 0) != 0)
+    fatal("mutex init failed");
+  stats->shards = NULL;
+  return stats;
+}
+
+void stats_free(Stats* stats) {
+  while (stats->shards != NULL) {
+    StatsShard* next = stats->shards->next;
+    free(stats->shards);
+    stats->shards = next;
+  }
+  if (pthread_mutex_destroy(&stats->lock) != 0)
+    fatal("mutex destroy failed");
+  free(stats);
+}
+
+// Returns calling thread's shard of [stats].
+static StatsShard* get_shard(Stats* stats) {
+  for (int i = 0; i < THREAD_SHARDS; i++) {
+    if (cached_shards[i].stats_id == stats->id) return cached_shards[i].shard;
+  }
+
+  // Shard of the evicted stats is not touched, as they may have been freed.
+  CachedShard* cached = NULL;
+  for (int i = 0; i < THREAD_SHARDS && cached == NULL; i++) {
+    if (cached_shards[i].stats_id == 0) cached = &cached_shards[i];
+  }
+  if (cached == NULL) {
+    cached = &cached_shards[next_victim];
+    next_victim = (next_victim + 1) % THREAD_SHARDS;
+  }
+
+  // Shards are aligned, so that no two threads write the same cache line.
+  StatsShard* shard = (StatsShard*) aligned_alloc(alignof(StatsShard), sizeof(StatsShard));
+  if (shard == NULL)
+    fatal("aligned_alloc failed");
+  for (int op = 0; op < TREE_STATS_OPS; op++) {
+    atomic_init(&shard->ops[op], 0);
+    atomic_init(&shard->enoent[op], 0);
+    atomic_init(&shard->eexist[op], 0);
+    atomic_init(&shard->enotempty[op], 0);
+    for (int kind = 0; kind < 2; kind++) {
+      atomic_init(&shard->waits[op][kind], 0);
+      atomic_init(&shard->wait_ns[op][kind], 0);
+      for (int i = 0; i < TREE_STATS_BUCKETS; i++)
+        atomic_init(&shard->histograms[op][kind][i], 0);
+    }
+  }
+
+  if (pthread_mutex_lock(&stats->lock) != 0)
+    fatal("lock failed");
+  shard->next = stats->shards;
+  stats->shards = shard;
+  if (pthread_mutex_unlock(&stats->lock) != 0)
+    fatal("unlock failed");
+
+  cached->stats_id = stats->id;
+  cached->shard = shard;
+  return shard;
+}
+
+StatsScope stats_start(Stats* stats, TreeStatsOp op) {
+  StatsScope scope;
+  scope.shard = get_shard(stats);
+  scope.previous = current;
+  scope.previous_op = current_op;
+  current = scope.shard;
+  current_op = op;
+  return scope;
+}
+
+void stats_switch(TreeStatsOp op) {
+  current_op = op;
+}
+
+void stats_count(StatsScope* scope, TreeStatsOp op, int result) {
+  increase(&scope->shard->ops[op], 1);
+  if (result == ENOENT)
+    increase(&scope->shard->enoent[op], 1);
+  else if (result == EEXIST)
+    increase(&scope->shard->eexist[op], 1);
+  else if (result == ENOTEMPTY)
+    increase(&scope->shard->enotempty[op], 1);
+}
+
+void stats_finish(StatsScope* scope) {
+  current = scope->previous;
+  current_op = scope->previous_op;
+}
+
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_count_wait(bool as_reader, uint64_t start) {
+  if (current == NULL) return;
+
+  uint64_t nanoseconds = stats_now() - start;
+  int bucket = nanoseconds == 0 ? 0 : 63 - __builtin_clzll(nanoseconds);
+  if (bucket >= TREE_STATS_BUCKETS) bucket = TREE_STATS_BUCKETS - 1;
+
+  int kind = as_reader ? 0 : 1;
+  increase(&current->waits[current_op][kind], 1);
+  increase(&current->wait_ns[current_op][kind], nanoseconds);
+  increase(&current->histograms[current_op][kind][bucket], 1);
+}
+
+void stats_collect(Stats* stats, TreeStats* result) {
+  if (pthread_mutex_lock(&stats->lock) != 0)
+    fatal("lock failed");
+  for (StatsShard* shard = stats->shards; shard != NULL; shard = shard->next) {
+    for (int op = 0; op < TREE_STATS_OPS; op++) {
+      result->ops[op] += atomic_load_explicit(&shard->ops[op], memory_order_relaxed);
+      result->enoent[op] += atomic_load_explicit(&shard->enoent[op], memory_order_relaxed);
+      result->eexist[op] += atomic_load_explicit(&shard->eexist[op], memory_order_relaxed);
+      result->enotempty[op] += atomic_load_explicit(&shard->enotempty[op], memory_order_relaxed);
+      result->reader_waits[op] += atomic_load_explicit(&shard->waits[op][0], memory_order_relaxed);
+      result->writer_waits[op] += atomic_load_explicit(&shard->waits[op][1], memory_order_relaxed);
+      result->reader_wait_ns[op] += atomic_load_explicit(&shard->wait_ns[op][0],
+                                                         memory_order_relaxed);
+      result->writer_wait_ns[op] += atomic_load_explicit(&shard->wait_ns[op][1],
+                                                         memory_order_relaxed);
+      for (int i = 0; i < TREE_STATS_BUCKETS; i++) {
+        result->reader_wait_histogram[op][i] +=
+            atomic_load_explicit(&shard->histograms[op][0][i], memory_order_relaxed);
+        result->writer_wait_histogram[op][i] +=
+            atomic_load_explicit(&shard->histograms[op][1][i], memory_order_relaxed);
+      }
+    }
+  }
+  if (pthread_mutex_unlock(&stats->lock) != 0)
+    fatal("unlock failed");
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Tree.h"
+
+// Counters of operations on a tree and of waits of threads doing them to enter
+// nodes, used only if built with TREE_STATS. Every thread counts in its own
+// shard, so counting writes only memory of calling thread, and stats_collect
+// sums all shards. All functions except stats_new and stats_free can be
+// called concurrently.
+typedef struct Stats Stats;
+
+typedef struct StatsShard StatsShard;
+
+// Shard an operation counts in and the one counted in before it, if the
+// operation is called by another one, with operations their waits are counted
+// for.
+typedef struct StatsScope {
+  StatsShard* shard;
+  StatsShard* previous;
+  TreeStatsOp previous_op;
+} StatsScope;
+
+Stats* stats_new();
+
+// Frees [stats] with all its shards. No one can use [stats] concurrently.
+void stats_free(Stats* stats);
+
+// Makes calling thread count waits in its shard of [stats] as waits of [op],
+// until stats_finish with the returned scope.
+StatsScope stats_start(Stats* stats, TreeStatsOp op);
+
+// Makes calling thread count waits as waits of [op] from now on, within the
+// scope of the last stats_start.
+void stats_switch(TreeStatsOp op);
+
+// Counts operation [op] with [result] in shard of [scope].
+void stats_count(StatsScope* scope, TreeStatsOp op, int result);
+
+// Makes calling thread count waits as before stats_start returned [scope].
+void stats_finish(StatsScope* scope);
+
+// Returns current time in nanoseconds, to be passed to stats_count_wait.
+uint64_t stats_now();
+
+// Counts a wait of calling thread to enter a node as a reader or a writer,
+// which started at [start], for the operation calling thread does, if any.
+void stats_count_wait(bool as_reader, uint64_t start);
+
+// Adds counters of all shards of [stats] to [*result].
+void stats_collect(Stats* stats, TreeStats* result);
@@ -0,0 +1,456 @@
+// Multithreaded benchmark of the folder tree. Threads run a random mix of
+// operations against one shared tree for a given time and report throughput
+// and latency percentiles of every kind of operation.
+//
+// Paths operated on are slots of a full tree with given fan-out and depth,
+// which is created before measuring. Every operation picks its slots with
+// uniform or Zipf distribution over all slots, so creates fill holes made by
+// removes and moves, and the tree keeps roughly its shape. A folder is moved to
+// a slot at the same depth, so its subtree stays within slots.
+//
+// Usage: ./tree_bench [options]
+//   -t threads     number of threads (default: 4)
+//   -d seconds     run time (default: 3)
+//   -f fanout      children of every folder in the initial tree (default: 8)
+//   -D depth       depth of the initial tree (default: 4)
+//   -m l:c:r:m     ratio of list, create, remove and move (default: 70:10:10:10)
+//   -z theta       Zipf skew of slots, 0 for uniform (default: 0)
+//   -M movers      additional threads moving folders between children of the
+//                  root, each its own folder (default: 0)
+//   -c entries     enable path cache with this many entries (default: off)
+//   -s seed        random seed (default: 1)
+//   -o format      text, csv or json (default: text)
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Tree.h"
+
+// Latencies are counted in a log-linear histogram: every power of two of
+// nanoseconds is split into SUB_BUCKETS buckets, which bounds the error of
+// reported percentiles by 1/SUB_BUCKETS.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+// XMOVE is a move done by additional threads, never picked by the mix.
+typedef enum Op { LIST, CREATE, REMOVE, MOVE, XMOVE, OPS } Op;
+
+static const char* op_names[OPS] = { "list", "create", "remove", "move", "xmove" };
+
+typedef struct Stats {
+  unsigned long count;
+  unsigned long succeeded;
+  unsigned long histogram[BUCKETS];
+} Stats;
+
+typedef struct Config {
+  int threads;
+  double seconds;
+  int fanout;
+  int depth;
+  int mix[OPS];      // weights of operations
+  int movers;
+  double theta;
+  size_t cache;
+  unsigned long seed;
+  const char* format;
+} Config;
+
+static Config config = { 4, 3, 8, 4, { 70, 10, 10, 10, 0 }, 0, 0, 0, 1, "text" };
+
+static Tree* tree;
+static char** paths;   // paths of all slots
+static size_t slots;   // number of slots
+static size_t* levels; // index of the first slot at every depth, and [slots]
+static double* cdf;    // cumulative distribution of slots, NULL if uniform
+static size_t* ranked; // slot of every Zipf rank
+
+static atomic_bool started = false;
+static atomic_bool stopped = false;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_unit(uint64_t* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int bucket_of(uint64_t ns) {
+  if (ns < SUB_BUCKETS) return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((ns >> shift) & (SUB_BUCKETS - 1));
+}
+
+// Upper bound of latencies counted in [bucket].
+static uint64_t bucket_limit(int bucket) {
+  if (bucket < SUB_BUCKETS) return bucket;
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t base = (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return base + ((uint64_t) 1 << shift) - 1;
+}
+
+static uint64_t percentile(Stats* stats, double p) {
+  unsigned long wanted = (unsigned long) ceil(stats->count * p);
+  unsigned long seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += stats->histogram[i];
+    if (seen >= wanted && seen > 0) return bucket_limit(i);
+  }
+  return 0;
+}
+
+// Appends name of [index]-th child to [path] of length [length].
+static size_t append_name(char* path, size_t length, int index) {
+  do {
+    path[length++] = 'a' + index % 26;
+    index /= 26;
+  } while (index > 0);
+  path[length++] = '/';
+  path[length] = '\0';
+  return length;
+}
+
+// Fills [paths] with slots of a full tree, parents before children.
+static void make_slots() {
+  slots = 0;
+  size_t level = 1;
+  for (int d = 0; d < config.depth; ++d) {
+    level *= config.fanout;
+    slots += level;
+  }
+  paths = malloc(slots * sizeof(char*));
+  levels = malloc((config.depth + 1) * sizeof(size_t));
+
+  size_t count = 0;
+  size_t level_start = 0;
+  size_t level_size = 1;
+  for (int d = 0; d < config.depth; ++d) {
+    levels[d] = count;
+    for (size_t p = 0; p < level_size; ++p) {
+      const char* parent = d == 0 ? "/" : paths[level_start + p];
+      for (int i = 0; i < config.fanout; ++i) {
+        char path[4096];
+        strcpy(path, parent);
+        append_name(path, strlen(path), i);
+        paths[count++] = strdup(path);
+      }
+    }
+    level_start = d == 0 ? 0 : level_start + level_size;
+    level_size *= config.fanout;
+  }
+  levels[config.depth] = slots;
+}
+
+static void make_distribution(uint64_t* rng) {
+  if (config.theta <= 0) return;
+
+  cdf = malloc(slots * sizeof(double));
+  double sum = 0;
+  for (size_t i = 0; i < slots; ++i) {
+    sum += 1 / pow(i + 1, config.theta);
+    cdf[i] = sum;
+  }
+  for (size_t i = 0; i < slots; ++i)
+    cdf[i] /= sum;
+
+  // Hot slots are scattered over the whole tree, not only its top.
+  ranked = malloc(slots * sizeof(size_t));
+  for (size_t i = 0; i < slots; ++i)
+    ranked[i] = i;
+  for (size_t i = slots - 1; i > 0; --i) {
+    size_t j = next_random(rng) % (i + 1);
+    size_t tmp = ranked[i];
+    ranked[i] = ranked[j];
+    ranked[j] = tmp;
+  }
+}
+
+static size_t pick_slot(uint64_t* rng) {
+  if (cdf == NULL) return next_random(rng) % slots;
+
+  double u = next_unit(rng);
+  size_t low = 0;
+  size_t high = slots - 1;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (cdf[mid] < u)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return ranked[low];
+}
+
+static Op pick_op(uint64_t* rng) {
+  int total = 0;
+  for (int i = 0; i < OPS; ++i)
+    total += config.mix[i];
+  int r = next_random(rng) % total;
+  for (int i = 0; i < OPS; ++i) {
+    if (r < config.mix[i]) return i;
+    r -= config.mix[i];
+  }
+  return LIST;
+}
+
+// Returns random slot at the same depth as [slot].
+static size_t pick_slot_at_depth_of(size_t slot, uint64_t* rng) {
+  int d = 0;
+  while (levels[d + 1] <= slot) d++;
+  return levels[d] + next_random(rng) % (levels[d + 1] - levels[d]);
+}
+
+// Runs [op] on random slots and returns true if it succeeded.
+static bool run_op(Op op, uint64_t* rng) {
+  size_t slot = pick_slot(rng);
+  const char* path = paths[slot];
+  switch (op) {
+    case LIST: {
+      char* list = tree_list(tree, path);
+      free(list);
+      return list != NULL;
+    }
+    case CREATE:
+      return tree_create(tree, path) == 0;
+    case REMOVE:
+      return tree_remove(tree, path) == 0;
+    case MOVE:
+      return tree_move(tree, path, paths[pick_slot_at_depth_of(slot, rng)]) == 0;
+    default:
+      return false;
+  }
+}
+
+typedef struct Worker {
+  pthread_t thread;
+  uint64_t rng;
+  char* folders[2]; // for movers, the folder in both of its places
+  int moves;        // for movers, number of moves done
+  Stats stats[OPS];
+} Worker;
+
+// Moves the folder of mover [w] to its other place.
+static bool run_xmove(Worker* w) {
+  int from = w->moves % 2;
+  bool succeeded = tree_move(tree, w->folders[from], w->folders[1 - from]) == 0;
+  w->moves += succeeded;
+  return succeeded;
+}
+
+static void* worker(void* arg) {
+  Worker* w = arg;
+  while (!atomic_load(&started));
+
+  while (!atomic_load_explicit(&stopped, memory_order_relaxed)) {
+    Op op = w->folders[0] != NULL ? XMOVE : pick_op(&w->rng);
+    uint64_t start = now_ns();
+    bool succeeded = op == XMOVE ? run_xmove(w) : run_op(op, &w->rng);
+    uint64_t latency = now_ns() - start;
+
+    Stats* stats = &w->stats[op];
+    stats->count++;
+    stats->succeeded += succeeded;
+    stats->histogram[bucket_of(latency)]++;
+  }
+  return NULL;
+}
+
+static void add_stats(Stats* to, Stats* from) {
+  to->count += from->count;
+  to->succeeded += from->succeeded;
+  for (int i = 0; i < BUCKETS; ++i)
+    to->histogram[i] += from->histogram[i];
+}
+
+static void print_results(Stats* total, double seconds) {
+  bool csv = strcmp(config.format, "csv") == 0;
+  bool json = strcmp(config.format, "json") == 0;
+
+  if (csv) {
+    printf("op,threads,seconds,ops,succeeded,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+  }
+  else if (json) {
+    printf("{\"threads\": %d, \"seconds\": %.3f, \"fanout\": %d, \"depth\": %d, "
+           "\"mix\": [%d, %d, %d, %d], \"movers\": %d, \"theta\": %g, \"cache\": %zu, "
+           "\"seed\": %lu, \"ops\": [",
+           config.threads, seconds, config.fanout, config.depth, config.mix[LIST],
+           config.mix[CREATE], config.mix[REMOVE], config.mix[MOVE], config.movers,
+           config.theta, config.cache, config.seed);
+  }
+  else {
+    printf("%d threads, %d movers, %.1f s, fanout %d, depth %d, theta %g\n",
+           config.threads, config.movers, seconds, config.fanout, config.depth, config.theta);
+    printf("%-8s %12s %10s %14s %10s %10s %10s\n",
+           "op", "ops", "succeeded", "ops/s", "p50 ns", "p99 ns", "p999 ns");
+  }
+
+  bool first = true;
+  for (int op = 0; op <= OPS; ++op) {
+    Stats* s = &total[op];
+    const char* name = op == OPS ? "all" : op_names[op];
+    if (op < OPS && s->count == 0) continue;
+    uint64_t p50 = percentile(s, 0.5);
+    uint64_t p99 = percentile(s, 0.99);
+    uint64_t p999 = percentile(s, 0.999);
+    double rate = s->count / seconds;
+
+    if (csv) {
+      printf("%s,%d,%.3f,%lu,%lu,%.0f,%lu,%lu,%lu\n", name, config.threads, seconds,
+             s->count, s->succeeded, rate, p50, p99, p999);
+    }
+    else if (json) {
+      printf("%s{\"op\": \"%s\", \"ops\": %lu, \"succeeded\": %lu, \"ops_per_sec\": %.0f, "
+             "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu}",
+             first ? "" : ", ", name, s->count, s->succeeded, rate, p50, p99, p999);
+    }
+    else {
+      printf("%-8s %12lu %10lu %14.0f %10lu %10lu %10lu\n",
+             name, s->count, s->succeeded, rate, p50, p99, p999);
+    }
+    first = false;
+  }
+
+  if (json) printf("]}\n");
+}
+
+// Prints waits to enter nodes of every kind of operation that waited, if the
+// tree was built with TREE_STATS.
+static void print_waits(Tree* tree) {
+  static const char* names[TREE_STATS_OPS] = {
+    "list", "create", "remove", "remove_recursive", "move", "walk", "stat"
+  };
+  TreeStats stats;
+  if (strcmp(config.format, "text") != 0 || tree_stats(tree, &stats) != 0) return;
+  for (int op = 0; op < TREE_STATS_OPS; op++) {
+    unsigned long reader_waits = stats.reader_waits[op], writer_waits = stats.writer_waits[op];
+    if (reader_waits == 0 && writer_waits == 0) continue;
+    printf("waits of %s: %lu as reader, %.0f ns mean; %lu as writer, %.0f ns mean\n", names[op],
+           reader_waits,
+           reader_waits == 0 ? 0.0 : (double) stats.reader_wait_ns[op] / reader_waits,
+           writer_waits,
+           writer_waits == 0 ? 0.0 : (double) stats.writer_wait_ns[op] / writer_waits);
+  }
+}
+
+// Creates two children of the root for [index]-th mover [w] and its folder in
+// the first one. Their names cannot collide with slots of any sensible size.
+static void make_mover(Worker* w, int index) {
+  for (int i = 0; i < 2; ++i) {
+    char path[64];
+    size_t length = append_name(strcpy(path, i == 0 ? "/zzzs" : "/zzzt"), 5, index);
+    tree_create(tree, path);
+    w->folders[i] = malloc(length + 3);
+    strcpy(w->folders[i], path);
+    strcat(w->folders[i], "f/");
+  }
+  tree_create(tree, w->folders[0]);
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-f fanout] [-D depth] "
+                  "[-m list:create:remove:move] [-M movers] [-z theta] [-c entries] [-s seed] "
+                  "[-o text|csv|json]\n", program);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:f:D:m:M:z:c:s:o:")) != -1) {
+    switch (opt) {
+      case 't': config.threads = atoi(optarg); break;
+      case 'd': config.seconds = atof(optarg); break;
+      case 'f': config.fanout = atoi(optarg); break;
+      case 'D': config.depth = atoi(optarg); break;
+      case 'm':
+        if (sscanf(optarg, "%d:%d:%d:%d", &config.mix[LIST], &config.mix[CREATE],
+                   &config.mix[REMOVE], &config.mix[MOVE]) != 4)
+          usage(argv[0]);
+        break;
+      case 'M': config.movers = atoi(optarg); break;
+      case 'z': config.theta = atof(optarg); break;
+      case 'c': config.cache = strtoul(optarg, NULL, 10); break;
+      case 's': config.seed = strtoul(optarg, NULL, 10); break;
+      case 'o': config.format = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (config.threads < 0 || config.movers < 0 || config.threads + config.movers < 1 || config.fanout < 1 || config.depth < 1 || config.seconds <= 0 ||
+      config.mix[LIST] + config.mix[CREATE] + config.mix[REMOVE] + config.mix[MOVE] <= 0)
+    usage(argv[0]);
+
+  uint64_t rng = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+  make_slots();
+  make_distribution(&rng);
+
+  tree = tree_new();
+  if (config.cache > 0) tree_enable_path_cache(tree, config.cache);
+  for (size_t i = 0; i < slots; ++i)
+    tree_create(tree, paths[i]);
+
+  int workers_count = config.threads + config.movers;
+  Worker* workers = calloc(workers_count, sizeof(Worker));
+  for (int i = config.threads; i < workers_count; ++i)
+    make_mover(&workers[i], i - config.threads);
+  for (int i = 0; i < workers_count; ++i) {
+    workers[i].rng = next_random(&rng) | 1;
+    pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+  }
+
+  uint64_t start = now_ns();
+  atomic_store(&started, true);
+  struct timespec duration = { (time_t) config.seconds,
+                               (long) ((config.seconds - (time_t) config.seconds) * 1e9) };
+  nanosleep(&duration, NULL);
+  atomic_store(&stopped, true);
+  for (int i = 0; i < workers_count; ++i)
+    pthread_join(workers[i].thread, NULL);
+  double seconds = (now_ns() - start) * 1e-9;
+
+  Stats* total = calloc(OPS + 1, sizeof(Stats));
+  for (int i = 0; i < workers_count; ++i) {
+    for (int op = 0; op < OPS; ++op) {
+      add_stats(&total[op], &workers[i].stats[op]);
+      add_stats(&total[OPS], &workers[i].stats[op]);
+    }
+  }
+  print_results(total, seconds);
+  print_waits(tree);
+
+  tree_free(tree);
+  for (size_t i = 0; i < slots; ++i)
+    free(paths[i]);
+  free(paths);
+  free(levels);
+  for (int i = 0; i < workers_count; ++i) {
+    free(workers[i].folders[0]);
+    free(workers[i].folders[1]);
+  }
+  free(cdf);
+  free(ranked);
+  free(workers);
+  free(total);
+  return 0;
+}